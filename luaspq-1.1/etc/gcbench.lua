@@ -0,0 +1,53 @@
+-- gcbench.lua: compare the incremental and generational collectors.
+-- usage: luaspq gcbench.lua [rounds] [heap size]
+--
+-- Keeps a large, long-lived heap while allocating many short-lived
+-- objects, the pattern generational mode is meant for. Each mode runs
+-- in a fresh cycle over the same workload.
+
+local rounds = tonumber(arg and arg[1]) or 200
+local heapsize = tonumber(arg and arg[2]) or 200000
+
+local function buildheap (n)
+  local heap = {}
+  for i = 1, n do
+    heap[i] = {i, tostring(i), {x = i}}
+  end
+  return heap
+end
+
+local function churn (heap, rounds)
+  local sum = 0
+  for r = 1, rounds do
+    local tmp = {}
+    for i = 1, 2000 do
+      tmp[i] = {r, i, "t" .. i}
+    end
+    for i = 1, #tmp do sum = sum + tmp[i][2] end
+    -- a few young objects become reachable from the old heap
+    local k = r % #heap + 1
+    heap[k][3] = {x = r, tmp[1]}
+  end
+  return sum
+end
+
+local function run (mode)
+  collectgarbage("collect")
+  collectgarbage(mode)
+  local heap = buildheap(heapsize)
+  local t0 = os.clock()
+  local sum = churn(heap, rounds)
+  local t = os.clock() - t0
+  local kb = collectgarbage("count")
+  heap = nil
+  collectgarbage("incremental")
+  collectgarbage("collect")
+  return t, kb, sum
+end
+
+local ti, ki, si = run("incremental")
+local tg, kg, sg = run("generational")
+assert(si == sg)
+print(string.format("%-14s %8.3fs %10.0f KB", "incremental", ti, ki))
+print(string.format("%-14s %8.3fs %10.0f KB", "generational", tg, kg))
+print(string.format("speedup        %8.2fx", ti / tg))
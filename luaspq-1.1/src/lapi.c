@@ -342,6 +342,25 @@ LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
 }
 
 
+/*
+** Writes the number at 'idx' into 'buff' (with room for LUA_NUMBUFFSIZE
+** bytes) without creating a string: integers in decimal, floats as
+** "%.<prec>g" or, if 'prec' is negative, as LUA_NUMBER_FMT. Returns the
+** length written, or 0 if the value is not a number.
+*/
+LUA_API size_t lua_numbertobuff (lua_State *L, int idx, char *buff,
+                                 int prec) {
+  const TValue *o = index2addr(L, idx);
+  api_check(L, prec <= 20, "precision too large");
+  if (ttisinteger(o))
+    return luaO_int2str(buff, ivalue(o));
+  else if (ttisfloat(o))
+    return luaO_num2str(buff, fltvalue(o), prec);
+  else
+    return 0;
+}
+
+
 LUA_API lua_Number lua_tonumberx (lua_State *L, int idx, int *pisnum) {
   lua_Number n;
   const TValue *o = index2addr(L, idx);
@@ -383,6 +402,13 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
     luaO_tostring(L, o);
     lua_unlock(L);
   }
+  else if (!isterminated(tsvalue(o))) {  /* slice inside another string? */
+    lua_lock(L);  /* 'luaS_ownslice' copies its bytes */
+    luaC_checkGC(L);
+    o = index2addr(L, idx);
+    luaS_ownslice(L, tsvalue(o));
+    lua_unlock(L);
+  }
   if (len != NULL)
     *len = vslen(o);
   return svalue(o);
@@ -488,6 +514,30 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+/*
+** Pushes the substring of the string at 'idx' with 'len' bytes starting
+** at offset 'off'. Long substrings may share the bytes of the original
+** string instead of copying them (see 'luaS_newsubstr'); so, the
+** returned bytes may not be followed by a '\0' ('lua_tolstring' on the
+** new string gives a C string).
+*/
+LUA_API const char *lua_pushsubstr (lua_State *L, int idx, size_t off,
+                                                           size_t len) {
+  TString *ts;
+  StkId o;
+  lua_lock(L);
+  luaC_checkGC(L);
+  o = index2addr(L, idx);
+  api_check(L, ttisstring(o), "string expected");
+  api_check(L, off <= vslen(o) && len <= vslen(o) - off, "invalid substring");
+  ts = luaS_newsubstr(L, tsvalue(o), off, len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  lua_unlock(L);
+  return getstr(ts);
+}
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
   lua_lock(L);
   if (s == NULL)
@@ -563,6 +613,7 @@ LUA_API void lua_pushboolean (lua_State *L, int b) {
 
 LUA_API void lua_pushlightuserdata (lua_State *L, void *p) {
   lua_lock(L);
+  api_check(L, ptrfits(p), "pointer does not fit in a value");
   setpvalue(L->top, p);
   api_incr_top(L);
   lua_unlock(L);
@@ -624,6 +675,36 @@ LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
 }
 
 
+/*
+** Like 'lua_getfield', for a key with explicit length. When 't' is a
+** table the key is looked up by its contents, so that no string is
+** created unless an '__index' metamethod needs it.
+*/
+LUA_API int lua_getlfield (lua_State *L, int idx, const char *k,
+                                                 size_t len) {
+  StkId t;
+  const TValue *aux = NULL;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  if (ttistable(t)) {
+    aux = luaH_getlstr(hvalue(t), k, len, luaS_hash(k, len, G(L)->seed));
+    if (ttisnil(aux) && fasttm(L, hvalue(t)->metatable, TM_INDEX) != NULL)
+      aux = NULL;  /* must call the metamethod */
+  }
+  if (aux != NULL) {
+    setobj2s(L, L->top, aux);
+    api_incr_top(L);
+  }
+  else {
+    setsvalue2s(L, L->top, luaS_newlstr(L, k, len));
+    api_incr_top(L);
+    luaV_gettable(L, t, L->top - 1, L->top - 1);
+  }
+  lua_unlock(L);
+  return ttnov(L->top - 1);
+}
+
+
 LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
   StkId t;
   const TValue *aux;
@@ -804,6 +885,7 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   slot = luaH_set(L, hvalue(o), L->top - 2);
   setobj2t(L, slot, L->top - 1);
   invalidateTMcache(hvalue(o));
@@ -819,6 +901,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   luaH_setint(L, hvalue(o), n, L->top - 1);
   luaC_barrierback(L, hvalue(o), L->top-1);
   L->top--;
@@ -833,6 +916,7 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  checkwritable(L, hvalue(o));
   setpvalue(&k, cast(void *, p));
   slot = luaH_set(L, hvalue(o), &k);
   setobj2t(L, slot, L->top - 1);
@@ -856,6 +940,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   }
   switch (ttnov(obj)) {
     case LUA_TTABLE: {
+      checkwritable(L, hvalue(obj));
       hvalue(obj)->metatable = mt;
       if (mt) {
         luaC_objbarrier(L, gcvalue(obj), mt);
@@ -1078,7 +1163,8 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
-      if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
+      /* end of cycle? (in generational mode, each step is a cycle) */
+      if (debt > 0 && (g->gcstate == GCSpause || g->gckind == KGC_GEN))
         res = 1;  /* signal it */
       break;
     }
@@ -1097,6 +1183,33 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCGEN: case LUA_GCINC: {
+      /* a pending bad collection still counts as generational mode */
+      res = (g->gckind == KGC_GEN || g->lastatomic != 0) ? LUA_GCGEN
+                                                         : LUA_GCINC;
+      luaC_changemode(L, (what == LUA_GCGEN) ? KGC_GEN : KGC_INC);
+      break;
+    }
+    case LUA_GCSETMINORMUL: {
+      res = g->genminormul;
+      if (data < 1) data = 1;  /* avoid a collection at every allocation */
+      g->genminormul = data;
+      break;
+    }
+    case LUA_GCSETMAJORMUL: {
+      res = g->genmajormul;
+      if (data < 1) data = 1;
+      g->genmajormul = data;
+      break;
+    }
+    case LUA_GCSETPARALLEL: {
+      res = luaC_setparallel(L, data);
+      break;
+    }
+    case LUA_GCSETBGFREE: {
+      res = luaC_setbgfree(L, data);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1136,6 +1249,230 @@ LUA_API int lua_next (lua_State *L, int idx) {
 }
 
 
+LUA_API void lua_cleartable (lua_State *L, int idx, int keepcap) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  checkwritable(L, hvalue(t));
+  luaH_clear(L, hvalue(t), keepcap);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_freeze (lua_State *L, int idx) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  hvalue(t)->flags |= FROZENBIT;
+  lua_unlock(L);
+}
+
+
+LUA_API int lua_isfrozen (lua_State *L, int idx) {
+  StkId t = index2addr(L, idx);
+  return (ttistable(t) && isfrozen(hvalue(t)));
+}
+
+
+/*
+** Copies t1[f .. e] to t2[t .. t + e - f] (the tables at 'idx1' and
+** 'idx2', which may be the same) with a single 'memmove', when both
+** ranges lie in the array parts and no '__index'/'__newindex'
+** metamethod could notice the difference. Returns 0, doing nothing,
+** otherwise.
+*/
+LUA_API int lua_movearray (lua_State *L, int idx1, lua_Integer f,
+                           lua_Integer e, lua_Integer t, int idx2) {
+  StkId o1, o2;
+  int res = 0;
+  lua_lock(L);
+  o1 = index2addr(L, idx1);
+  o2 = index2addr(L, idx2);
+  if (ttistable(o1) && ttistable(o2)) {
+    Table *h1 = hvalue(o1);
+    Table *h2 = hvalue(o2);
+    if (1 <= f && f <= e && e <= cast(lua_Integer, h1->sizearray) &&
+        1 <= t && t <= cast(lua_Integer, h2->sizearray) - (e - f) &&
+        !isfrozen(h2) && fasttm(L, h1->metatable, TM_INDEX) == NULL &&
+        fasttm(L, h2->metatable, TM_NEWINDEX) == NULL) {
+      memmove(h2->array + (t - 1), h1->array + (f - 1),
+              cast(size_t, e - f + 1) * sizeof(TValue));
+      if (h1 != h2 && isblack(h2))  /* may have new white values? */
+        luaC_barrierback_(L, h2);
+      res = 1;
+    }
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Pushes t[i .. j] (the table at 'idx') when that range lies in its
+** array part and there is no '__index' metamethod. Returns 0, pushing
+** nothing, otherwise. The caller must ensure the stack space.
+*/
+LUA_API int lua_pusharray (lua_State *L, int idx, lua_Integer i,
+                                         lua_Integer j) {
+  StkId o;
+  int res = 0;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  if (ttistable(o)) {
+    Table *h = hvalue(o);
+    if (1 <= i && i <= j && j <= cast(lua_Integer, h->sizearray) &&
+        fasttm(L, h->metatable, TM_INDEX) == NULL) {
+      const TValue *v = h->array + (i - 1);
+      api_check(L, j - i < L->stack_last - L->top, "stack overflow");
+      for (; i <= j; i++) {
+        setobj2s(L, L->top, v);
+        v++;
+        L->top++;
+      }
+      res = 1;
+    }
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Computes in '*total' the length of the concatenation of the 'n + 1'
+** values in 'v' with 'n' separators of length 'lsep'. Returns 0 if some
+** value is not a string or a number or the result would be too long.
+*/
+static int concatlen (const TValue *v, size_t n, size_t lsep,
+                      size_t *total) {
+  const size_t maxlen = (MAX_SIZE - sizeof(TString)) / sizeof(char);
+  char buff[LUA_NUMBUFFSIZE];
+  size_t len, k;
+  if (lsep > 0 && n >= maxlen / lsep)
+    return 0;
+  len = n * lsep;
+  for (k = 0; k <= n; k++) {
+    size_t l;
+    if (ttisstring(v + k))
+      l = tsslen(tsvalue(v + k));
+    else if (ttisnumber(v + k))
+      l = luaO_tostringbuff(buff, v + k);
+    else
+      return 0;
+    if (l >= maxlen - len)
+      return 0;
+    len += l;
+  }
+  *total = len;
+  return 1;
+}
+
+
+/*
+** Pushes the concatenation of t[i .. j] (the table at 'idx') with
+** 'sep' between elements, when that range lies in its array part,
+** there is no '__index' metamethod and all elements are strings or
+** numbers. A first pass computes the exact length, so the result is
+** written in place into a single new string. Returns 0, pushing
+** nothing, otherwise.
+*/
+LUA_API int lua_concatarray (lua_State *L, int idx, const char *sep,
+                             size_t lsep, lua_Integer i, lua_Integer j) {
+  StkId o;
+  size_t total;
+  int res = 0;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  if (ttistable(o)) {
+    Table *h = hvalue(o);
+    if (1 <= i && i <= j && j <= cast(lua_Integer, h->sizearray) &&
+        fasttm(L, h->metatable, TM_INDEX) == NULL &&
+        concatlen(h->array + (i - 1), cast(size_t, j - i), lsep, &total)) {
+      const TValue *v = h->array + (i - 1);
+      size_t n = cast(size_t, j - i);  /* number of separators */
+      /* the values cannot change: nothing below runs the collector */
+      char sbuff[LUAI_MAXSHORTLEN];
+      TString *ts = (total <= LUAI_MAXSHORTLEN) ? NULL
+                                                : luaS_createlngstrobj(L, total);
+      char *p = (ts == NULL) ? sbuff : getstr(ts);
+      size_t k;
+      for (k = 0; k <= n; k++) {
+        if (k > 0) {
+          memcpy(p, sep, lsep);
+          p += lsep;
+        }
+        if (ttisstring(v + k)) {
+          size_t l = tsslen(tsvalue(v + k));
+          memcpy(p, svalue(v + k), l);
+          p += l;
+        }
+        else {
+          char buff[LUA_NUMBUFFSIZE];
+          size_t l = luaO_tostringbuff(buff, v + k);
+          memcpy(p, buff, l);
+          p += l;
+        }
+      }
+      if (ts == NULL)  /* short strings must be internalized */
+        ts = luaS_newlstr(L, sbuff, total);
+      setsvalue2s(L, L->top, ts);
+      api_incr_top(L);
+      luaC_checkGC(L);
+      res = 1;
+    }
+  }
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Sorts t[1 .. n] (the table at 'idx') when that range lies in its
+** array part and the values that define the order (its own, or the
+** ones in the table at 'kidx' when it is not 0) are all numbers or all
+** strings. 'how' combines LUA_SORTDESC and LUA_SORTSTABLE. Returns 0
+** without changing anything otherwise.
+*/
+LUA_API int lua_sortarray (lua_State *L, int idx, lua_Integer n, int kidx,
+                                         int how) {
+  StkId t;
+  Table *k = NULL;
+  int res = 0;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  if (kidx != 0) {
+    StkId o = index2addr(L, kidx);
+    api_check(L, ttistable(o), "table expected");
+    k = hvalue(o);
+  }
+  if (ttistable(t) && !isfrozen(hvalue(t)) && 0 <= n && n <= MAX_INT)
+    res = luaH_sortarray(L, hvalue(t), k, cast(unsigned int, n), how);
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Moves to t[k] (the table at 'idx') the element that belongs there
+** when t[1 .. n] is sorted, with no greater element before it and no
+** smaller one after it, under the same conditions as 'lua_sortarray'.
+*/
+LUA_API int lua_selectarray (lua_State *L, int idx, lua_Integer n,
+                                           lua_Integer k, int how) {
+  StkId t;
+  int res = 0;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  if (ttistable(t) && !isfrozen(hvalue(t)) && 1 <= k && k <= n &&
+      n <= MAX_INT)
+    res = luaH_selectarray(L, hvalue(t), cast(unsigned int, n),
+                                         cast(unsigned int, k - 1), how);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API void lua_concat (lua_State *L, int n) {
   lua_lock(L);
   api_checknelems(L, n);
@@ -1174,6 +1511,7 @@ LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
 
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
   lua_lock(L);
+  luaC_syncfrees(L, 1);  /* pending blocks belong to the old allocator */
   G(L)->ud = ud;
   G(L)->frealloc = f;
   lua_unlock(L);
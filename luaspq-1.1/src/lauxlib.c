@@ -1007,6 +1007,454 @@ LUALIB_API lua_State *luaL_newstate (void) {
 }
 
 
+/*
+** {======================================================
+** Pooled allocator
+** =======================================================
+*/
+
+/*
+** Small blocks (most tables, strings, closures, upvalues and call
+** infos) come from pages split into blocks of one size class; larger
+** blocks use 'realloc'/'free'. Size classes are multiples of
+** POOLGRAIN, 8 bytes, the alignment that Lua objects and userdata need
+** on usual machines (a host with a stricter LUAI_USER_ALIGNMENT_T must
+** raise it); blocks round up to the next class. A
+** block finds its page by address masking, and the page records the
+** class of its blocks. Pages are carved from chunks of POOLCHUNKPAGES
+** aligned pages; an empty page goes back to its chunk and an empty
+** chunk back to the system, except for one spare chunk, so that a
+** heap hovering around a chunk boundary does not allocate and free
+** chunks over and over.
+**
+** Shrinking a block must not fail. When there is no room for it in a
+** smaller class, a small block stays in its current class; a large
+** block stays where it is and becomes "displaced". Displaced blocks
+** are kept in POOLDISPLACED lists hashed by address, linked through a
+** word after their first POOLMAXSIZE bytes (large blocks always have
+** room for it), so telling a small block from a displaced one looks at
+** one short list.
+**
+** The allocator is not thread safe, so 'luaL_newstate_pooled' forbids
+** background frees (LUA_GCSETBGFREE) in its states.
+*/
+
+#if !defined(POOLGRAIN)
+#define POOLGRAIN	8
+#endif
+
+#if !defined(POOLMAXSIZE)
+#define POOLMAXSIZE	256
+#endif
+
+/* page size; must be a power of 2 */
+#if !defined(POOLPAGESIZE)
+#define POOLPAGESIZE	(16 * 1024)
+#endif
+
+#if !defined(POOLCHUNKPAGES)
+#define POOLCHUNKPAGES	16
+#endif
+
+/* number of lists of displaced blocks; must be a power of 2 */
+#if !defined(POOLDISPLACED)
+#define POOLDISPLACED	64
+#endif
+
+#define POOLNCLASSES	(POOLMAXSIZE / POOLGRAIN)
+
+/* size class of a block of size 's' (0 < s <= POOLMAXSIZE) */
+#define poolclass(s)	((int)(((s) - 1) / POOLGRAIN))
+#define classsize(c)	((size_t)((c) + 1) * POOLGRAIN)
+
+#define pageof(b)  \
+  ((PoolPage *)((size_t)(b) & ~(size_t)(POOLPAGESIZE - 1)))
+
+/* size allocated for a large block of size 's' */
+#define LARGEMIN	(POOLMAXSIZE + sizeof(void *))
+#define largesize(s)	(((s) < LARGEMIN) ? LARGEMIN : (s))
+
+/* link of a displaced block */
+#define displacedlink(b)	(*(void **)((char *)(b) + POOLMAXSIZE))
+
+/* list of displaced blocks where 'b' would be */
+#define displacedlist(p,b)  \
+  (&(p)->displaced[((size_t)(b) / POOLMAXSIZE) & (POOLDISPLACED - 1)])
+
+
+typedef struct PoolChunk {
+  void *raw;  /* memory block holding the pages */
+  int nfree;  /* number of empty pages */
+} PoolChunk;
+
+
+typedef struct PoolPage {
+  struct PoolPage *next;  /* next page in its list */
+  struct PoolPage *prev;  /* previous page in its list */
+  PoolChunk *chunk;  /* chunk owning this page */
+  void *freeblocks;  /* list of freed blocks */
+  char *bump;  /* first never-used block */
+  char *limit;  /* end of the last block that fits in the page */
+  size_t nused;  /* number of blocks in use */
+  int sclass;  /* size class of the page's blocks */
+} PoolPage;
+
+
+/* first block of a page */
+#define PAGEHEADER  \
+  ((sizeof(PoolPage) + POOLGRAIN - 1) & ~(size_t)(POOLGRAIN - 1))
+
+
+typedef struct Pool {
+  PoolPage *partial[POOLNCLASSES];  /* pages with room, per class */
+  PoolPage *freepages;  /* empty pages (of any chunk) */
+  PoolChunk *spare;  /* empty chunk kept for reuse */
+  void *displaced[POOLDISPLACED];  /* large blocks with a small size */
+  size_t ndisplaced;  /* number of those blocks */
+  size_t nblocks[POOLNCLASSES];  /* blocks in use, per class */
+  size_t npages[POOLNCLASSES];  /* pages in use, per class */
+  size_t nchunks;
+  size_t nlive;  /* blocks in use, of all sizes */
+  size_t nlarge;  /* blocks in use larger than POOLMAXSIZE */
+  size_t largebytes;  /* bytes in those blocks */
+  int autofree;  /* free the pool when its last block is freed */
+} Pool;
+
+
+static void unlinkpage (PoolPage **list, PoolPage *page) {
+  if (page->prev) page->prev->next = page->next;
+  else *list = page->next;
+  if (page->next) page->next->prev = page->prev;
+}
+
+
+static void linkpage (PoolPage **list, PoolPage *page) {
+  page->prev = NULL;
+  page->next = *list;
+  if (*list) (*list)->prev = page;
+  *list = page;
+}
+
+
+static int newchunk (Pool *p) {
+  PoolChunk *ck = (PoolChunk *)malloc(sizeof(PoolChunk));
+  char *pages;
+  int i;
+  if (ck == NULL) return 0;
+  /* one extra page so that 'POOLCHUNKPAGES' aligned pages fit */
+  ck->raw = malloc((POOLCHUNKPAGES + 1) * POOLPAGESIZE);
+  if (ck->raw == NULL) {
+    free(ck);
+    return 0;
+  }
+  pages = (char *)pageof((char *)ck->raw + POOLPAGESIZE - 1);
+  for (i = 0; i < POOLCHUNKPAGES; i++) {
+    PoolPage *page = (PoolPage *)(pages + i * POOLPAGESIZE);
+    page->chunk = ck;
+    linkpage(&p->freepages, page);
+  }
+  ck->nfree = POOLCHUNKPAGES;
+  p->nchunks++;
+  return 1;
+}
+
+
+static void freechunk (Pool *p, PoolChunk *ck) {
+  char *pages = (char *)pageof((char *)ck->raw + POOLPAGESIZE - 1);
+  int i;
+  for (i = 0; i < POOLCHUNKPAGES; i++)
+    unlinkpage(&p->freepages, (PoolPage *)(pages + i * POOLPAGESIZE));
+  free(ck->raw);
+  free(ck);
+  p->nchunks--;
+}
+
+
+/*
+** Get an empty page for class 'c' and make it the first page with
+** room in that class.
+*/
+static PoolPage *newpage (Pool *p, int c) {
+  PoolPage *page;
+  if (p->freepages == NULL && !newchunk(p))
+    return NULL;
+  page = p->freepages;
+  unlinkpage(&p->freepages, page);
+  if (page->chunk == p->spare)  /* spare chunk is in use again? */
+    p->spare = NULL;
+  page->chunk->nfree--;
+  page->freeblocks = NULL;
+  page->bump = (char *)page + PAGEHEADER;
+  page->limit = page->bump +
+                ((POOLPAGESIZE - PAGEHEADER) / classsize(c)) * classsize(c);
+  page->nused = 0;
+  page->sclass = c;
+  linkpage(&p->partial[c], page);
+  p->npages[c]++;
+  return page;
+}
+
+
+#define pagefull(page)  \
+  ((page)->freeblocks == NULL && (page)->bump == (page)->limit)
+
+
+static void *poolmalloc (Pool *p, size_t size) {
+  if (size > POOLMAXSIZE) {
+    void *b = malloc(largesize(size));
+    if (b != NULL) {
+      p->nlive++;
+      p->nlarge++;
+      p->largebytes += size;
+    }
+    return b;
+  }
+  else {
+    int c = poolclass(size);
+    PoolPage *page = p->partial[c];
+    void *b;
+    if (page == NULL && (page = newpage(p, c)) == NULL)
+      return NULL;
+    if (page->freeblocks != NULL) {  /* reuse a freed block? */
+      b = page->freeblocks;
+      page->freeblocks = *(void **)b;
+    }
+    else {  /* bump allocation */
+      b = page->bump;
+      page->bump += classsize(c);
+    }
+    page->nused++;
+    p->nblocks[c]++;
+    p->nlive++;
+    if (pagefull(page))  /* no more room? */
+      unlinkpage(&p->partial[c], page);
+    return b;
+  }
+}
+
+
+static void freelarge (Pool *p, void *b, size_t size) {
+  free(b);
+  p->nlive--;
+  p->nlarge--;
+  p->largebytes -= size;
+}
+
+
+static void freesmall (Pool *p, void *b) {
+  PoolPage *page = pageof(b);
+  int c = page->sclass;
+  int wasfull = pagefull(page);
+  *(void **)b = page->freeblocks;
+  page->freeblocks = b;
+  page->nused--;
+  p->nblocks[c]--;
+  p->nlive--;
+  if (page->nused == 0) {  /* page is empty? */
+    PoolChunk *ck = page->chunk;
+    if (!wasfull)
+      unlinkpage(&p->partial[c], page);
+    p->npages[c]--;
+    linkpage(&p->freepages, page);
+    if (++ck->nfree == POOLCHUNKPAGES) {  /* whole chunk is empty? */
+      if (p->spare == NULL)
+        p->spare = ck;  /* keep it */
+      else
+        freechunk(p, ck);
+    }
+  }
+  else if (wasfull)  /* page has room again */
+    linkpage(&p->partial[c], page);
+}
+
+
+/*
+** If 'b' is a displaced block, return the link that points to it;
+** otherwise return NULL.
+*/
+static void **finddisplaced (Pool *p, void *b) {
+  void **l = displacedlist(p, b);
+  if (p->ndisplaced == 0)
+    return NULL;
+  while (*l != NULL) {
+    if (*l == b) return l;
+    l = &displacedlink(*l);
+  }
+  return NULL;
+}
+
+
+static void poolfree (Pool *p, void *b, size_t size) {
+  void **l;
+  if (size > POOLMAXSIZE)
+    freelarge(p, b, size);
+  else if ((l = finddisplaced(p, b)) != NULL) {
+    *l = displacedlink(b);  /* remove it from its list */
+    p->ndisplaced--;
+    freelarge(p, b, size);
+  }
+  else
+    freesmall(p, b);
+}
+
+
+static void *poolrealloc (Pool *p, void *b, size_t osize, size_t nsize) {
+  void **l = NULL;  /* link to 'b' if it is displaced */
+  void *nb;
+  if (osize <= POOLMAXSIZE && (l = finddisplaced(p, b)) == NULL) {
+    int c = pageof(b)->sclass;  /* a small block */
+    if (nsize <= POOLMAXSIZE && poolclass(nsize) == c)
+      return b;  /* block already has the right size */
+    nb = poolmalloc(p, nsize);
+    if (nb == NULL)  /* keep the block if it is large enough */
+      return (nsize <= classsize(c)) ? b : NULL;
+    memcpy(nb, b, (osize < nsize) ? osize : nsize);
+    freesmall(p, b);
+    return nb;
+  }
+  else if (nsize > POOLMAXSIZE) {
+    if (l != NULL) {  /* it will not be displaced anymore */
+      *l = displacedlink(b);
+      p->ndisplaced--;
+    }
+    nb = realloc(b, largesize(nsize));
+    if (nb == NULL) {
+      if (nsize > osize) {  /* growing can fail */
+        if (l != NULL) {  /* still displaced */
+          *l = b;
+          p->ndisplaced++;
+        }
+        return NULL;
+      }
+      nb = b;  /* keep the larger block */
+    }
+    p->largebytes += nsize - osize;  /* (modular arithmetic) */
+    return nb;
+  }
+  else {  /* large block with a small size */
+    nb = poolmalloc(p, nsize);
+    if (nb != NULL) {  /* move it to a page */
+      if (l != NULL) {
+        *l = displacedlink(b);
+        p->ndisplaced--;
+      }
+      memcpy(nb, b, (osize < nsize) ? osize : nsize);
+      freelarge(p, b, osize);
+      return nb;
+    }
+    if (l == NULL) {  /* keep it as a displaced block */
+      l = displacedlist(p, b);
+      displacedlink(b) = *l;
+      *l = b;
+      p->ndisplaced++;
+    }
+    p->largebytes += nsize - osize;
+    return b;
+  }
+}
+
+
+static void freepool (Pool *p) {
+  if (p->spare != NULL)
+    freechunk(p, p->spare);  /* all other chunks are already gone */
+  free(p);
+}
+
+
+static void *l_poolalloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Pool *p = (Pool *)ud;
+  if (nsize == 0) {
+    if (ptr != NULL) {
+      poolfree(p, ptr, osize);
+      if (p->autofree && p->nlive == 0)  /* state was closed? */
+        freepool(p);
+    }
+    return NULL;
+  }
+  else if (ptr == NULL)  /* ('osize' is a type tag) */
+    return poolmalloc(p, nsize);
+  else
+    return poolrealloc(p, ptr, osize, nsize);
+}
+
+
+/*
+** Creates a state whose memory comes from a new pool. The pool frees
+** itself when 'lua_close' frees the state's last block.
+*/
+LUALIB_API lua_State *luaL_newstate_pooled (void) {
+  lua_State *L;
+  Pool *p = (Pool *)malloc(sizeof(Pool));
+  if (p == NULL) return NULL;
+  memset(p, 0, sizeof(Pool));
+  L = lua_newstate(l_poolalloc, p);
+  if (L == NULL) {  /* everything allocated was already freed */
+    freepool(p);
+    return NULL;
+  }
+  p->autofree = 1;
+  lua_gc(L, LUA_GCSETBGFREE, -1);  /* pools are not thread safe */
+  lua_atpanic(L, &panic);
+  return L;
+}
+
+
+/*
+** If 'L' uses a pool, pushes a table describing it and returns 1;
+** otherwise returns 0 and pushes nothing. The array part has one entry
+** per size class ('size', 'blocks', 'pages', 'bytes' in use and 'free'
+** bytes in its pages); the hash part has totals for the whole pool.
+** 'fragmentation' is the fraction of the pool's pages not holding live
+** blocks (page headers, tails, freed blocks and empty pages).
+*/
+LUALIB_API int luaL_poolstats (lua_State *L) {
+  void *ud;
+  Pool snap;  /* building the table changes the pool */
+  Pool *p = &snap;
+  size_t used = 0;
+  size_t total;
+  int c;
+  if (lua_getallocf(L, &ud) != l_poolalloc)
+    return 0;
+  snap = *(Pool *)ud;
+  total = p->nchunks * POOLCHUNKPAGES * POOLPAGESIZE;
+  lua_createtable(L, POOLNCLASSES, 8);
+  for (c = 0; c < POOLNCLASSES; c++) {
+    size_t bytes = p->nblocks[c] * classsize(c);
+    used += bytes;
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, (lua_Integer)classsize(c));
+    lua_setfield(L, -2, "size");
+    lua_pushinteger(L, (lua_Integer)p->nblocks[c]);
+    lua_setfield(L, -2, "blocks");
+    lua_pushinteger(L, (lua_Integer)p->npages[c]);
+    lua_setfield(L, -2, "pages");
+    lua_pushinteger(L, (lua_Integer)bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, (lua_Integer)(p->npages[c] * POOLPAGESIZE - bytes));
+    lua_setfield(L, -2, "free");
+    lua_rawseti(L, -2, c + 1);
+  }
+  lua_pushinteger(L, POOLPAGESIZE);
+  lua_setfield(L, -2, "pagesize");
+  lua_pushinteger(L, (lua_Integer)p->nchunks);
+  lua_setfield(L, -2, "chunks");
+  lua_pushinteger(L, (lua_Integer)total);
+  lua_setfield(L, -2, "poolbytes");
+  lua_pushinteger(L, (lua_Integer)used);
+  lua_setfield(L, -2, "usedbytes");
+  lua_pushinteger(L, (lua_Integer)p->nlarge);
+  lua_setfield(L, -2, "largeblocks");
+  lua_pushinteger(L, (lua_Integer)p->largebytes);
+  lua_setfield(L, -2, "largebytes");
+  lua_pushnumber(L, (total == 0) ? 0 : 1 - (lua_Number)used / total);
+  lua_setfield(L, -2, "fragmentation");
+  return 1;
+}
+
+/* }====================================================== */
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
   const lua_Number *v = lua_version(L);
   if (sz != LUAL_NUMSIZES)  /* check numeric types */
@@ -175,14 +175,24 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "generational", "incremental", "setparallel", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, LUA_GCSETPARALLEL};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int res;
+  if (o == LUA_GCGEN) {  /* optional minor and major multipliers */
+    int majormul = (int)luaL_optinteger(L, 3, 0);
+    if (ex != 0) lua_gc(L, LUA_GCSETMINORMUL, ex);
+    if (majormul != 0) lua_gc(L, LUA_GCSETMAJORMUL, majormul);
+  }
+  res = lua_gc(L, o, ex);
   switch (o) {
+    case LUA_GCGEN: case LUA_GCINC: {  /* return previous mode */
+      lua_pushstring(L, (res == LUA_GCGEN) ? "generational" : "incremental");
+      return 1;
+    }
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
       lua_pushnumber(L, (lua_Number)res + ((lua_Number)b/1024));
@@ -546,7 +556,7 @@ typedef struct luaL_FuncNameNotePair {
 static const luaL_FuncNameNotePair base_funcs_note_chs[] = {
 	{ "assert", "如果其参数 v 的值为假（nil 或 false）， 它就调用 error； 否则，返回所有的参数。 在错误情况时， message 指那个错误对象； 如果不提供这个参数，参数默认为 \"assertion failed!\" 。" },
 	{ "authors", "显示lua核心库软件作者" },
-	{ "collectgarbage", "垃圾回收 \n \"stop\": 停止垃圾回收。\n \"restart\": 重启垃圾回收。\n \"collect\" : 执行垃圾回收的完整循环。\n \"count\" : 返回 Lua 当前使用的总内存（单位为 Kb）。\n \"step\" : 执行一步（一步可由多步组成）垃圾回收。步数可由参数 arg 控制（值越大，步数越多，0 表示执行一步（指最小的一步））。如果执行后完成了回收循环，返回 true。\n \"setpause\" : 把 arg / 100 作为垃圾回收参数 pause 的新值。\n \"setstepmul\" : 把 arg / 100 作为垃圾回收参数 step mutiplier 的新值。" },
+	{ "collectgarbage", "垃圾回收 \n \"stop\": 停止垃圾回收。\n \"restart\": 重启垃圾回收。\n \"collect\" : 执行垃圾回收的完整循环。\n \"count\" : 返回 Lua 当前使用的总内存（单位为 Kb）。\n \"step\" : 执行一步（一步可由多步组成）垃圾回收。步数可由参数 arg 控制（值越大，步数越多，0 表示执行一步（指最小的一步））。如果执行后完成了回收循环，返回 true。\n \"setpause\" : 把 arg / 100 作为垃圾回收参数 pause 的新值。\n \"setstepmul\" : 把 arg / 100 作为垃圾回收参数 step mutiplier 的新值。\n \"generational\" : 切换到分代模式，可选参数为 minor 与 major 倍率，返回之前的模式。\n \"incremental\" : 切换到增量模式，返回之前的模式。\n \"setparallel\" : 用 arg 个线程并行标记大的堆（1 表示串行），返回之前的线程数。" },
 	{ "clear", "清除当前屏幕内容" },
 	{ "cls", "清除当前屏幕内容，与clear一样" },
 	{ "dofile", "打开该名字的文件，并执行文件中的 Lua 代码块" },
@@ -580,7 +590,7 @@ static const luaL_FuncNameNotePair base_funcs_note_chs[] = {
 static const luaL_FuncNameNotePair base_funcs_note_fre[] = {
 	{ "assert", " Si la valeur de ses paramètres de V est faux (0 ou faux), qui appelle une erreur; sinon, le retour de tous les paramètres.En cas d'erreur, le message de l'objet d'erreur; si elle ne fournit pas de ce paramètre, un paramètre par défaut pour \"assertion failed!\"." },
 	{ "authors", " Bibliothèque centrale de logiciel d'auteur lua." },
-	{ "collectgarbage", " Recyclage d'ordures \n \"Stop\": arrête de recyclage d'ordures.\ n \"redémarrage \": le redémarrage de recyclage d'ordures.\ n \"collect \": le cycle complet de la mise en œuvre de déchets de recyclage.\ n \"count\": le retour de mémoire totale de l'utilisation actuelle de lua (unité pour KB).\ n \"Step \": une étape d'exécution (étape peut être composée de plusieurs étapes de récupération de déchets).Le nombre de pas à partir de paramètres de commande peuvent être Arg (plus la valeur de nombre de pas plus de 0, et une étape d'exécution (étape un minimum)).Si la mise en œuvre de l'achèvement de la récupération de circulation, renvoie VRAI.\ n \"setpause \": ARG / 100 comme nouvelle valeur de paramètres de récupération de pause d'ordures.\ n \"setstepmul \": ARG / 100 comme nouvelle valeur de paramètres de récupération step mutiplier d'ordures." },
+	{ "collectgarbage", " Recyclage d'ordures \n \"Stop\": arrête de recyclage d'ordures.\ n \"redémarrage \": le redémarrage de recyclage d'ordures.\ n \"collect \": le cycle complet de la mise en œuvre de déchets de recyclage.\ n \"count\": le retour de mémoire totale de l'utilisation actuelle de lua (unité pour KB).\ n \"Step \": une étape d'exécution (étape peut être composée de plusieurs étapes de récupération de déchets).Le nombre de pas à partir de paramètres de commande peuvent être Arg (plus la valeur de nombre de pas plus de 0, et une étape d'exécution (étape un minimum)).Si la mise en œuvre de l'achèvement de la récupération de circulation, renvoie VRAI.\ n \"setpause \": ARG / 100 comme nouvelle valeur de paramètres de récupération de pause d'ordures.\ n \"setstepmul \": ARG / 100 comme nouvelle valeur de paramètres de récupération step mutiplier d'ordures.\n \"generational\": passe en mode générationnel (arguments optionnels : multiplicateurs minor et major), renvoie le mode précédent.\n \"incremental\": passe en mode incrémental, renvoie le mode précédent.\n \"setparallel\": marque les grands tas avec ARG threads (1 pour le mode série), renvoie le nombre précédent." },
 	{ "clear", " Efface le contenu d'écran actuelle." },
 	{ "cls", " Efface le contenu d'écran actuel, et clair comme." },
 	{ "dofile", " Ouvrir un fichier pour le nom de fichier, et de mettre en œuvre dans le bloc de code lua." },
@@ -613,7 +623,7 @@ static const luaL_FuncNameNotePair base_funcs_note_fre[] = {
 static const luaL_FuncNameNotePair base_funcs_note_eng[] = {
 	{ "assert", " If the value of the parameter V is false (nil or false), it calls error; otherwise, all parameters are returned. In the error case, message refers to that error object; if this parameter is not supplied, the parameter defaults to \"assertion failed\"." },
 	{ "authors", " Display Lua core library software author." },
-	{ "collectgarbage", " Garbage collection \n \"stop\":stop garbage recycling. \n \"restart\": restart garbage collection. \n \"collect\": executes the full cycle of garbage collection. \n \"count\": returns the total memory used by Lua (Kb). \n  \"step\": perform a step (step by step composition) garbage collection. The number of steps can be controlled by the parameter Arg (the larger the number, the more steps, and the 0 indicates the execution step (the smallest step). If the recycle cycle is completed after execution, returns true. \n \"setpause\": take Arg / 100 as the new value of the garbage collection parameter pause. \n \"setstepmul\": take Arg / 100 as the new value of the garbage collection parameter step mutiplier." },
+	{ "collectgarbage", " Garbage collection \n \"stop\":stop garbage recycling. \n \"restart\": restart garbage collection. \n \"collect\": executes the full cycle of garbage collection. \n \"count\": returns the total memory used by Lua (Kb). \n  \"step\": perform a step (step by step composition) garbage collection. The number of steps can be controlled by the parameter Arg (the larger the number, the more steps, and the 0 indicates the execution step (the smallest step). If the recycle cycle is completed after execution, returns true. \n \"setpause\": take Arg / 100 as the new value of the garbage collection parameter pause. \n \"setstepmul\": take Arg / 100 as the new value of the garbage collection parameter step mutiplier. \n \"generational\": switch to generational mode, with optional minor and major multipliers; returns the previous mode. \n \"incremental\": switch to incremental mode; returns the previous mode. \n \"setparallel\": mark large heaps with Arg threads (1 means serial marking); returns the previous number of threads." },
 	{ "clear", " Clear the current screen content." },
 	{ "cls", " Clear the contents of the current screen, just like clear." },
 	{ "dofile", " Open the file with the name and execute the Lua code block in the file." },
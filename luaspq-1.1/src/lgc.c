@@ -23,6 +23,7 @@
 #include "lstate.h"
 #include "lstring.h"
 #include "ltable.h"
+#include "lthread.h"
 #include "ltm.h"
 
 
@@ -67,8 +68,25 @@
 #define makewhite(g,x)	\
  (x->marked = cast_byte((x->marked & maskcolors) | luaC_white(g)))
 
-#define white2gray(x)	resetbits(x->marked, WHITEBITS)
-#define black2gray(x)	resetbit(x->marked, BLACKBIT)
+/* 'maskcolors' without the age bits: used to reset an object to new */
+#define maskgcbits	(maskcolors & ~AGEBITS)
+
+#define white2gray(x)	setmarked(x, getmarked(x) & ~WHITEBITS)
+
+/*
+** turn a white object gray, returning false if it was not white. A
+** parallel marker must win the race for 'o' against the other markers
+*/
+#if defined(LUA_USE_GCTHREADS)
+#define inparallel(g)		((g)->gcmarker)
+#define claimobject(g,o)	((g)->gcmarker ? casgray(o) : (white2gray(o), 1))
+#define touchupval(uv)		l_storeint(&(uv)->u.open.touched, 1)
+#else
+#define inparallel(g)		0
+#define claimobject(g,o)	(white2gray(o), 1)
+#define touchupval(uv)		((uv)->u.open.touched = 1)
+#endif
+#define black2gray(x)	setmarked(x, getmarked(x) & ~bitmask(BLACKBIT))
 
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
@@ -113,6 +131,22 @@ static void reallymarkobject (global_State *g, GCObject *o);
 #define linkgclist(o,p)	((o)->gclist = (p), (p) = obj2gco(o))
 
 
+/*
+** pointer to the 'gclist' field of a gray object
+*/
+static GCObject **getgclist (GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: return &gco2t(o)->gclist;
+    case LUA_TLCL: return &gco2lcl(o)->gclist;
+    case LUA_TCCL: return &gco2ccl(o)->gclist;
+    case LUA_TTHREAD: return &gco2th(o)->gclist;
+    case LUA_TPROTO: return &gco2p(o)->gclist;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+
+
 /*
 ** If key is not marked, mark its entry as dead. This allows key to be
 ** collected, but keeps its entry in the table.  A dead node is needed
@@ -129,6 +163,14 @@ static void removeentry (Node *n) {
 }
 
 
+/*
+** Traversals leave dead entries in place while marking in parallel:
+** other markers may be looking up '__mode' in the same table (used as
+** a metatable), so they must only read tables they do not own.
+*/
+#define dropentry(g,n)	(inparallel(g) ? (void)0 : removeentry(n))
+
+
 /*
 ** tells whether a key or value can be cleared from a weak
 ** table. Non-collectable objects are never removed from weak
@@ -155,24 +197,36 @@ static int iscleared (global_State *g, const TValue *o) {
 void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
-  if (keepinvariant(g))  /* must keep invariant? */
+  if (keepinvariant(g)) {  /* must keep invariant? */
     reallymarkobject(g, v);  /* restore invariant */
+    if (isold(o)) {
+      lua_assert(!isold(v));  /* white object could not be old */
+      setage(v, G_OLD0);  /* restore generational invariant */
+    }
+  }
   else {  /* sweep phase */
     lua_assert(issweepphase(g));
-    makewhite(g, o);  /* mark main obj. as white to avoid other barriers */
+    if (g->gckind == KGC_INC)  /* incremental mode? */
+      makewhite(g, o);  /* mark main obj. as white to avoid other barriers */
   }
 }
 
 
 /*
 ** barrier that moves collector backward, that is, mark the black object
-** pointing to a white object as gray again.
+** pointing to a white object as gray again. In generational mode, the
+** table is 'touched' and a table still 'touched' from the previous
+** cycle is already in 'grayagain'.
 */
 void luaC_barrierback_ (lua_State *L, Table *t) {
   global_State *g = G(L);
   lua_assert(isblack(t) && !isdead(g, t));
+  lua_assert((g->gckind == KGC_GEN) == (isold(t) && getage(t) != G_TOUCHED1));
   black2gray(t);  /* make table gray (again) */
-  linkgclist(t, g->grayagain);
+  if (getage(t) != G_TOUCHED2)  /* not already in 'grayagain' list? */
+    linkgclist(t, g->grayagain);
+  if (isold(t))  /* generational mode? */
+    setage(t, G_TOUCHED1);  /* touched in current cycle */
 }
 
 
@@ -180,14 +234,18 @@ void luaC_barrierback_ (lua_State *L, Table *t) {
 ** barrier for assignments to closed upvalues. Because upvalues are
 ** shared among closures, it is impossible to know the color of all
 ** closures pointing to it. So, we assume that the object being assigned
-** must be marked.
+** must be marked. For the same reason, in generational mode we assume
+** some of those closures is old, so the object must become old too.
 */
 void luaC_upvalbarrier_ (lua_State *L, UpVal *uv) {
   global_State *g = G(L);
   GCObject *o = gcvalue(uv->v);
   lua_assert(!upisopen(uv));  /* ensured by macro luaC_upvalbarrier */
-  if (keepinvariant(g))
+  if (keepinvariant(g)) {
     markobject(g, o);
+    if (g->gckind == KGC_GEN && !isold(o))
+      setage(o, G_OLD0);
+  }
 }
 
 
@@ -195,6 +253,7 @@ void luaC_fix (lua_State *L, GCObject *o) {
   global_State *g = G(L);
   lua_assert(g->allgc == o);  /* object must be 1st in 'allgc' list! */
   white2gray(o);  /* they will be gray forever */
+  setage(o, G_OLD);  /* and old forever */
   g->allgc = o->next;  /* remove object from 'allgc' list */
   o->next = g->fixedgc;  /* link it to 'fixedgc' list */
   g->fixedgc = o;
@@ -226,6 +285,19 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 */
 
 
+#if defined(LUA_USE_GCTHREADS)
+static int casgray (GCObject *o) {
+  for (;;) {
+    lu_byte old = getmarked(o);
+    if (!(old & WHITEBITS))
+      return 0;  /* already marked */
+    if (l_casbyte(&o->marked, old, cast_byte(old & ~WHITEBITS)))
+      return 1;
+  }
+}
+#endif
+
+
 /*
 ** mark an object. Userdata, strings, and closed upvalues are visited
 ** and turned black here. Other objects are marked gray and added
@@ -234,7 +306,8 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 */
 static void reallymarkobject (global_State *g, GCObject *o) {
  reentry:
-  white2gray(o);
+  if (!claimobject(g, o))
+    return;  /* another marker got it first */
   switch (o->tt) {
     case LUA_TSHRSTR: {
       gray2black(o);
@@ -243,7 +316,9 @@ static void reallymarkobject (global_State *g, GCObject *o) {
     }
     case LUA_TLNGSTR: {
       gray2black(o);
-      g->GCmemtrav += sizelstring(gco2ts(o)->u.lnglen);
+      g->GCmemtrav += sizelngstr(gco2ts(o));
+      if (isslice(gco2ts(o)))  /* slice? */
+        markobjectN(g, gslice(gco2ts(o))->parent);  /* keep its bytes */
       break;
     }
     case LUA_TUSERDATA: {
@@ -325,6 +400,14 @@ static void remarkupvals (global_State *g) {
           markvalue(g, uv->v);  /* remark upvalue's value */
           uv->u.open.touched = 0;
         }
+        /* in generational mode, the upvalue will be closed when the
+           thread is swept, out of reach of 'luaC_upvalbarrier'; closures
+           using it may be old, so its value must become old too */
+        if (g->gckind == KGC_GEN && uv->refcount > 0 && iscollectable(uv->v)) {
+          markvalue(g, uv->v);
+          if (!isold(gcvalue(uv->v)))
+            setage(gcvalue(uv->v), G_OLD0);
+        }
       }
     }
   }
@@ -352,21 +435,43 @@ static void restartcollection (global_State *g) {
 ** =======================================================
 */
 
+/*
+** In generational mode, a table touched in this cycle must go back to
+** 'grayagain' (it is visited again in the next cycle, when its young
+** children will have become survivals); a table touched in the previous
+** cycle is done and becomes plain old.
+*/
+static void genlink (global_State *g, Table *h) {
+  lua_assert(isblack(h));
+  if (getage(h) == G_TOUCHED1) {  /* touched in this cycle? */
+    black2gray(h);
+    linkgclist(h, g->grayagain);  /* link it back in 'grayagain' */
+  }  /* everything else do not need to be linked back */
+  else if (getage(h) == G_TOUCHED2)
+    changeage(h, G_TOUCHED2, G_OLD);  /* advance age */
+}
+
+
 /*
 ** Traverse a table with weak values and link it to proper list. During
 ** propagate phase, keep it in 'grayagain' list, to be revisited in the
 ** atomic phase. In the atomic phase, if table has any white value,
-** put it in 'weak' list, to be cleared.
+** put it in 'weak' list, to be cleared; otherwise keep it in
+** 'grayagain', where generational mode will find it.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
   Node *n, *limit = gnodelast(h);
   /* if there is array part, assume it may have white values (it is not
      worth traversing it now just to check) */
   int hasclears = (h->sizearray > 0);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h) && h->shape->nkeys > 0)
+    hasclears = 1;  /* same for the slots */
+#endif
   for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
+      dropentry(g, n);  /* remove it */
     else {
       lua_assert(!ttisnil(gkey(n)));
       markvalue(g, gkey(n));  /* mark key */
@@ -374,10 +479,10 @@ static void traverseweakvalue (global_State *g, Table *h) {
         hasclears = 1;  /* table will have to be cleared */
     }
   }
-  if (g->gcstate == GCSpropagate)
-    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
-  else if (hasclears)
+  if (g->gcstate == GCSinsideatomic && hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
+  else
+    linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
 }
 
 
@@ -389,7 +494,8 @@ static void traverseweakvalue (global_State *g, Table *h) {
 ** the atomic phase, if table has any white->white entry, it has to
 ** be revisited during ephemeron convergence (as that key may turn
 ** black). Otherwise, if it has any white key, table has to be cleared
-** (in the atomic phase).
+** (in the atomic phase); if not, it stays in 'grayagain' as in
+** 'traverseweakvalue'.
 */
 static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
@@ -404,11 +510,22 @@ static int traverseephemeron (global_State *g, Table *h) {
       reallymarkobject(g, gcvalue(&h->array[i]));
     }
   }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* traverse slots (their keys are never cleared) */
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++) {
+      if (valiswhite(&h->slots[j])) {
+        marked = 1;
+        reallymarkobject(g, gcvalue(&h->slots[j]));
+      }
+    }
+  }
+#endif
   /* traverse hash part */
   for (n = gnode(h, 0); n < limit; n++) {
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
+      dropentry(g, n);  /* remove it */
     else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
       hasclears = 1;  /* table must be cleared */
       if (valiswhite(gval(n)))  /* value not marked yet? */
@@ -420,12 +537,14 @@ static int traverseephemeron (global_State *g, Table *h) {
     }
   }
   /* link table into proper list */
-  if (g->gcstate == GCSpropagate)
+  if (g->gcstate != GCSinsideatomic)
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasww)  /* table has white->white entries? */
     linkgclist(h, g->ephemeron);  /* have to propagate again */
   else if (hasclears)  /* table has white keys? */
     linkgclist(h, g->allweak);  /* may have to clean white keys */
+  else
+    linkgclist(h, g->grayagain);  /* nothing to clear */
   return marked;
 }
 
@@ -435,26 +554,62 @@ static void traversestrongtable (global_State *g, Table *h) {
   unsigned int i;
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++)  /* traverse slots */
+      markvalue(g, &h->slots[j]);
+  }
+#endif
   for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
     checkdeadkey(n);
     if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
+      dropentry(g, n);  /* remove it */
     else {
       lua_assert(!ttisnil(gkey(n)));
       markvalue(g, gkey(n));  /* mark key */
       markvalue(g, gval(n));  /* mark value */
     }
   }
+  genlink(g, h);
 }
 
 
+/*
+** '__mode' field of metatable 'mt'. Parallel markers do not update the
+** metatable's cache of absent tag methods, which other markers read.
+*/
+static const TValue *gcmode (global_State *g, Table *mt) {
+  if (inparallel(g) && mt != NULL) {
+    const TValue *tm;
+    if (mt->flags & (1u << TM_MODE))  /* known to be absent? */
+      return NULL;
+    tm = luaH_getshortstr(mt, g->tmname[TM_MODE]);
+    return ttisnil(tm) ? NULL : tm;
+  }
+  return gfasttm(g, mt, TM_MODE);
+}
+
+
+/* search a mode string for 'c' (its bytes may not end with a '\0') */
+#define modechr(mode,c)  \
+	cast(const char *, memchr(svalue(mode), c, vslen(mode)))
+
+
 static lu_mem traversetable (global_State *g, Table *h) {
   const char *weakkey, *weakvalue;
-  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  const TValue *mode = gcmode(g, h->metatable);
   markobjectN(g, h->metatable);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* mark keys of its shape (strings, never weak) */
+    int i;
+    for (i = 0; i < h->shape->nkeys; i++)
+      markobject(g, h->shape->keys[i]);
+  }
+#endif
   if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-      ((weakkey = strchr(svalue(mode), 'k')),
-       (weakvalue = strchr(svalue(mode), 'v')),
+      ((weakkey = modechr(mode, 'k')),
+       (weakvalue = modechr(mode, 'v')),
        (weakkey || weakvalue))) {  /* is really weak? */
     black2gray(h);  /* keep table gray */
     if (!weakkey)  /* strong keys? */
@@ -467,6 +622,9 @@ static lu_mem traversetable (global_State *g, Table *h) {
   else  /* not weak */
     traversestrongtable(g, h);
   return sizeof(Table) + sizeof(TValue) * h->sizearray +
+#if defined(LUA_USE_SHAPES)
+                         sizeof(TValue) * h->sizeslots +
+#endif
                          sizeof(Node) * cast(size_t, sizenode(h));
 }
 
@@ -518,7 +676,7 @@ static lu_mem traverseLclosure (global_State *g, LClosure *cl) {
     UpVal *uv = cl->upvals[i];
     if (uv != NULL) {
       if (upisopen(uv) && g->gcstate != GCSinsideatomic)
-        uv->u.open.touched = 1;  /* can be marked in 'remarkupvals' */
+        touchupval(uv);  /* can be marked in 'remarkupvals' */
       else
         markvalue(g, uv->v);
     }
@@ -545,7 +703,7 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
       g->twups = th;
     }
   }
-  else if (g->gckind != KGC_EMERGENCY)
+  else if (!g->gcemergency)
     luaD_shrinkstack(th); /* do not change stack in emergency cycle */
   return (sizeof(lua_State) + sizeof(TValue) * th->stacksize +
           sizeof(CallInfo) * th->nci);
@@ -559,7 +717,7 @@ static lu_mem traversethread (global_State *g, lua_State *th) {
 static void propagatemark (global_State *g) {
   lu_mem size;
   GCObject *o = g->gray;
-  lua_assert(isgray(o));
+  lua_assert(isgray(o) || getage(o) == G_TOUCHED2);
   gray2black(o);
   switch (o->tt) {
     case LUA_TTABLE: {
@@ -625,6 +783,486 @@ static void convergeephemerons (global_State *g) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+#if defined(LUA_USE_GCTHREADS)
+
+/* heaps smaller than this are always marked serially */
+#if !defined(LUAI_GCPARMIN)
+#define LUAI_GCPARMIN	(8 << 20)
+#endif
+
+/* maximum number of marking threads */
+#if !defined(LUAI_MAXGCTHREADS)
+#define LUAI_MAXGCTHREADS	64
+#endif
+
+/* maximum number of gray lists waiting to be taken by an idle marker */
+#define MAXCHAINS	(2 * LUAI_MAXGCTHREADS)
+
+
+/*
+** Each marker (the running thread plus 'nmarkers - 1' helpers) works
+** on a private copy of 'global_State', so that the traverse functions
+** above link objects into private gray lists and count private work.
+** Markers only share objects: 'claimobject' decides which marker visits
+** each one, so the (relaxed) reads of colors elsewhere are only hints. A
+** marker with more than one gray object gives all but the first to idle
+** markers through 'chains'.
+*/
+typedef struct GCMarker {
+  global_State g;  /* private copy of the collector state */
+  struct GCPool *pool;
+  l_thread thread;
+} GCMarker;
+
+
+typedef struct GCPool {
+  l_mutex lock;
+  l_cond work;  /* signals a new round, a new chain, or the end of a round */
+  l_cond done;  /* signals that a helper left its round */
+  int nmarkers;  /* number of markers (helpers plus the running thread) */
+  int sizemarkers;  /* size of array 'markers' */
+  int nidle;  /* markers waiting for work */
+  int nchains;  /* number of entries in 'chains' */
+  int nactive;  /* helpers still in the current round */
+  int quit;  /* true when helpers must exit */
+  unsigned int round;  /* number of the current round */
+  GCObject *chains[MAXCHAINS];  /* gray lists waiting for a marker */
+  GCMarker markers[1];  /* 'nmarkers' markers; markers[0] is the caller */
+} GCPool;
+
+
+#define sizegcpool(n)	(sizeof(GCPool) + ((n) - 1) * sizeof(GCMarker))
+
+
+/*
+** give all gray objects but the first to the idle markers
+*/
+static void sharegray (GCPool *p, global_State *g) {
+  GCObject **next = getgclist(g->gray);
+  l_lock(&p->lock);
+  if (p->nchains < MAXCHAINS) {
+    p->chains[p->nchains] = *next;
+    l_storeint(&p->nchains, p->nchains + 1);
+    *next = NULL;
+    l_condbroadcast(&p->work);
+  }
+  l_unlock(&p->lock);
+}
+
+
+/*
+** Propagate marks until all markers run out of gray objects. The round
+** ends when every marker is idle with no chains left.
+*/
+static void markround (GCMarker *m) {
+  GCPool *p = m->pool;
+  global_State *g = &m->g;
+  for (;;) {
+    while (g->gray != NULL) {
+      propagatemark(g);
+      if (l_loadint(&p->nidle) > l_loadint(&p->nchains) &&
+          g->gray != NULL && *getgclist(g->gray) != NULL)
+        sharegray(p, g);
+    }
+    l_lock(&p->lock);
+    l_storeint(&p->nidle, p->nidle + 1);
+    while (p->nchains == 0 && p->nidle < p->nmarkers)
+      l_condwait(&p->work, &p->lock);
+    if (p->nchains == 0) {  /* everybody idle and nothing left? */
+      l_condbroadcast(&p->work);  /* round is over */
+      l_unlock(&p->lock);
+      return;
+    }
+    l_storeint(&p->nchains, p->nchains - 1);
+    g->gray = p->chains[p->nchains];
+    l_storeint(&p->nidle, p->nidle - 1);
+    l_unlock(&p->lock);
+  }
+}
+
+
+static l_threadfunc(markermain, ud) {
+  GCMarker *m = cast(GCMarker *, ud);
+  GCPool *p = m->pool;
+  unsigned int round = 0;
+  l_lock(&p->lock);
+  for (;;) {
+    while (p->round == round && !p->quit)
+      l_condwait(&p->work, &p->lock);
+    if (p->quit)
+      break;
+    round = p->round;
+    l_unlock(&p->lock);
+    markround(m);
+    l_lock(&p->lock);
+    p->nactive--;
+    l_condbroadcast(&p->done);
+  }
+  l_unlock(&p->lock);
+  l_threadreturn;
+}
+
+
+/*
+** link gray list 'o' in front of list 'l'
+*/
+static void mergegclist (GCObject **l, GCObject *o) {
+  if (o != NULL) {
+    GCObject **next = getgclist(o);
+    while (*next != NULL)
+      next = getgclist(*next);
+    *next = *l;
+    *l = o;
+  }
+}
+
+
+/*
+** Move into 'g' what a marker left in its private state: its gray
+** lists, its work, and the threads it linked back into 'twups' (which
+** all end at 'twups', the list as it was at the start of the round).
+** Markers cannot shrink stacks, so do it here.
+*/
+static void mergemarker (global_State *g, global_State *mg, lua_State *twups) {
+  lua_assert(mg->gray == NULL);
+  if (g->gcstate != GCSinsideatomic && !g->gcemergency) {
+    GCObject *o;
+    for (o = mg->grayagain; o != NULL; o = *getgclist(o)) {
+      if (o->tt == LUA_TTHREAD)
+        luaD_shrinkstack(gco2th(o));
+    }
+  }
+  mergegclist(&g->grayagain, mg->grayagain);
+  mergegclist(&g->weak, mg->weak);
+  mergegclist(&g->allweak, mg->allweak);
+  mergegclist(&g->ephemeron, mg->ephemeron);
+  if (mg->twups != twups) {
+    lua_State *last = mg->twups;
+    while (last->twups != twups)
+      last = last->twups;
+    last->twups = g->twups;
+    g->twups = mg->twups;
+  }
+  g->GCmemtrav += mg->GCmemtrav;
+}
+
+
+/*
+** Empty the gray list with all markers. The running thread deals the
+** gray objects among the markers, wakes the helpers, marks with them,
+** and collects their results once all of them left the round.
+*/
+static void propagateallpar (global_State *g) {
+  GCPool *p = g->gcpool;
+  lua_State *twups = g->twups;
+  int i;
+  if (p == NULL || g->gray == NULL || gettotalbytes(g) < LUAI_GCPARMIN) {
+    propagateall(g);  /* not worth waking the helpers */
+    return;
+  }
+  for (i = 0; i < p->nmarkers; i++) {
+    global_State *mg = &p->markers[i].g;
+    *mg = *g;
+    mg->gcmarker = 1;
+    mg->gcemergency = 1;  /* do not change stacks while marking */
+    mg->gray = mg->grayagain = NULL;
+    mg->weak = mg->allweak = mg->ephemeron = NULL;
+    mg->GCmemtrav = 0;
+  }
+  for (i = 0; g->gray != NULL; i = (i + 1) % p->nmarkers) {
+    GCObject *o = g->gray;
+    global_State *mg = &p->markers[i].g;
+    g->gray = *getgclist(o);
+    *getgclist(o) = mg->gray;
+    mg->gray = o;
+  }
+  l_lock(&p->lock);
+  l_storeint(&p->nidle, 0);
+  l_storeint(&p->nchains, 0);
+  p->nactive = p->nmarkers - 1;
+  p->round++;
+  l_condbroadcast(&p->work);  /* start the helpers */
+  l_unlock(&p->lock);
+  markround(&p->markers[0]);
+  l_lock(&p->lock);
+  while (p->nactive > 0)  /* wait for the helpers to leave the round */
+    l_condwait(&p->done, &p->lock);
+  l_unlock(&p->lock);
+  for (i = 0; i < p->nmarkers; i++)
+    mergemarker(g, &p->markers[i].g, twups);
+}
+
+
+/*
+** stop and free all helper threads
+*/
+static void freegcpool (lua_State *L, GCPool *p) {
+  int i;
+  l_lock(&p->lock);
+  p->quit = 1;
+  l_condbroadcast(&p->work);
+  l_unlock(&p->lock);
+  for (i = 1; i < p->nmarkers; i++)
+    l_threadjoin(p->markers[i].thread);
+  l_condfree(&p->done);
+  l_condfree(&p->work);
+  l_mutexfree(&p->lock);
+  luaM_freemem(L, p, sizegcpool(p->sizemarkers));
+}
+
+
+/*
+** Use 'n' threads (counting the running one) to mark large heaps in
+** the atomic phase and in full collections; 'n' <= 1 marks serially.
+** If the system cannot start all helpers, work with the ones started.
+** Returns the previous number of threads.
+*/
+int luaC_setparallel (lua_State *L, int n) {
+  global_State *g = G(L);
+  GCPool *p = g->gcpool;
+  int old = (p == NULL) ? 1 : p->nmarkers;
+  if (n > LUAI_MAXGCTHREADS) n = LUAI_MAXGCTHREADS;
+  if (n < 1) n = 1;
+  if (n != old) {
+    g->gcpool = NULL;
+    if (p != NULL)
+      freegcpool(L, p);
+    if (n > 1) {
+      int i;
+      p = cast(GCPool *, luaM_malloc(L, sizegcpool(n)));
+      l_mutexinit(&p->lock);
+      l_condinit(&p->work);
+      l_condinit(&p->done);
+      p->nidle = p->nchains = p->nactive = 0;
+      p->quit = 0;
+      p->round = 0;
+      p->sizemarkers = n;
+      p->markers[0].pool = p;
+      for (i = 1; i < n; i++) {
+        p->markers[i].pool = p;
+        if (!l_threadcreate(&p->markers[i].thread, markermain, &p->markers[i]))
+          break;
+      }
+      p->nmarkers = i;
+      if (i > 1)
+        g->gcpool = p;
+      else  /* could not start any helper */
+        freegcpool(L, p);
+    }
+  }
+  return old;
+}
+
+#else
+
+#define propagateallpar(g)	propagateall(g)
+
+int luaC_setparallel (lua_State *L, int n) {
+  UNUSED(L); UNUSED(n);
+  return 1;  /* always serial */
+}
+
+#endif
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Background frees
+** =======================================================
+*/
+
+#if defined(LUA_USE_GCTHREADS)
+
+/* blocks handed to the freeing thread at a time */
+#define FREEBATCH	256
+
+
+/*
+** A dead block waiting to be freed. The header lives in the block
+** itself, so only blocks at least this large can wait.
+*/
+typedef struct FreeBlock {
+  struct FreeBlock *next;
+  size_t size;
+} FreeBlock;
+
+
+/*
+** Sweeping unlinks dead objects and does all their bookkeeping on the
+** running thread, but the calls that give their blocks back to the
+** allocator go, in batches, to a helper thread. So, this can only be
+** used with allocators that may be called from another thread, like
+** the one of 'luaL_newstate'.
+*/
+typedef struct GCFreer {
+  l_mutex lock;
+  l_cond work;  /* signals new blocks in 'pending' or 'quit' */
+  l_cond idle;  /* signals that the thread freed all pending blocks */
+  FreeBlock *pending;  /* blocks handed to the thread */
+  FreeBlock *batch;  /* blocks not handed yet */
+  FreeBlock *lastbatch;  /* last block in 'batch' */
+  int nbatch;  /* number of blocks in 'batch' */
+  int busy;  /* true while the thread is freeing blocks */
+  int quit;  /* true when the thread must exit */
+  global_State *g;
+  l_thread thread;
+} GCFreer;
+
+
+static l_threadfunc(freermain, ud) {
+  GCFreer *f = cast(GCFreer *, ud);
+  l_lock(&f->lock);
+  for (;;) {
+    FreeBlock *b;
+    while (f->pending == NULL && !f->quit)
+      l_condwait(&f->work, &f->lock);
+    if (f->pending == NULL)  /* quit with nothing left? */
+      break;
+    b = f->pending;
+    f->pending = NULL;
+    f->busy = 1;
+    l_unlock(&f->lock);
+    while (b != NULL) {
+      FreeBlock *next = b->next;
+      (*f->g->frealloc)(f->g->ud, b, b->size, 0);
+      b = next;
+    }
+    l_lock(&f->lock);
+    f->busy = 0;
+    if (f->pending == NULL)
+      l_condbroadcast(&f->idle);
+  }
+  l_unlock(&f->lock);
+  l_threadreturn;
+}
+
+
+/*
+** hand the current batch to the freeing thread
+*/
+static void handbatch (GCFreer *f) {
+  if (f->batch != NULL) {
+    l_lock(&f->lock);
+    f->lastbatch->next = f->pending;
+    f->pending = f->batch;
+    l_condbroadcast(&f->work);
+    l_unlock(&f->lock);
+    f->batch = f->lastbatch = NULL;
+    f->nbatch = 0;
+  }
+}
+
+
+/*
+** Called by 'luaM_realloc_' (when 'g->gcdeferfree') instead of freeing
+** 'block'; returns false if 'block' is too small to wait.
+*/
+int luaC_deferfree (global_State *g, void *block, size_t size) {
+  GCFreer *f = g->gcfreer;
+  FreeBlock *b = cast(FreeBlock *, block);
+  if (size < sizeof(FreeBlock))
+    return 0;
+  b->size = size;
+  b->next = f->batch;
+  if (f->batch == NULL)
+    f->lastbatch = b;
+  f->batch = b;
+  if (++f->nbatch >= FREEBATCH)
+    handbatch(f);
+  return 1;
+}
+
+
+/*
+** Hand all waiting blocks to the freeing thread; if 'wait', also wait
+** until they are all back to the allocator.
+*/
+void luaC_syncfrees (lua_State *L, int wait) {
+  GCFreer *f = G(L)->gcfreer;
+  if (f != NULL) {
+    handbatch(f);
+    if (wait) {
+      l_lock(&f->lock);
+      while (f->pending != NULL || f->busy)
+        l_condwait(&f->idle, &f->lock);
+      l_unlock(&f->lock);
+    }
+  }
+}
+
+
+/*
+** Start ('on' > 0) or stop the freeing thread. Returns whether it was
+** running. Stopping frees every waiting block first. A negative 'on'
+** stops it for good, as the allocator is not thread safe; starting it
+** afterwards fails and returns -1.
+*/
+int luaC_setbgfree (lua_State *L, int on) {
+  global_State *g = G(L);
+  GCFreer *f = g->gcfreer;
+  int old = (f != NULL);
+  if (on < 0)
+    g->gcnobgfree = 1;
+  else if (on && g->gcnobgfree)
+    return -1;
+  if (on > 0 && f == NULL) {
+    f = luaM_new(L, GCFreer);
+    l_mutexinit(&f->lock);
+    l_condinit(&f->work);
+    l_condinit(&f->idle);
+    f->pending = f->batch = f->lastbatch = NULL;
+    f->nbatch = f->busy = f->quit = 0;
+    f->g = g;
+    if (l_threadcreate(&f->thread, freermain, f))
+      g->gcfreer = f;
+    else {  /* cannot start thread; keep freeing on the running thread */
+      l_condfree(&f->idle);
+      l_condfree(&f->work);
+      l_mutexfree(&f->lock);
+      luaM_free(L, f);
+    }
+  }
+  else if (on <= 0 && f != NULL) {
+    handbatch(f);
+    l_lock(&f->lock);
+    f->quit = 1;
+    l_condbroadcast(&f->work);
+    l_unlock(&f->lock);
+    l_threadjoin(f->thread);  /* thread exits after freeing 'pending' */
+    g->gcfreer = NULL;
+    l_condfree(&f->idle);
+    l_condfree(&f->work);
+    l_mutexfree(&f->lock);
+    luaM_free(L, f);
+  }
+  return old;
+}
+
+#else
+
+void luaC_syncfrees (lua_State *L, int wait) {
+  UNUSED(L); UNUSED(wait);
+}
+
+
+int luaC_setbgfree (lua_State *L, int on) {
+  UNUSED(L); UNUSED(on);
+  return 0;  /* always free on the running thread */
+}
+
+#endif
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Sweep Functions
@@ -664,6 +1302,16 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
+#if defined(LUA_USE_SHAPES)
+    if (isshaped(h)) {
+      int j;
+      for (j = 0; j < h->shape->nkeys; j++) {
+        TValue *o = &h->slots[j];
+        if (iscleared(g, o))  /* value was collected? */
+          setnilvalue(o);  /* remove value */
+      }
+    }
+#endif
     for (n = gnode(h, 0); n < limit; n++) {
       if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
         setnilvalue(gval(n));  /* remove value ... */
@@ -694,6 +1342,11 @@ static void freeLclosure (lua_State *L, LClosure *cl) {
 
 
 static void freeobj (lua_State *L, GCObject *o) {
+#if defined(LUA_USE_GCTHREADS)
+  global_State *g = G(L);
+  /* let 'luaM_realloc_' hand the object's blocks to the freeing thread */
+  g->gcdeferfree = (g->gcfreer != NULL && !g->gcemergency);
+#endif
   switch (o->tt) {
     case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
     case LUA_TLCL: {
@@ -712,11 +1365,17 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
+      TString *ts = gco2ts(o);
+      if (isslice(ts) && gslice(ts)->parent == NULL)  /* owns its bytes? */
+        luaM_freearray(L, gslice(ts)->contents, ts->u.lnglen + 1);
+      luaM_freemem(L, o, sizelngstr(ts));
       break;
     }
     default: lua_assert(0);
   }
+#if defined(LUA_USE_GCTHREADS)
+  g->gcdeferfree = 0;
+#endif
 }
 
 
@@ -742,8 +1401,8 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       *p = curr->next;  /* remove 'curr' from list */
       freeobj(L, curr);  /* erase 'curr' */
     }
-    else {  /* change mark to 'white' */
-      curr->marked = cast_byte((marked & maskcolors) | white);
+    else {  /* change mark to 'white' (and age to new) */
+      curr->marked = cast_byte((marked & maskgcbits) | white);
       p = &curr->next;  /* go to next element */
     }
   }
@@ -775,12 +1434,16 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p, int *n) {
 */
 
 /*
-** If possible, shrink string table
+** If possible, shrink string table. It shrinks only when it is less
+** than 1/8 full; after halving, it is still less than 1/4 full, so
+** programs that keep creating and dropping many strings do not make it
+** shrink and grow again every cycle.
 */
 static void checkSizes (lua_State *L, global_State *g) {
-  if (g->gckind != KGC_EMERGENCY) {
+  if (!g->gcemergency) {
     l_mem olddebt = g->GCdebt;
-    if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
+    if (g->strt.nuse < g->strt.size / 8 &&  /* string table too big? */
+        g->strt.size > MINSTRTABSIZE)
       luaS_resize(L, g->strt.size / 2);  /* shrink it a little */
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
   }
@@ -796,6 +1459,8 @@ static GCObject *udata2finalize (global_State *g) {
   resetbit(o->marked, FINALIZEDBIT);  /* object is "normal" again */
   if (issweepphase(g))
     makewhite(g, o);  /* "sweep" object */
+  else if (getage(o) == G_OLD1)
+    g->firstold1 = o;  /* it is the first OLD1 object in the list */
   return o;
 }
 
@@ -826,9 +1491,11 @@ static void GCTM (lua_State *L, int propagateerrors) {
     g->gcrunning = running;  /* restore state */
     if (status != LUA_OK && propagateerrors) {  /* error while running __gc? */
       if (status == LUA_ERRRUN) {  /* is there an error object? */
-        const char *msg = (ttisstring(L->top - 1))
-                            ? svalue(L->top - 1)
-                            : "no message";
+        const char *msg = "no message";
+        if (ttisstring(L->top - 1)) {
+          luaS_terminate(L, tsvalue(L->top - 1));
+          msg = svalue(L->top - 1);
+        }
         luaO_pushfstring(L, "error in __gc metamethod (%s)", msg);
         status = LUA_ERRGCMM;  /* error in __gc metamethod */
       }
@@ -875,17 +1542,21 @@ static GCObject **findlast (GCObject **p) {
 
 /*
 ** move all unreachable objects (or 'all' objects) that need
-** finalization from list 'finobj' to list 'tobefnz' (to be finalized)
+** finalization from list 'finobj' to list 'tobefnz' (to be finalized).
+** (In generational mode, old objects cannot be white, so the search
+** stops at 'finobjold1'; in incremental mode it is NULL.)
 */
 static void separatetobefnz (global_State *g, int all) {
   GCObject *curr;
   GCObject **p = &g->finobj;
   GCObject **lastnext = findlast(&g->tobefnz);
-  while ((curr = *p) != NULL) {  /* traverse all finalizable objects */
+  while ((curr = *p) != g->finobjold1) {  /* traverse finalizable objects */
     lua_assert(tofinalize(curr));
     if (!(iswhite(curr) || all))  /* not being collected? */
       p = &curr->next;  /* don't bother with it */
     else {
+      if (curr == g->finobjsur)  /* removing 'finobjsur'? */
+        g->finobjsur = curr->next;  /* correct it */
       *p = curr->next;  /* remove 'curr' from 'finobj' list */
       curr->next = *lastnext;  /* link at the end of 'tobefnz' list */
       *lastnext = curr;
@@ -895,6 +1566,27 @@ static void separatetobefnz (global_State *g, int all) {
 }
 
 
+/*
+** If pointer 'p' points to 'o', move it to the next element.
+*/
+static void checkpointer (GCObject **p, GCObject *o) {
+  if (o == *p)
+    *p = o->next;
+}
+
+
+/*
+** Correct pointers to objects inside 'allgc' list when
+** object 'o' is being removed from the list.
+*/
+static void correctpointers (global_State *g, GCObject *o) {
+  checkpointer(&g->survival, o);
+  checkpointer(&g->old1, o);
+  checkpointer(&g->reallyold, o);
+  checkpointer(&g->firstold1, o);
+}
+
+
 /*
 ** if object 'o' has a finalizer, remove it from 'allgc' list (must
 ** search the list to find it) and link it in 'finobj' list.
@@ -911,6 +1603,8 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
       if (g->sweepgc == &o->next)  /* should not remove 'sweepgc' object */
         g->sweepgc = sweeptolive(L, g->sweepgc, NULL);  /* change 'sweepgc' */
     }
+    else
+      correctpointers(g, o);
     /* search for pointer pointing to 'o' */
     for (p = &g->allgc; *p != o; p = &(*p)->next) { /* empty */ }
     *p = o->next;  /* remove 'o' from 'allgc' list */
@@ -924,6 +1618,424 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 
 
 
+/*
+** {======================================================
+** Generational Collector
+** =======================================================
+*/
+
+static void setpause (global_State *g);
+static int entersweep (lua_State *L);
+static l_mem atomic (lua_State *L);
+
+
+/*
+** Sweep a list of objects to enter generational mode. Deletes dead
+** objects and turns the non dead to old. All non-dead threads---which
+** are now old---must be in a gray list. Everything else is black.
+*/
+static void sweep2old (lua_State *L, GCObject **p) {
+  GCObject *curr;
+  global_State *g = G(L);
+  while ((curr = *p) != NULL) {
+    if (iswhite(curr)) {  /* is 'curr' dead? */
+      lua_assert(isdead(g, curr));
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {  /* all surviving objects become old */
+      setage(curr, G_OLD);
+      if (curr->tt == LUA_TTHREAD) {  /* threads must be watched */
+        lua_State *th = gco2th(curr);
+        lua_assert(isgray(curr));
+        linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
+      }
+      else  /* everything else is black */
+        gray2black(curr);
+      p = &curr->next;  /* go to next element */
+    }
+  }
+}
+
+
+/*
+** Sweep for generational mode. Delete dead objects. (Because the
+** collection is not incremental, there are no "new white" objects
+** during the sweep. So, any white object must be dead.) For
+** non-dead objects, advance their ages and clear the color of
+** new objects. (Old objects keep their colors.)
+** The ages of G_TOUCHED1 and G_TOUCHED2 objects cannot be advanced
+** here, because these old-generation objects are usually not swept
+** here.  They will all be advanced in 'correctgraylist'. That function
+** will also remove objects turned white here from any gray list.
+*/
+static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
+                            GCObject *limit, GCObject **pfirstold1) {
+  static const lu_byte nextage[] = {
+    G_SURVIVAL,  /* from G_NEW */
+    G_OLD1,      /* from G_SURVIVAL */
+    G_OLD1,      /* from G_OLD0 */
+    G_OLD,       /* from G_OLD1 */
+    G_OLD,       /* from G_OLD (do not change) */
+    G_TOUCHED1,  /* from G_TOUCHED1 (do not change) */
+    G_TOUCHED2   /* from G_TOUCHED2 (do not change) */
+  };
+  int white = luaC_white(g);
+  GCObject *curr;
+  while ((curr = *p) != limit) {
+    if (iswhite(curr)) {  /* is 'curr' dead? */
+      lua_assert(!isold(curr) && isdead(g, curr));
+      *p = curr->next;  /* remove 'curr' from list */
+      freeobj(L, curr);  /* erase 'curr' */
+    }
+    else {  /* correct mark and age */
+      if (getage(curr) == G_NEW) {  /* new objects go back to white */
+        int marked = curr->marked & maskgcbits;  /* erase GC bits */
+        curr->marked = cast_byte(marked | (G_SURVIVAL << AGEBIT) | white);
+      }
+      else {  /* all other objects will be old, and so keep their color */
+        setage(curr, nextage[getage(curr)]);
+        if (getage(curr) == G_OLD1 && *pfirstold1 == NULL)
+          *pfirstold1 = curr;  /* first OLD1 object in the list */
+      }
+      p = &curr->next;  /* go to next element */
+    }
+  }
+  return p;
+}
+
+
+/*
+** Traverse a list making all its elements white and clearing their
+** age. In incremental mode, all objects are 'new' all the time,
+** except for fixed strings (which are always old).
+*/
+static void whitelist (global_State *g, GCObject *p) {
+  int white = luaC_white(g);
+  for (; p != NULL; p = p->next)
+    p->marked = cast_byte((p->marked & maskgcbits) | white);
+}
+
+
+/*
+** Correct a list of gray objects. Return pointer to where rest of the
+** list should be linked.
+** Because this correction is done after sweeping, young objects might
+** be turned white and still be in the list. They are only removed.
+** 'TOUCHED1' objects are advanced to 'TOUCHED2' and remain on the list;
+** Non-white threads also remain on the list; 'TOUCHED2' objects become
+** regular old; they and anything else are removed from the list.
+*/
+static GCObject **correctgraylist (GCObject **p) {
+  GCObject *curr;
+  while ((curr = *p) != NULL) {
+    GCObject **next = getgclist(curr);
+    if (iswhite(curr))
+      *p = *next;  /* remove all white objects */
+    else if (getage(curr) == G_TOUCHED1) {  /* touched in this cycle? */
+      lua_assert(isgray(curr));
+      gray2black(curr);  /* make it black, for next barrier */
+      changeage(curr, G_TOUCHED1, G_TOUCHED2);
+      p = next;  /* keep it in the list and go to next element */
+    }
+    else if (curr->tt == LUA_TTHREAD) {
+      lua_assert(isgray(curr));
+      p = next;  /* keep non-white threads on the list */
+    }
+    else {  /* everything else is removed */
+      lua_assert(isold(curr));  /* young objects should be white here */
+      if (getage(curr) == G_TOUCHED2)  /* advance from TOUCHED2... */
+        changeage(curr, G_TOUCHED2, G_OLD);  /* ... to OLD */
+      gray2black(curr);  /* make object black (to be removed) */
+      *p = *next;
+    }
+  }
+  return p;
+}
+
+
+/*
+** Correct all gray lists, coalescing them into 'grayagain'.
+*/
+static void correctgraylists (global_State *g) {
+  GCObject **list = correctgraylist(&g->grayagain);
+  *list = g->weak; g->weak = NULL;
+  list = correctgraylist(list);
+  *list = g->allweak; g->allweak = NULL;
+  list = correctgraylist(list);
+  *list = g->ephemeron; g->ephemeron = NULL;
+  correctgraylist(list);
+}
+
+
+/*
+** Mark black 'OLD1' objects when starting a new young collection.
+** Gray objects are already in some gray list, and so will be visited
+** in the atomic step.
+*/
+static void markold (global_State *g, GCObject *from, GCObject *to) {
+  GCObject *p;
+  for (p = from; p != to; p = p->next) {
+    if (getage(p) == G_OLD1) {
+      lua_assert(!iswhite(p));
+      changeage(p, G_OLD1, G_OLD);  /* now they are old */
+      if (isblack(p)) {
+        black2gray(p);
+        reallymarkobject(g, p);  /* revisit its children */
+      }
+    }
+  }
+}
+
+
+/*
+** Finish a young-generation collection.
+*/
+static void finishgencycle (lua_State *L, global_State *g) {
+  correctgraylists(g);
+  checkSizes(L, g);
+  g->gcstate = GCSpropagate;  /* skip restart */
+  if (!g->gcemergency)
+    callallpendingfinalizers(L, 1);
+}
+
+
+/*
+** Does a young collection. First, mark 'OLD1' objects. Then does the
+** atomic step. Then, sweep all lists and advance pointers. Finally,
+** finish the collection.
+*/
+static void youngcollection (lua_State *L, global_State *g) {
+  GCObject **psurvival;  /* to point to first non-dead survival object */
+  GCObject *dummy;  /* dummy out parameter to 'sweepgen' */
+  lua_assert(g->gcstate == GCSpropagate);
+  if (g->firstold1) {  /* are there regular OLD1 objects? */
+    markold(g, g->firstold1, g->reallyold);  /* mark them */
+    g->firstold1 = NULL;  /* no more OLD1 objects (for now) */
+  }
+  markold(g, g->finobj, g->finobjrold);
+  markold(g, g->tobefnz, NULL);
+  atomic(L);
+  /* sweep nursery and get a pointer to its last live element */
+  g->gcstate = GCSswpallgc;
+  psurvival = sweepgen(L, g, &g->allgc, g->survival, &g->firstold1);
+  /* sweep 'survival' */
+  sweepgen(L, g, psurvival, g->old1, &g->firstold1);
+  g->reallyold = g->old1;
+  g->old1 = *psurvival;  /* 'survival' survivals are old now */
+  g->survival = g->allgc;  /* all news are survivals */
+  /* repeat for 'finobj' lists */
+  dummy = NULL;  /* no 'firstold1' optimization for 'finobj' lists */
+  psurvival = sweepgen(L, g, &g->finobj, g->finobjsur, &dummy);
+  /* sweep 'survival' */
+  sweepgen(L, g, psurvival, g->finobjold1, &dummy);
+  g->finobjrold = g->finobjold1;
+  g->finobjold1 = *psurvival;  /* 'survival' survivals are old now */
+  g->finobjsur = g->finobj;  /* all news are survivals */
+  sweepgen(L, g, &g->tobefnz, NULL, &dummy);
+  finishgencycle(L, g);
+}
+
+
+/*
+** Clears all gray lists (generational mode starts with all objects
+** black or in 'grayagain').
+*/
+static void cleargraylists (global_State *g) {
+  g->gray = g->grayagain = NULL;
+  g->weak = g->allweak = g->ephemeron = NULL;
+}
+
+
+/*
+** Clears all gray lists, sweeps objects, and prepare sublists to enter
+** generational mode. The sweeps remove dead objects and turn all
+** surviving objects to old. Threads go back to 'grayagain'; everything
+** else is turned black (not in any gray list). The main thread is not
+** in 'allgc', so it is handled apart.
+*/
+static void atomic2gen (lua_State *L, global_State *g) {
+  cleargraylists(g);
+  /* sweep all elements making them old */
+  g->gcstate = GCSswpallgc;
+  sweep2old(L, &g->allgc);
+  /* everything alive now is old */
+  g->reallyold = g->old1 = g->survival = g->allgc;
+  g->firstold1 = NULL;  /* there are no OLD1 objects anywhere */
+  /* repeat for 'finobj' lists */
+  sweep2old(L, &g->finobj);
+  g->finobjrold = g->finobjold1 = g->finobjsur = g->finobj;
+  sweep2old(L, &g->tobefnz);
+  lua_assert(isgray(g->mainthread));
+  setage(g->mainthread, G_OLD);
+  linkgclist(g->mainthread, g->grayagain);
+  g->gckind = KGC_GEN;
+  g->lastatomic = 0;
+  g->GCestimate = gettotalbytes(g);  /* base for memory control */
+  finishgencycle(L, g);
+}
+
+
+/*
+** Set debt for the next minor collection, which will happen when
+** memory grows 'genminormul'%.
+*/
+static void setminordebt (global_State *g) {
+  luaE_setdebt(g, -(cast(l_mem, (gettotalbytes(g) / 100)) * g->genminormul));
+}
+
+
+/*
+** Enter generational mode. Must go until the end of an atomic cycle
+** to ensure that all objects are correctly marked and weak tables
+** are cleared. Then, turn all objects into old and finishes the
+** collection.
+*/
+static l_mem entergen (lua_State *L, global_State *g) {
+  l_mem work;
+  luaC_runtilstate(L, bitmask(GCSpause));  /* prepare to start a new cycle */
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  work = atomic(L);  /* propagates all and then do the atomic stuff */
+  atomic2gen(L, g);
+  setminordebt(g);  /* set debt assuming next cycle will be minor */
+  return work;
+}
+
+
+/*
+** Enter incremental mode. Turn all objects white, make all
+** intermediate lists point to NULL (to avoid invalid pointers),
+** and go to the pause state.
+*/
+static void enterinc (global_State *g) {
+  whitelist(g, g->allgc);
+  g->reallyold = g->old1 = g->survival = NULL;
+  g->firstold1 = NULL;
+  whitelist(g, g->finobj);
+  whitelist(g, g->tobefnz);
+  g->finobjrold = g->finobjold1 = g->finobjsur = NULL;
+  whitelist(g, obj2gco(g->mainthread));  /* (its 'next' is always NULL) */
+  g->gcstate = GCSpause;
+  g->gckind = KGC_INC;
+  g->lastatomic = 0;
+}
+
+
+/*
+** Change collector mode to 'newmode'.
+*/
+void luaC_changemode (lua_State *L, int newmode) {
+  global_State *g = G(L);
+  if (newmode != g->gckind) {
+    if (newmode == KGC_GEN)  /* entering generational mode? */
+      entergen(L, g);
+    else
+      enterinc(g);  /* entering incremental mode */
+  }
+  g->lastatomic = 0;
+}
+
+
+/*
+** Does a full collection in generational mode.
+*/
+static l_mem fullgen (lua_State *L, global_State *g) {
+  enterinc(g);
+  return entergen(L, g);
+}
+
+
+/*
+** Does a major collection after last collection was a "bad
+** collection".
+**
+** When the program is building a big structure, it allocates lots of
+** memory but generates very little garbage. In those scenarios,
+** the generational mode just wastes time doing small collections, and
+** major collections are frequently what we call a "bad collection", a
+** collection that frees too few objects. To avoid the cost of switching
+** between generational mode and the incremental mode needed for full
+** (major) collections, the collector tries to stay in incremental mode
+** after a bad collection, and to switch back to generational mode only
+** after a "good" collection (one that traverses less than 9/8 the
+** memory traversed by the previous one). The collector must choose
+** whether to stay in incremental mode or to switch back to generational
+** mode before sweeping. At this point, it does not know the real memory
+** in use, so it cannot use memory to decide whether to return to
+** generational mode. Instead, it uses the traversal work done by
+** 'atomic' as an approximation. (A number of bytes traversed that
+** does not shrink much means a collection that freed too little.)
+*/
+static void stepgenfull (lua_State *L, global_State *g) {
+  lu_mem newatomic;  /* work done by this collection */
+  lu_mem lastatomic = g->lastatomic;  /* work from last collection */
+  if (g->gckind == KGC_GEN)  /* still in generational mode? */
+    enterinc(g);  /* enter incremental mode */
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  newatomic = cast(lu_mem, atomic(L));  /* mark everybody */
+  if (newatomic < lastatomic + (lastatomic >> 3)) {  /* good collection? */
+    atomic2gen(L, g);  /* return to generational mode */
+    setminordebt(g);
+  }
+  else {  /* another bad collection; stay in incremental mode */
+    g->GCestimate = gettotalbytes(g);  /* first estimate */
+    entersweep(L);
+    luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
+    setpause(g);
+    g->lastatomic = newatomic;
+  }
+}
+
+
+/*
+** Does a generational "step".
+** Usually, this means doing a minor collection and setting the debt to
+** make another collection when memory grows 'genminormul'% larger.
+**
+** However, there are exceptions. If memory grows 'genmajormul'%
+** larger than it was at the end of the last major collection (kept
+** in 'g->GCestimate'), the function does a major collection. At the
+** end, it checks whether the major collection was able to free a
+** decent amount of memory (at least half the growth in memory since
+** previous major collection). If so, the collector keeps its state,
+** and the next collection will probably be minor again. Otherwise,
+** we have what we call a "bad collection". In that case, set the field
+** 'g->lastatomic' to signal that fact, so that the next collection will
+** go to 'stepgenfull'.
+**
+** 'GCdebt <= 0' means an explicit call to GC step with "size" zero;
+** in that case, do a minor collection.
+*/
+static void genstep (lua_State *L, global_State *g) {
+  if (g->lastatomic != 0)  /* last collection was a bad one? */
+    stepgenfull(L, g);  /* do a full step */
+  else {
+    lu_mem majorbase = g->GCestimate;  /* memory after last major collection */
+    lu_mem majorinc = (majorbase / 100) * g->genmajormul;
+    if (g->GCdebt > 0 && gettotalbytes(g) > majorbase + majorinc) {
+      lu_mem work = cast(lu_mem, fullgen(L, g));  /* do a major collection */
+      if (gettotalbytes(g) < majorbase + (majorinc / 2)) {
+        /* collected at least half of memory growth since last major
+           collection; keep doing minor collections. */
+        lua_assert(g->lastatomic == 0);
+      }
+      else {  /* bad collection */
+        g->lastatomic = work;  /* signal that last collection was bad */
+        setpause(g);  /* do a long wait for next (major) collection */
+      }
+    }
+    else {  /* regular case; do a minor collection */
+      youngcollection(L, g);
+      setminordebt(g);
+      g->GCestimate = majorbase;  /* preserve base value */
+    }
+  }
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** GC control
@@ -969,12 +2081,14 @@ static int entersweep (lua_State *L) {
 
 void luaC_freeallobjects (lua_State *L) {
   global_State *g = G(L);
+  luaC_changemode(L, KGC_INC);
   separatetobefnz(g, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
   callallpendingfinalizers(L, 0);
   lua_assert(g->tobefnz == NULL);
+  luaC_setparallel(L, 1);  /* stop helper threads */
+  luaC_setbgfree(L, 0);
   g->currentwhite = WHITEBITS; /* this "white" makes all objects look dead */
-  g->gckind = KGC_NORMAL;
   sweepwholelist(L, &g->finobj);
   sweepwholelist(L, &g->allgc);
   sweepwholelist(L, &g->fixedgc);  /* collect fixed objects */
@@ -987,6 +2101,7 @@ static l_mem atomic (lua_State *L) {
   l_mem work;
   GCObject *origweak, *origall;
   GCObject *grayagain = g->grayagain;  /* save original list */
+  g->grayagain = NULL;
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
   g->gcstate = GCSinsideatomic;
@@ -997,10 +2112,10 @@ static l_mem atomic (lua_State *L) {
   markmt(g);  /* mark global metatables */
   /* remark occasional upvalues of (maybe) dead threads */
   remarkupvals(g);
-  propagateall(g);  /* propagate changes */
+  propagateallpar(g);  /* propagate changes */
   work = g->GCmemtrav;  /* stop counting (do not recount 'grayagain') */
   g->gray = grayagain;
-  propagateall(g);  /* traverse 'grayagain' list */
+  propagateallpar(g);  /* traverse 'grayagain' list */
   g->GCmemtrav = 0;  /* restart counting */
   convergeephemerons(g);
   /* at this point, all strongly accessible objects are marked. */
@@ -1065,7 +2180,7 @@ static lu_mem singlestep (lua_State *L) {
     case GCSatomic: {
       lu_mem work;
       int sw;
-      propagateall(g);  /* make sure gray list is empty */
+      propagateallpar(g);  /* make sure gray list is empty */
       work = atomic(L);  /* work is what was traversed by 'atomic' */
       sw = entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
@@ -1087,7 +2202,7 @@ static lu_mem singlestep (lua_State *L) {
       return 0;
     }
     case GCScallfin: {  /* call remaining finalizers */
-      if (g->tobefnz && g->gckind != KGC_EMERGENCY) {
+      if (g->tobefnz && !g->gcemergency) {
         int n = runafewfinalizers(L);
         return (n * GCFINALIZECOST);
       }
@@ -1128,15 +2243,10 @@ static l_mem getdebt (global_State *g) {
 }
 
 /*
-** performs a basic GC step when collector is running
+** performs a basic incremental step
 */
-void luaC_step (lua_State *L) {
-  global_State *g = G(L);
+static void incstep (lua_State *L, global_State *g) {
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
-  if (!g->gcrunning) {  /* not running? */
-    luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
-    return;
-  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1152,32 +2262,61 @@ void luaC_step (lua_State *L) {
 
 
 /*
-** Performs a full GC cycle; if 'isemergency', set a flag to avoid
-** some operations which could change the interpreter state in some
-** unexpected ways (running finalizers and shrinking some structures).
+** performs a basic GC step when collector is running ('lastatomic' set
+** means generational mode waiting to come back from a bad collection)
+*/
+void luaC_step (lua_State *L) {
+  global_State *g = G(L);
+  if (!g->gcrunning)  /* not running? */
+    luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
+  else if (g->gckind == KGC_GEN || g->lastatomic != 0)
+    genstep(L, g);
+  else
+    incstep(L, g);
+  luaC_syncfrees(L, 0);  /* hand this step's dead blocks */
+}
+
+
+/*
+** Performs a full GC cycle in incremental mode.
 ** Before running the collection, check 'keepinvariant'; if it is true,
 ** there may be some objects marked as black, so the collector has
 ** to sweep all objects to turn them back to white (as white has not
 ** changed, nothing will be collected).
 */
-void luaC_fullgc (lua_State *L, int isemergency) {
-  global_State *g = G(L);
-  lua_assert(g->gckind == KGC_NORMAL);
-  if (isemergency) g->gckind = KGC_EMERGENCY;  /* set flag */
+static void fullinc (lua_State *L, global_State *g) {
   if (keepinvariant(g)) {  /* black objects? */
     entersweep(L); /* sweep everything to turn them back to white */
   }
   /* finish any pending sweep phase to start a new cycle */
   luaC_runtilstate(L, bitmask(GCSpause));
   luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
+  g->gcstate = GCSatomic;  /* mark everything at once (maybe in parallel) */
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
   lua_assert(g->GCestimate == gettotalbytes(g));
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
-  g->gckind = KGC_NORMAL;
   setpause(g);
 }
 
+
+/*
+** Performs a full GC cycle; if 'isemergency', set a flag to avoid
+** some operations which could change the interpreter state in some
+** unexpected ways (running finalizers and shrinking some structures).
+*/
+void luaC_fullgc (lua_State *L, int isemergency) {
+  global_State *g = G(L);
+  lua_assert(!g->gcemergency);
+  g->gcemergency = isemergency;  /* set flag */
+  if (g->gckind == KGC_INC)
+    fullinc(L, g);
+  else
+    fullgen(L, g);
+  g->gcemergency = 0;
+  luaC_syncfrees(L, isemergency);  /* an emergency needs the memory now */
+}
+
 /* }====================================================== */
 
 
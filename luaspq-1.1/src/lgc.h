@@ -10,6 +10,7 @@
 
 #include "lobject.h"
 #include "lstate.h"
+#include "lthread.h"
 
 /*
 ** Collectable objects may have one of three colors: white, which
@@ -22,6 +23,11 @@
 ** allweak, ephemeron) so that it can be visited again before finishing
 ** the collection cycle. These lists have no meaning when the invariant
 ** is not being enforced (e.g., sweep phase).
+**
+** In generational mode, objects also have an age. A minor collection
+** traverses only young objects (plus old ones touched by a barrier)
+** and frees only young ones; old objects are black and are revisited
+** only by a major (full) collection.
 */
 
 
@@ -55,7 +61,9 @@
 ** ones) must be kept. During a collection, the sweep
 ** phase may break the invariant, as objects turned white may point to
 ** still-black objects. The invariant is restored when sweep ends and
-** all objects are white again.
+** all objects are white again. (In generational mode the collector
+** stays in 'GCSpropagate' between collections, so the invariant is
+** always kept.)
 */
 
 #define keepinvariant(g)	((g)->gcstate <= GCSatomic)
@@ -79,28 +87,63 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define AGEBIT		4  /* bits 4-6 keep the age of the object */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
 
 
-#define iswhite(x)      testbits((x)->marked, WHITEBITS)
-#define isblack(x)      testbit((x)->marked, BLACKBIT)
+/*
+** With parallel marking, markers read the 'marked' field of objects
+** that other markers are changing, so its accesses are atomic
+*/
+#if defined(LUA_USE_GCTHREADS)
+#define getmarked(x)	l_loadbyte(&(x)->marked)
+#define setmarked(x,m)	l_storebyte(&(x)->marked, cast_byte(m))
+#else
+#define getmarked(x)	((x)->marked)
+#define setmarked(x,m)	((x)->marked = cast_byte(m))
+#endif
+
+
+#define iswhite(x)      testbits(getmarked(x), WHITEBITS)
+#define isblack(x)      testbit(getmarked(x), BLACKBIT)
 #define isgray(x)  /* neither white nor black */  \
-	(!testbits((x)->marked, WHITEBITS | bitmask(BLACKBIT)))
+	(!testbits(getmarked(x), WHITEBITS | bitmask(BLACKBIT)))
 
-#define tofinalize(x)	testbit((x)->marked, FINALIZEDBIT)
+#define tofinalize(x)	testbit(getmarked(x), FINALIZEDBIT)
 
 #define otherwhite(g)	((g)->currentwhite ^ WHITEBITS)
 #define isdeadm(ow,m)	(!(((m) ^ WHITEBITS) & (ow)))
-#define isdead(g,v)	isdeadm(otherwhite(g), (v)->marked)
+#define isdead(g,v)	isdeadm(otherwhite(g), getmarked(v))
 
 #define changewhite(x)	((x)->marked ^= WHITEBITS)
-#define gray2black(x)	l_setbit((x)->marked, BLACKBIT)
+#define gray2black(x)	setmarked(x, getmarked(x) | bitmask(BLACKBIT))
 
 #define luaC_white(g)	cast(lu_byte, (g)->currentwhite & WHITEBITS)
 
 
+/* object age in generational mode */
+#define G_NEW		0	/* created in current cycle */
+#define G_SURVIVAL	1	/* created in previous cycle */
+#define G_OLD0		2	/* marked old by frw. barrier in this cycle */
+#define G_OLD1		3	/* first full cycle as old */
+#define G_OLD		4	/* really old object (not to be visited) */
+#define G_TOUCHED1	5	/* old object touched this cycle */
+#define G_TOUCHED2	6	/* old object touched in previous cycle */
+
+#define AGEBITS		(7 << AGEBIT)
+
+#define getage(o)	((getmarked(o) & AGEBITS) >> AGEBIT)
+#define setage(o,a)  \
+	setmarked(o, (getmarked(o) & ~AGEBITS) | ((a) << AGEBIT))
+#define isold(o)	(getage(o) > G_SURVIVAL)
+
+#define changeage(o,f,t)  \
+	check_exp(getage(o) == (f),  \
+	          setmarked(o, getmarked(o) ^ (((f)^(t)) << AGEBIT)))
+
+
 /*
 ** Does one step of collection when debt becomes positive. 'pre'/'pos'
 ** allows some adjustments to be done only when needed. macro
@@ -142,6 +185,13 @@ LUAI_FUNC void luaC_barrierback_ (lua_State *L, Table *o);
 LUAI_FUNC void luaC_upvalbarrier_ (lua_State *L, UpVal *uv);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_upvdeccount (lua_State *L, UpVal *uv);
+LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
+LUAI_FUNC int luaC_setparallel (lua_State *L, int n);
+LUAI_FUNC int luaC_setbgfree (lua_State *L, int on);
+LUAI_FUNC void luaC_syncfrees (lua_State *L, int wait);
+#if defined(LUA_USE_GCTHREADS)
+LUAI_FUNC int luaC_deferfree (global_State *g, void *block, size_t size);
+#endif
 
 
 #endif
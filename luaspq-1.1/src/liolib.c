@@ -614,10 +614,9 @@ static int g_write (lua_State *L, FILE *f, int arg) {
   for (; nargs--; arg++) {
     if (lua_type(L, arg) == LUA_TNUMBER) {
       /* optimization: could be done exactly as for strings */
-      int len = lua_isinteger(L, arg)
-                ? fprintf(f, LUA_INTEGER_FMT, lua_tointeger(L, arg))
-                : fprintf(f, LUA_NUMBER_FMT, lua_tonumber(L, arg));
-      status = status && (len > 0);
+      char buff[LUA_NUMBUFFSIZE];
+      size_t len = lua_numbertobuff(L, arg, buff, -1);
+      status = status && (fwrite(buff, sizeof(char), len, f) == len);
     }
     else {
       size_t l;
@@ -178,6 +178,22 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** Substrings of long strings with at least LUAI_MINSLICE bytes (which
+** must be more than LUAI_MAXSHORTLEN) share the bytes of the original
+** string instead of copying them, as long as the string owning those
+** bytes is at most LUAI_SLICERATIO times longer than the substring;
+** so, a slice never keeps alive more than that many times its size.
+*/
+#if !defined(LUAI_MINSLICE)
+#define LUAI_MINSLICE		64
+#endif
+
+#if !defined(LUAI_SLICERATIO)
+#define LUAI_SLICERATIO		8
+#endif
+
+
 /*
 ** Initial size for the string table (must be power of 2).
 ** The Lua core alone registers ~50 strings (reserved words +
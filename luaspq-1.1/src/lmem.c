@@ -82,6 +82,13 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
 #if defined(HARDMEMTESTS)
   if (nsize > realosize && g->gcrunning)
     luaC_fullgc(L, 1);  /* force a GC whenever possible */
+#endif
+#if defined(LUA_USE_GCTHREADS)
+  if (nsize == 0 && g->gcdeferfree && block != NULL &&
+      luaC_deferfree(g, block, osize)) {  /* freed by the freeing thread? */
+    g->GCdebt -= osize;
+    return NULL;
+  }
 #endif
   newblock = (*g->frealloc)(g->ud, block, osize, nsize);
   if (newblock == NULL && nsize > 0) {
@@ -93,6 +100,11 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
     if (newblock == NULL)
       luaD_throw(L, LUA_ERRMEM);
   }
+  if (block == NULL && newblock != NULL && !ptrfits(newblock)) {
+    /* values could not hold its address (see 'LUA_NANBOXING') */
+    (*g->frealloc)(g->ud, newblock, nsize, 0);
+    luaD_throw(L, LUA_ERRMEM);
+  }
   lua_assert((nsize == 0) == (newblock == NULL));
   g->GCdebt = (g->GCdebt + nsize) - realosize;
   return newblock;
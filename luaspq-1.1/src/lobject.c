@@ -33,6 +33,37 @@
 LUAI_DDEF const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
+#if defined(LUA_NANBOXING)
+
+/* type tags for each NaN-boxing code (code 0 is a float) */
+LUAI_DDEF const lu_byte luaO_nbtag_[16] = {
+  LUA_TNUMFLT, LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA,
+  LUA_TNUMINT, LUA_TDEADKEY, LUA_TLCF, ctb(LUA_TLCL),
+  ctb(LUA_TCCL), ctb(LUA_TSHRSTR), ctb(LUA_TLNGSTR), ctb(LUA_TTABLE),
+  ctb(LUA_TUSERDATA), ctb(LUA_TTHREAD), ctb(LUA_TPROTO), LUA_TNONE & 0xFF
+};
+
+
+/*
+** converts the tag of a collectable object into its NaN-boxing code
+*/
+int luaO_nbcode (int tt) {
+  switch (tt) {
+    case LUA_TLCL: return NBC_LCL;
+    case LUA_TCCL: return NBC_CCL;
+    case LUA_TSHRSTR: return NBC_SHRSTR;
+    case LUA_TLNGSTR: return NBC_LNGSTR;
+    case LUA_TTABLE: return NBC_TABLE;
+    case LUA_TUSERDATA: return NBC_USERDATA;
+    case LUA_TTHREAD: return NBC_THREAD;
+    case LUA_TPROTO: return NBC_PROTO;
+    default: lua_assert(0); return NBC_NIL;
+  }
+}
+
+#endif
+
+
 /*
 ** converts an integer to a "floating point byte", represented as
 ** (eeeeexxx), where the real value is (1xxx) * 2^(eeeee - 1) if
@@ -243,8 +274,89 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 /* }====================================================== */
 
 
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* exact powers of 10 for 'l_str2dfast' */
+static const double str2dpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/*
+** Fast conversion of a decimal numeral to a double, always with '.' as
+** the decimal point. It handles numerals whose significant digits fit
+** exactly in a double (at most 15 of them) and whose decimal exponent
+** is at most 22 in absolute value: then both the digits and the power
+** of 10 are exact, and a single (correctly rounded) multiplication or
+** division gives the correctly rounded result. Returns NULL for
+** anything else, which 'strtod' will then handle.
+*/
+static const char *l_str2dfast (const char *s, lua_Number *result) {
+  double r = 0;
+  int sigdig = 0;  /* number of significant digits */
+  int nodigits = 1;
+  int e = 0;  /* decimal exponent */
+  int neg;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (; lisdigit(cast_uchar(*s)); s++) {  /* integral part */
+    nodigits = 0;
+    if (sigdig > 0 || *s != '0') {
+      if (++sigdig > 15) return NULL;  /* too many digits */
+      r = r * 10 + (*s - '0');
+    }
+  }
+  if (*s == '.') {
+    for (s++; lisdigit(cast_uchar(*s)); s++) {  /* fractional part */
+      nodigits = 0;
+      if (sigdig > 0 || *s != '0') {
+        if (++sigdig > 15) return NULL;  /* too many digits */
+        r = r * 10 + (*s - '0');
+      }
+      e--;
+    }
+  }
+  if (nodigits) return NULL;
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int exp1 = 0;
+    int neg1;
+    s++;  /* skip 'e' */
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s)))
+      return NULL;  /* invalid; must have at least one digit */
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      if (exp1 > 1000) return NULL;  /* too large */
+      exp1 = exp1 * 10 + (*s - '0');
+    }
+    e += (neg1) ? -exp1 : exp1;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0') return NULL;  /* not a simple numeral */
+  if (e < 0) {
+    if (e < -22) return NULL;
+    r /= str2dpow10[-e];
+  }
+  else if (e > 0) {
+    if (e > 22) return NULL;
+    r *= str2dpow10[e];
+  }
+  *result = (neg) ? -r : r;
+  return s;
+}
+
+#else				/* }{ */
+
+#define l_str2dfast(s,r)	NULL
+
+#endif				/* } */
+
+
 static const char *l_str2d (const char *s, lua_Number *result) {
   char *endptr;
+  const char *e;
+  if ((e = l_str2dfast(s, result)) != NULL)  /* common case? */
+    return e;
   if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
     return NULL;
   else if (strpbrk(s, "xX"))  /* hex? */
@@ -319,21 +431,206 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
+/*
+** {======================================================
+** Number formatting
+** =======================================================
+*/
+
 /* maximum length of the conversion of a number to a string */
-#define MAXNUMBER2STR	50
+#define MAXNUMBER2STR	LUA_NUMBUFFSIZE
+
+
+static const char digitpairs[] =
+  "00010203040506070809101112131415161718192021222324"
+  "25262728293031323334353637383940414243444546474849"
+  "50515253545556575859606162636465666768697071727374"
+  "75767778798081828384858687888990919293949596979899";
 
 
 /*
-** Convert a number object to a string
+** Write the decimal digits of 'u' backwards, ending at 'p'; returns
+** the first digit written. Digits go two at a time.
 */
-void luaO_tostring (lua_State *L, StkId obj) {
-  char buff[MAXNUMBER2STR];
+static char *writedigits (char *p, lua_Unsigned u) {
+  while (u >= 100) {
+    int d = cast_int(u % 100) * 2;
+    u /= 100;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  if (u >= 10) {
+    int d = cast_int(u) * 2;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  else
+    *--p = cast(char, '0' + cast_int(u));
+  return p;
+}
+
+
+/*
+** Convert an integer to its decimal representation (the same as
+** 'lua_integer2str' with the default LUA_INTEGER_FMT)
+*/
+int luaO_int2str (char *buff, lua_Integer i) {
+  char temp[MAXNUMBER2STR];
+  char *end = temp + sizeof(temp);
+  lua_Unsigned u = l_castS2U(i);
+  char *p = writedigits(end, (i < 0) ? 0u - u : u);
+  int len;
+  if (i < 0) *--p = '-';
+  len = cast_int(end - p);
+  memcpy(buff, p, len);
+  buff[len] = '\0';
+  return len;
+}
+
+
+/*
+** Number of significant digits in LUA_NUMBER_FMT, when 'luaO_num2str'
+** can produce it by itself. Only the default format for doubles ("%.14g")
+** has a fast path; other configurations use 'lua_number2str'.
+*/
+#if !defined(LUAI_NUMPREC) && LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE
+#define LUAI_NUMPREC	14
+#endif
+
+
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* powers of 10 that are exact in a double */
+static const double powersof10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/*
+** Fast conversion of a float 'n' as "%.<prec>g" would do it. It looks
+** for the shortest decimal 'r * 10^-p', with 'r' an integer of at most
+** 'prec' digits, that reads back as 'n' (IEEE division is correctly
+** rounded, so 'r / 10^p == n' proves that). As 'n' is then within half
+** an ulp of that decimal, rounding it to 'prec' digits gives exactly
+** those digits. Returns 0 when there is no such decimal (or 'n' is not
+** finite); the caller then falls back to 'snprintf'.
+*/
+static int fastnum2str (char *buff, double n, int prec) {
+  double a = (n < 0) ? -n : n;
+  double limit, r;
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *d;
+  int p, nd, x;
+  char *b = buff;
+  if (prec <= 0 || prec > 15)  /* 'prec' digits must fit in a double */
+    return 0;
+  if (n == 0) {  /* zero (+0 or -0)? */
+    if (1 / n < 0) *b++ = '-';
+    *b++ = '0';
+    *b = '\0';
+    return cast_int(b - buff);
+  }
+  limit = powersof10[prec];
+  for (p = 0; ; p++) {  /* look for the shortest decimal */
+    double m;
+    if (p >= (int)(sizeof(powersof10) / sizeof(powersof10[0])))
+      return 0;
+    m = a * powersof10[p];
+    if (!(m < limit))  /* too many digits (or not a finite number)? */
+      return 0;
+    r = floor(m + 0.5);
+    if (r / powersof10[p] == a)
+      break;
+  }
+  {  /* write digits of 'r' (less than 10^15) in two pieces */
+    lua_Unsigned hi = (lua_Unsigned)(r / 1e8);
+    lua_Unsigned lo = (lua_Unsigned)(r - (double)hi * 1e8);
+    d = writedigits(end, lo);
+    if (hi > 0) {
+      while (d > end - 8) *--d = '0';  /* pad 'lo' to 8 digits */
+      d = writedigits(d, hi);
+    }
+  }
+  while (end[-1] == '0') { end--; p--; }  /* remove trailing zeros */
+  nd = cast_int(end - d);
+  x = nd - 1 - p;  /* decimal exponent of first digit */
+  if (n < 0) *b++ = '-';
+  if (x < -4 || x >= prec) {  /* exponential format */
+    *b++ = *d++;
+    if (d < end) {
+      *b++ = lua_getlocaledecpoint();
+      while (d < end) *b++ = *d++;
+    }
+    *b++ = 'e';
+    *b++ = (x < 0) ? '-' : '+';
+    if (x < 0) x = -x;
+    if (x >= 100) *b++ = cast(char, '0' + x / 100);
+    *b++ = cast(char, '0' + (x / 10) % 10);
+    *b++ = cast(char, '0' + x % 10);
+  }
+  else if (x >= 0) {  /* fixed format, with an integral part */
+    int i;
+    for (i = 0; i <= x; i++)
+      *b++ = (d < end) ? *d++ : '0';
+    if (d < end) {
+      *b++ = lua_getlocaledecpoint();
+      while (d < end) *b++ = *d++;
+    }
+  }
+  else {  /* fixed format, less than 1 */
+    *b++ = '0';
+    *b++ = lua_getlocaledecpoint();
+    while (++x < 0) *b++ = '0';
+    while (d < end) *b++ = *d++;
+  }
+  *b = '\0';
+  return cast_int(b - buff);
+}
+
+#else				/* }{ */
+
+#define fastnum2str(b,n,prec)	0
+
+#endif				/* } */
+
+
+/*
+** Convert a float to a string, as "%.<prec>g" would do it, or as
+** 'lua_number2str' does if 'prec' is negative. 'buff' must have room
+** for MAXNUMBER2STR bytes.
+*/
+int luaO_num2str (char *buff, lua_Number n, int prec) {
+  int len;
+  if (prec < 0) {  /* default format? */
+#if defined(LUAI_NUMPREC)
+    if ((len = fastnum2str(buff, n, LUAI_NUMPREC)) > 0)
+      return len;
+#endif
+    return lua_number2str(buff, MAXNUMBER2STR, n);
+  }
+  if ((len = fastnum2str(buff, n, prec)) > 0)
+    return len;
+  else {
+    char form[16];  /* "%.<prec>g" with length modifier */
+    l_sprintf(form, sizeof(form), "%%.%d" LUA_NUMBER_FRMLEN "g", prec);
+    return l_sprintf(buff, MAXNUMBER2STR, form, (LUAI_UACNUMBER)n);
+  }
+}
+
+
+/*
+** Write the string form of number 'obj' into 'buff' (with room for
+** MAXNUMBER2STR bytes), as 'luaO_tostring' does; returns its length
+*/
+size_t luaO_tostringbuff (char *buff, const TValue *obj) {
   size_t len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, sizeof(buff), ivalue(obj));
+    len = luaO_int2str(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, sizeof(buff), fltvalue(obj));
+    len = luaO_num2str(buff, fltvalue(obj), -1);
 #if !defined(LUA_COMPAT_FLOATSTRING)
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
@@ -341,9 +638,21 @@ void luaO_tostring (lua_State *L, StkId obj) {
     }
 #endif
   }
+  return len;
+}
+
+
+/*
+** Convert a number object to a string
+*/
+void luaO_tostring (lua_State *L, StkId obj) {
+  char buff[MAXNUMBER2STR];
+  size_t len = luaO_tostringbuff(buff, obj);
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
 
+/* }====================================================== */
+
 
 static void pushstr (lua_State *L, const char *str, size_t l) {
   setsvalue2s(L, L->top, luaS_newlstr(L, str, l));
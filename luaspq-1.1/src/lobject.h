@@ -94,6 +94,8 @@ struct GCObject {
 ** an actual value plus a tag with its type.
 */
 
+#if !defined(LUA_NANBOXING)	/* { */
+
 /*
 ** Union of all Lua values
 */
@@ -126,6 +128,104 @@ typedef struct lua_TValue {
 /* raw type tag of a TValue */
 #define rttype(o)	((o)->tt_)
 
+/* any pointer fits in a value */
+#define ptrfits(p)	1
+
+#else				/* }{ */
+
+/*
+** NaN boxing: a value is a single 64-bit word. Floats are kept as they
+** are; any other value lives in the payload of a negative quiet NaN,
+** a bit pattern that stored floats never have (NaNs are canonicalized
+** when stored). Layout of a boxed value:
+**   bits 51-63: all ones (sign, exponent, and quiet bit)
+**   bits 47-50: a compact code for the type tag (1-15; see 'NBC_*')
+**   bits 0-46: payload (pointer, 32-bit integer, or boolean)
+*/
+
+#if LUA_FLOAT_TYPE != LUA_FLOAT_DOUBLE || LUA_INT_TYPE != LUA_INT_INT
+#error "LUA_NANBOXING needs 'double' floats and 'int' integers"
+#endif
+
+typedef unsigned long long lu_nbword;
+
+typedef union Value {
+  lu_nbword w;     /* raw bits */
+  lua_Number n;    /* float numbers */
+} Value;
+
+
+#define TValuefields	Value value_
+
+
+typedef struct lua_TValue {
+  TValuefields;
+} TValue;
+
+
+/* codes for boxed values (see 'luaO_nbtag_' for their tags) */
+#define NBC_NIL		1
+#define NBC_BOOLEAN	2
+#define NBC_LIGHTUD	3
+#define NBC_INT		4
+#define NBC_DEADKEY	5
+#define NBC_LCF		6
+#define NBC_LCL		7	/* first collectable code */
+#define NBC_CCL		8
+#define NBC_SHRSTR	9
+#define NBC_LNGSTR	10
+#define NBC_TABLE	11
+#define NBC_USERDATA	12
+#define NBC_THREAD	13
+#define NBC_PROTO	14
+
+#define NB_PAYLOADBITS	47
+#define NB_PAYLOAD	((cast(lu_nbword, 1) << NB_PAYLOADBITS) - 1)
+
+/* high 17 bits of a boxed value with code 0 */
+#define NB_HIGHBASE	0x1FFF0u
+
+#define nb_high(w)	((w) >> NB_PAYLOADBITS)
+#define nb_box(c,p)  \
+	((cast(lu_nbword, NB_HIGHBASE | (c)) << NB_PAYLOADBITS) | (p))
+#define nb_ptrbits(p)	cast(lu_nbword, cast(size_t, (p)))
+
+/* true if pointer 'p' fits in the payload of a boxed value */
+#define ptrfits(p)	((nb_ptrbits(p) & ~NB_PAYLOAD) == 0)
+
+/* the only NaN stored in a value */
+#define NB_CANONNAN	(cast(lu_nbword, 0x7FF8) << 48)
+
+#define NB_NIL		nb_box(NBC_NIL, 0)
+
+
+/* macro defining a nil value */
+#define NILCONSTANT	{NB_NIL}
+
+
+#define val_(o)		((o)->value_)
+
+
+/* code of a value (0 for floats) */
+#define nb_code(o)  \
+	(nb_high(val_(o).w) > NB_HIGHBASE ? \
+	 cast_int(nb_high(val_(o).w) - NB_HIGHBASE) : 0)
+
+#define nb_is(o,c)	(nb_high(val_(o).w) == (NB_HIGHBASE | (c)))
+
+/* code of 'o' is in the interval [lo,hi] */
+#define nb_between(o,lo,hi)  \
+	(nb_high(val_(o).w) - (NB_HIGHBASE | (lo)) <= cast(lu_nbword, (hi) - (lo)))
+
+#define nb_payload(o)	(val_(o).w & NB_PAYLOAD)
+#define nb_ptr(o)	cast(void *, cast(size_t, nb_payload(o)))
+
+
+/* raw type tag of a TValue */
+#define rttype(o)	(luaO_nbtag_[nb_code(o)])
+
+#endif				/* } */
+
 /* tag with no variants (bits 0-3) */
 #define novariant(x)	((x) & 0x0F)
 
@@ -136,6 +236,8 @@ typedef struct lua_TValue {
 #define ttnov(o)	(novariant(rttype(o)))
 
 
+#if !defined(LUA_NANBOXING)	/* { */
+
 /* Macros to test type */
 #define checktag(o,t)		(rttype(o) == (t))
 #define checktype(o,t)		(ttnov(o) == (t))
@@ -178,20 +280,10 @@ typedef struct lua_TValue {
 /* a dead value may get the 'gc' field, but cannot access its contents */
 #define deadvalue(o)	check_exp(ttisdeadkey(o), cast(void *, val_(o).gc))
 
-#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
-
 
 #define iscollectable(o)	(rttype(o) & BIT_ISCOLLECTABLE)
 
 
-/* Macros for internal tests */
-#define righttt(obj)		(ttype(obj) == gcvalue(obj)->tt)
-
-#define checkliveness(L,obj) \
-	lua_longassert(!iscollectable(obj) || \
-		(righttt(obj) && (L == NULL || !isdead(G(L),gcvalue(obj)))))
-
-
 /* Macros to set values */
 #define settt_(o,t)	((o)->tt_=(t))
 
@@ -254,6 +346,123 @@ typedef struct lua_TValue {
 
 #define setdeadvalue(obj)	settt_(obj, LUA_TDEADKEY)
 
+#else				/* }{ */
+
+/* Macros to test type */
+#define checktag(o,t)		(rttype(o) == (t))
+#define checktype(o,t)		(ttnov(o) == (t))
+#define ttisnumber(o)		(ttisfloat(o) || ttisinteger(o))
+#define ttisfloat(o)		(val_(o).w < nb_box(NBC_NIL, 0))
+#define ttisinteger(o)		nb_is((o), NBC_INT)
+#define ttisnil(o)		nb_is((o), NBC_NIL)
+#define ttisboolean(o)		nb_is((o), NBC_BOOLEAN)
+#define ttislightuserdata(o)	nb_is((o), NBC_LIGHTUD)
+#define ttisstring(o)		nb_between((o), NBC_SHRSTR, NBC_LNGSTR)
+#define ttisshrstring(o)	nb_is((o), NBC_SHRSTR)
+#define ttislngstring(o)	nb_is((o), NBC_LNGSTR)
+#define ttistable(o)		nb_is((o), NBC_TABLE)
+#define ttisfunction(o)		nb_between((o), NBC_LCF, NBC_CCL)
+#define ttisclosure(o)		nb_between((o), NBC_LCL, NBC_CCL)
+#define ttisCclosure(o)		nb_is((o), NBC_CCL)
+#define ttisLclosure(o)		nb_is((o), NBC_LCL)
+#define ttislcf(o)		nb_is((o), NBC_LCF)
+#define ttisfulluserdata(o)	nb_is((o), NBC_USERDATA)
+#define ttisthread(o)		nb_is((o), NBC_THREAD)
+#define ttisdeadkey(o)		nb_is((o), NBC_DEADKEY)
+
+
+/* Macros to access values */
+#define ivalue(o)	check_exp(ttisinteger(o), \
+	l_castU2S(cast(lua_Unsigned, val_(o).w)))
+#define fltvalue(o)	check_exp(ttisfloat(o), val_(o).n)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
+#define gcvalue(o)	check_exp(iscollectable(o), cast(GCObject *, nb_ptr(o)))
+#define pvalue(o)	check_exp(ttislightuserdata(o), nb_ptr(o))
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(nb_ptr(o)))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(nb_ptr(o)))
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(nb_ptr(o)))
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(nb_ptr(o)))
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(nb_ptr(o)))
+#define fvalue(o)  \
+	check_exp(ttislcf(o), cast(lua_CFunction, cast(size_t, nb_payload(o))))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(nb_ptr(o)))
+#define bvalue(o)	check_exp(ttisboolean(o), cast_int(val_(o).w & 1))
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(nb_ptr(o)))
+/* a dead value keeps its pointer, but cannot access its contents */
+#define deadvalue(o)	check_exp(ttisdeadkey(o), nb_ptr(o))
+
+
+#define iscollectable(o)	nb_between((o), NBC_LCL, NBC_PROTO)
+
+
+/* Macros to set values */
+#define nb_setbox(obj,c,p) \
+  { TValue *io=(obj); lua_assert(((p) & ~NB_PAYLOAD) == 0); \
+    val_(io).w = nb_box(c, p); }
+
+#define nb_setgco(L,obj,c,x) \
+  { TValue *io=(obj); lua_assert(ptrfits(x)); \
+    val_(io).w = nb_box(c, nb_ptrbits(x)); checkliveness(L,io); }
+
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); \
+    if (luai_numisnan(n_)) val_(io).w = NB_CANONNAN; else val_(io).n = n_; }
+
+#define chgfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); lua_assert(ttisfloat(io)); \
+    if (luai_numisnan(n_)) val_(io).w = NB_CANONNAN; else val_(io).n = n_; }
+
+#define setivalue(obj,x) \
+  { TValue *io=(obj); \
+    val_(io).w = nb_box(NBC_INT, cast(lu_nbword, l_castS2U(x))); }
+
+#define chgivalue(obj,x) \
+  { TValue *io=(obj); lua_assert(ttisinteger(io)); \
+    val_(io).w = nb_box(NBC_INT, cast(lu_nbword, l_castS2U(x))); }
+
+#define setnilvalue(obj) (val_(obj).w = NB_NIL)
+
+#define setfvalue(obj,x)	nb_setbox(obj, NBC_LCF, nb_ptrbits(x))
+
+#define setpvalue(obj,x)	nb_setbox(obj, NBC_LIGHTUD, nb_ptrbits(x))
+
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); val_(io).w = nb_box(NBC_BOOLEAN, (x) != 0); }
+
+#define setgcovalue(L,obj,x) \
+  { GCObject *i_g=(x); nb_setgco(L, obj, luaO_nbcode(i_g->tt), i_g); }
+
+#define setsvalue(L,obj,x) \
+  { TString *x_ = (x); \
+    nb_setgco(L, obj, x_->tt == LUA_TSHRSTR ? NBC_SHRSTR : NBC_LNGSTR, x_); }
+
+#define setuvalue(L,obj,x)	nb_setgco(L, obj, NBC_USERDATA, (Udata *)(x))
+
+#define setthvalue(L,obj,x)	nb_setgco(L, obj, NBC_THREAD, (lua_State *)(x))
+
+#define setclLvalue(L,obj,x)	nb_setgco(L, obj, NBC_LCL, (LClosure *)(x))
+
+#define setclCvalue(L,obj,x)	nb_setgco(L, obj, NBC_CCL, (CClosure *)(x))
+
+#define sethvalue(L,obj,x)	nb_setgco(L, obj, NBC_TABLE, (Table *)(x))
+
+#define setdeadvalue(obj)  \
+	(val_(obj).w = nb_box(NBC_DEADKEY, val_(obj).w & NB_PAYLOAD))
+
+#endif				/* } */
+
+
+#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
+
+
+/* Macros for internal tests */
+#define righttt(obj)		(ttype(obj) == gcvalue(obj)->tt)
+
+#define checkliveness(L,obj) \
+	lua_longassert(!iscollectable(obj) || \
+		(righttt(obj) && (L == NULL || !isdead(G(L),gcvalue(obj)))))
+
 
 
 #define setobj(L,obj1,obj2) \
@@ -302,7 +511,8 @@ typedef TValue *StkId;  /* index to stack elements */
 */
 typedef struct TString {
   CommonHeader;
-  lu_byte extra;  /* reserved words for short strings; "has hash" for longs */
+  lu_byte extra;  /* reserved words for short strings; "has hash" (bit 0)
+                     and SLICEBIT for longs */
   lu_byte shrlen;  /* length for short strings */
   unsigned int hash;
   union {
@@ -321,12 +531,33 @@ typedef union UTString {
 } UTString;
 
 
+/*
+** A slice is a long string whose bytes are part of another long
+** string, its 'parent', instead of following its header. Unlike other
+** strings, its bytes may not be followed by a '\0'; code that needs
+** that mark uses 'luaS_terminate', which gives such a slice its own
+** copy of its bytes (and then 'parent' is NULL). Slices are marked by
+** SLICEBIT in 'extra'; short strings never have that bit set.
+*/
+typedef struct Slice {
+  UTString h;
+  TString *parent;  /* string owning the bytes (never a shared slice) */
+  char *contents;  /* first byte of the slice */
+} Slice;
+
+#define SLICEBIT	(1 << 7)
+
+#define isslice(ts)	((ts)->extra & SLICEBIT)
+
+#define gslice(ts)	check_exp(isslice(ts), cast(Slice *, (ts)))
+
+
 /*
 ** Get the actual string (array of bytes) from a 'TString'.
 ** (Access to 'extra' ensures that value is really a 'TString'.)
 */
 #define getstr(ts)  \
-  check_exp(sizeof((ts)->extra), cast(char *, (ts)) + sizeof(UTString))
+  (isslice(ts) ? gslice(ts)->contents : cast(char *, (ts)) + sizeof(UTString))
 
 
 /* get the actual string (array of bytes) from a Lua value */
@@ -338,6 +569,9 @@ typedef union UTString {
 /* get string length from 'TValue *o' */
 #define vslen(o)	tsslen(tsvalue(o))
 
+/* true if the bytes of 'ts' are followed by a '\0' (only slices may not) */
+#define isterminated(ts)	(getstr(ts)[tsslen(ts)] == '\0')
+
 
 /*
 ** Header for userdata; memory area follows the end of this structure
@@ -368,6 +602,8 @@ typedef union UUdata {
 #define getudatamem(u)  \
   check_exp(sizeof((u)->ttuv_), (cast(char*, (u)) + sizeof(UUdata)))
 
+#if !defined(LUA_NANBOXING)	/* { */
+
 #define setuservalue(L,u,o) \
 	{ const TValue *io=(o); Udata *iu = (u); \
 	  iu->user_ = io->value_; iu->ttuv_ = rttype(io); \
@@ -379,6 +615,20 @@ typedef union UUdata {
 	  io->value_ = iu->user_; settt_(io, iu->ttuv_); \
 	  checkliveness(L,io); }
 
+#else				/* }{ */
+
+/* a boxed 'user_' carries its own tag; 'ttuv_' is not used */
+#define setuservalue(L,u,o) \
+	{ const TValue *io=(o); Udata *iu = (u); \
+	  iu->user_ = io->value_; checkliveness(L,io); }
+
+
+#define getuservalue(L,u,o) \
+	{ TValue *io=(o); const Udata *iu = (u); \
+	  io->value_ = iu->user_; checkliveness(L,io); }
+
+#endif				/* } */
+
 
 /*
 ** Description of an upvalue for function prototypes
@@ -482,10 +732,16 @@ typedef union TKey {
 
 
 /* copy a value into a key without messing up field 'next' */
+#if !defined(LUA_NANBOXING)
 #define setnodekey(L,key,obj) \
 	{ TKey *k_=(key); const TValue *io_=(obj); \
 	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
 	  (void)L; checkliveness(L,io_); }
+#else
+#define setnodekey(L,key,obj) \
+	{ TKey *k_=(key); const TValue *io_=(obj); \
+	  k_->nk.value_ = io_->value_; (void)L; checkliveness(L,io_); }
+#endif
 
 
 typedef struct Node {
@@ -494,16 +750,47 @@ typedef struct Node {
 } Node;
 
 
+#if defined(LUA_USE_SHAPES)
+
+/*
+** Shapes: immutable key layouts shared by tables. A shape with 'n'
+** keys maps each of them (always a short string) to a slot in the
+** table's 'slots' array. Shapes form a tree: each one extends its
+** 'parent' with one more key; tables move along the tree as they
+** get new keys.
+*/
+typedef struct Shape {
+  struct Shape *parent;  /* shape with one key less */
+  struct Shape *kids;  /* list of shapes with one key more */
+  struct Shape *sibling;  /* next shape in 'kids' list of parent */
+  TString **keys;  /* keys in slot order */
+  lu_byte *index;  /* hash of 'keys' (slot + 1; 0 means empty) */
+  unsigned int lasthash;  /* hash of last key when shape was created */
+  int nkeys;  /* number of keys (and of used slots) */
+  int refcount;  /* number of tables and kids using this shape */
+  lu_byte lsizeindex;  /* log2 of size of 'index' */
+} Shape;
+
+#endif
+
+
 typedef struct Table {
   CommonHeader;
-  lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
+  lu_byte flags;  /* 1<<p means tagmethod(p) is not present (+ FROZENBIT) */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
+#if defined(LUA_USE_SHAPES)
+  lu_byte sizeslots;  /* size of 'slots' array */
+#endif
   unsigned int sizearray;  /* size of 'array' array */
   TValue *array;  /* array part */
   Node *node;
   Node *lastfree;  /* any free position is before this position */
   struct Table *metatable;
   GCObject *gclist;
+#if defined(LUA_USE_SHAPES)
+  Shape *shape;  /* key layout (NULL for a regular hash part) */
+  TValue *slots;  /* values for the keys in 'shape' */
+#endif
 } Table;
 
 
@@ -527,6 +814,11 @@ typedef struct Table {
 
 LUAI_DDEC const TValue luaO_nilobject_;
 
+#if defined(LUA_NANBOXING)
+LUAI_DDEC const lu_byte luaO_nbtag_[16];
+LUAI_FUNC int luaO_nbcode (int tt);
+#endif
+
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
@@ -538,6 +830,9 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC int luaO_int2str (char *buff, lua_Integer i);
+LUAI_FUNC int luaO_num2str (char *buff, lua_Number n, int prec);
+LUAI_FUNC size_t luaO_tostringbuff (char *buff, const TValue *obj);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
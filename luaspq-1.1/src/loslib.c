@@ -345,6 +345,12 @@ static int os_setlocale (lua_State *L) {
   const char *l = luaL_optstring(L, 1, NULL);
   int op = luaL_checkoption(L, 2, "all", catnames);
   lua_pushstring(L, setlocale(cat[op], l));
+  if (l != NULL && (cat[op] == LC_ALL || cat[op] == LC_CTYPE)) {
+    /* compiled patterns may have stale character classes */
+    if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_PATCACHE) == LUA_TTABLE)
+      lua_cleartable(L, -1, 1);
+    lua_pop(L, 1);
+  }
   return 1;
 }
 
@@ -36,6 +36,14 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GENMINORMUL)
+#define LUAI_GENMINORMUL	20  /* minor collection after 20% growth */
+#endif
+
+#if !defined(LUAI_GENMAJORMUL)
+#define LUAI_GENMAJORMUL	100  /* major collection after 100% growth */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -298,6 +306,10 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   global_State *g;
   LG *l = cast(LG *, (*f)(ud, NULL, LUA_TTHREAD, sizeof(LG)));
   if (l == NULL) return NULL;
+  if (!ptrfits(l) || !ptrfits(lua_newstate)) {  /* cannot box pointers? */
+    (*f)(ud, l, sizeof(LG), 0);
+    return NULL;
+  }
   L = &l->l.l;
   g = &l->g;
   L->next = NULL;
@@ -312,22 +324,46 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcrunning = 0;  /* no GC while building state */
   g->GCestimate = 0;
   g->strt.size = g->strt.nuse = 0;
+  g->strt.oldsize = g->strt.split = 0;
   g->strt.hash = NULL;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
-  g->gckind = KGC_NORMAL;
+  g->gckind = KGC_INC;
+  g->gcemergency = 0;
   g->allgc = g->finobj = g->tobefnz = g->fixedgc = NULL;
+  g->survival = g->old1 = g->reallyold = g->firstold1 = NULL;
+  g->finobjsur = g->finobjold1 = g->finobjrold = NULL;
+  g->lastatomic = 0;
+#if defined(LUA_USE_GCTHREADS)
+  g->gcpool = NULL;
+  g->gcmarker = 0;
+  g->gcdeferfree = 0;
+  g->gcnobgfree = 0;
+  g->gcfreer = NULL;
+#endif
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
   g->twups = NULL;
+  g->nexttable = NULL;
+  g->nextnode = 0;
+#if defined(LUA_USE_SHAPES)
+  g->rootshape.parent = g->rootshape.kids = g->rootshape.sibling = NULL;
+  g->rootshape.keys = NULL;
+  g->rootshape.index = NULL;
+  g->rootshape.lasthash = 0;
+  g->rootshape.nkeys = g->rootshape.refcount = 0;
+  g->rootshape.lsizeindex = 0;
+#endif
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->genminormul = LUAI_GENMINORMUL;
+  g->genmajormul = LUAI_GENMAJORMUL;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
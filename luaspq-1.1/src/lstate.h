@@ -26,6 +26,11 @@
 ** 'tobefnz': all objects ready to be finalized; 
 ** 'fixedgc': all objects that are not to be collected (currently
 ** only small strings, such as reserved words).
+**
+** For the generational collector, 'allgc' and 'finobj' also have marks
+** for generations: 'survival'/'old1'/'reallyold' (and 'finobjsur'/
+** 'finobjold1'/'finobjrold') point to the first element of each older
+** generation; a generation goes until the next mark.
 
 */
 
@@ -42,14 +47,16 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 
 /* kinds of Garbage Collection */
-#define KGC_NORMAL	0
-#define KGC_EMERGENCY	1	/* gc was forced by an allocation failure */
+#define KGC_INC		0	/* incremental gc */
+#define KGC_GEN		1	/* generational gc */
 
 
 typedef struct stringtable {
   TString **hash;
   int nuse;  /* number of elements */
   int size;
+  int oldsize;  /* size before a growth still in progress (0 if none) */
+  int split;  /* number of old buckets already split by that growth */
 } stringtable;
 
 
@@ -119,6 +126,7 @@ typedef struct global_State {
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
+  lu_byte gcemergency;  /* true if this is an emergency collection */
   lu_byte gcrunning;  /* true if GC is running */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
@@ -130,10 +138,28 @@ typedef struct global_State {
   GCObject *allweak;  /* list of all-weak tables */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
+  /* fields for generational collector */
+  GCObject *survival;  /* start of objects that survived one GC cycle */
+  GCObject *old1;  /* start of old1 objects */
+  GCObject *reallyold;  /* objects more than one cycle old ("really old") */
+  GCObject *firstold1;  /* first OLD1 object in the list (if any) */
+  GCObject *finobjsur;  /* list of survival objects with finalizers */
+  GCObject *finobjold1;  /* list of old1 objects with finalizers */
+  GCObject *finobjrold;  /* list of really old objects with finalizers */
   struct lua_State *twups;  /* list of threads with open upvalues */
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int genminormul;  /* control for minor generational collections */
+  int genmajormul;  /* control for major generational collections */
+  lu_mem lastatomic;  /* see function 'genstep' in file 'lgc.c' */
+#if defined(LUA_USE_GCTHREADS)
+  struct GCPool *gcpool;  /* helper threads for parallel marking */
+  lu_byte gcmarker;  /* true in the private state of a parallel marker */
+  lu_byte gcdeferfree;  /* true while frees may go to 'gcfreer' */
+  lu_byte gcnobgfree;  /* true if 'frealloc' is not thread safe */
+  struct GCFreer *gcfreer;  /* helper thread for background frees */
+#endif
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -141,6 +167,11 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  struct Table *nexttable;  /* table of last hash entry returned by 'next' */
+  unsigned int nextnode;  /* index of that entry in 'nexttable' */
+#if defined(LUA_USE_SHAPES)
+  Shape rootshape;  /* shape with no keys (root of all shapes) */
+#endif
 } global_State;
 
 
@@ -27,7 +27,7 @@
 
 /*
 ** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** compute its hash (unless LUA_USE_FULLHASH is defined)
 */
 #if !defined(LUAI_HASHLIMIT)
 #define LUAI_HASHLIMIT		5
@@ -46,6 +46,45 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+#if defined(LUA_USE_FULLHASH)	/* { */
+
+/*
+** Hash over all bytes of the string, read 8 at a time (a variant of
+** MurmurHash64A). Unlike the sampling hash, strings that differ only
+** in bytes it would skip (long shared prefixes and suffixes, as in
+** URLs and paths) still get different hashes.
+*/
+
+typedef unsigned long long lu_hash64;
+
+#define HASHMUL		0xc6a4a7935bd1e995ULL
+#define HASHSHIFT	47
+
+unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  lu_hash64 h = seed ^ (cast(lu_hash64, l) * HASHMUL);
+  const char *end = str + (l & ~cast(size_t, 7));
+  lu_hash64 w;
+  for (; str != end; str += 8) {  /* whole words */
+    memcpy(&w, str, sizeof(w));  /* (compilers turn it into a load) */
+    w *= HASHMUL;
+    w ^= w >> HASHSHIFT;
+    w *= HASHMUL;
+    h = (h ^ w) * HASHMUL;
+  }
+  if ((l &= 7) != 0) {  /* remaining bytes */
+    w = 0;
+    while (l-- > 0)
+      w = (w << 8) | cast_byte(str[l]);
+    h = (h ^ w) * HASHMUL;
+  }
+  h ^= h >> HASHSHIFT;  /* final mix */
+  h *= HASHMUL;
+  h ^= h >> HASHSHIFT;
+  return cast(unsigned int, h ^ (h >> 32));
+}
+
+#else				/* }{ */
+
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast(unsigned int, l);
   size_t step = (l >> LUAI_HASHLIMIT) + 1;
@@ -54,23 +93,94 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   return h;
 }
 
+#endif				/* } */
+
 
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
-  if (ts->extra == 0) {  /* no hash? */
+  if ((ts->extra & 1) == 0) {  /* no hash? */
     ts->hash = luaS_hash(getstr(ts), ts->u.lnglen, ts->hash);
-    ts->extra = 1;  /* now it has its hash */
+    ts->extra |= 1;  /* now it has its hash */
   }
   return ts->hash;
 }
 
 
 /*
-** resizes the string table
+** {======================================================
+** String table
+** =======================================================
+*/
+
+/*
+** Number of old buckets split by each new short string while the table
+** grows. A growth from 'n' to '2n' buckets starts when the table has 'n'
+** strings, so it ends before the next one could start.
+*/
+#if !defined(STRSPLITSTEP)
+#define STRSPLITSTEP	2
+#endif
+
+
+/*
+** The table grows incrementally: when it is full, it doubles its bucket
+** array at once, but each old bucket 'i' is split into buckets 'i' and
+** 'i + oldsize' only later, a few at a time. Until then, strings that
+** hash to 'i + oldsize' stay in bucket 'i'.
+*/
+static TString **strbucket (stringtable *tb, unsigned int h) {
+  int i = lmod(h, tb->size);
+  if (tb->oldsize != 0) {  /* growing? */
+    int j = lmod(h, tb->oldsize);
+    if (j >= tb->split)  /* old bucket not split yet? */
+      i = j;  /* string is still there */
+  }
+  return &tb->hash[i];
+}
+
+
+/*
+** split up to 'n' old buckets of a growing table
+*/
+static void splitbuckets (stringtable *tb, int n) {
+  for (; n > 0 && tb->oldsize != 0; n--) {
+    TString *p = tb->hash[tb->split];
+    tb->hash[tb->split] = NULL;
+    while (p) {  /* for each node in the list */
+      TString *hnext = p->u.hnext;  /* save next */
+      unsigned int h = lmod(p->hash, tb->size);  /* new position */
+      p->u.hnext = tb->hash[h];  /* chain it */
+      tb->hash[h] = p;
+      p = hnext;
+    }
+    if (++tb->split == tb->oldsize)  /* all buckets split? */
+      tb->oldsize = tb->split = 0;  /* growth is complete */
+  }
+}
+
+
+/*
+** starts doubling the size of the string table
+*/
+static void growstrtab (lua_State *L, stringtable *tb) {
+  int i;
+  splitbuckets(tb, MAX_INT);  /* finish any previous growth */
+  luaM_reallocvector(L, tb->hash, tb->size, tb->size * 2, TString *);
+  for (i = tb->size; i < tb->size * 2; i++)
+    tb->hash[i] = NULL;
+  tb->oldsize = tb->size;
+  tb->split = 0;
+  tb->size *= 2;
+}
+
+
+/*
+** resizes the string table (at once)
 */
 void luaS_resize (lua_State *L, int newsize) {
   int i;
   stringtable *tb = &G(L)->strt;
+  splitbuckets(tb, MAX_INT);  /* finish any incremental growth */
   if (newsize > tb->size) {  /* grow table if needed */
     luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
     for (i = tb->size; i < newsize; i++)
@@ -95,6 +205,8 @@ void luaS_resize (lua_State *L, int newsize) {
   tb->size = newsize;
 }
 
+/* }====================================================== */
+
 
 /*
 ** Clear API string cache. (Entries cannot be empty, so fill them with
@@ -151,9 +263,56 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** Creates a string with the 'l' bytes of string 'ts' starting at offset
+** 'off'. A long enough substring of a long string becomes a slice
+** sharing the bytes of the string owning them, unless that string is
+** more than LUAI_SLICERATIO times longer (see 'LUAI_MINSLICE'). Other
+** substrings are copied.
+*/
+TString *luaS_newsubstr (lua_State *L, TString *ts, size_t off, size_t l) {
+  lua_assert(off <= tsslen(ts) && l <= tsslen(ts) - off);
+  if (l == tsslen(ts))
+    return ts;  /* whole string */
+  else if (ts->tt == LUA_TLNGSTR && l > LUAI_MAXSHORTLEN &&
+           l >= LUAI_MINSLICE) {
+    TString *p = (isslice(ts) && gslice(ts)->parent != NULL)
+               ? gslice(ts)->parent  /* share the bytes of its parent */
+               : ts;
+    if (p->u.lnglen / LUAI_SLICERATIO <= l) {  /* is it worth sharing? */
+      GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizeof(Slice));
+      TString *s = gco2ts(o);
+      Slice *sl = cast(Slice *, s);
+      s->hash = G(L)->seed;
+      s->extra = SLICEBIT;
+      s->u.lnglen = l;
+      sl->parent = p;
+      sl->contents = getstr(ts) + off;
+      return s;
+    }
+  }
+  return luaS_newlstr(L, getstr(ts) + off, l);
+}
+
+
+/*
+** Gives slice 'ts' its own copy of its bytes, followed by a '\0'; the
+** slice no longer keeps its parent alive.
+*/
+void luaS_ownslice (lua_State *L, TString *ts) {
+  Slice *sl = gslice(ts);
+  size_t l = ts->u.lnglen;
+  char *buff = luaM_newvector(L, l + 1, char);
+  memcpy(buff, sl->contents, l * sizeof(char));
+  buff[l] = '\0';
+  sl->contents = buff;
+  sl->parent = NULL;
+}
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
+  TString **p = strbucket(tb, ts->hash);
   while (*p != ts)  /* find previous element */
     p = &(*p)->u.hnext;
   *p = (*p)->u.hnext;  /* remove element from its list */
@@ -168,8 +327,10 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString *ts;
   global_State *g = G(L);
   unsigned int h = luaS_hash(str, l, g->seed);
-  TString **list = &g->strt.hash[lmod(h, g->strt.size)];
+  TString **list;
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
+  splitbuckets(&g->strt, STRSPLITSTEP);  /* advance any growth */
+  list = strbucket(&g->strt, h);
   for (ts = *list; ts != NULL; ts = ts->u.hnext) {
     if (l == ts->shrlen &&
         (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
@@ -180,8 +341,8 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
     }
   }
   if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
-    luaS_resize(L, g->strt.size * 2);
-    list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
+    growstrtab(L, &g->strt);
+    list = strbucket(&g->strt, h);  /* recompute with new size */
   }
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   memcpy(getstr(ts), str, l * sizeof(char));
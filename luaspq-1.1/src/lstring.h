@@ -14,6 +14,10 @@
 
 #define sizelstring(l)  (sizeof(union UTString) + ((l) + 1) * sizeof(char))
 
+/* size of a long string object (plain or slice, without owned bytes) */
+#define sizelngstr(ts)  \
+	(isslice(ts) ? sizeof(Slice) : sizelstring((ts)->u.lnglen))
+
 #define sizeludata(l)	(sizeof(union UUdata) + (l))
 #define sizeudata(u)	sizeludata((u)->len)
 
@@ -33,6 +37,13 @@
 #define eqshrstr(a,b)	check_exp((a)->tt == LUA_TSHRSTR, (a) == (b))
 
 
+/*
+** make sure the bytes of string 'ts' are followed by a '\0'
+*/
+#define luaS_terminate(L,ts)  \
+	(isterminated(ts) ? (void)0 : luaS_ownslice(L, ts))
+
+
 LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
 LUAI_FUNC unsigned int luaS_hashlongstr (TString *ts);
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
@@ -44,6 +55,9 @@ LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 LUAI_FUNC TString *luaS_new (lua_State *L, const char *str);
 LUAI_FUNC TString *luaS_createlngstrobj (lua_State *L, size_t l);
+LUAI_FUNC TString *luaS_newsubstr (lua_State *L, TString *ts, size_t off,
+                                                             size_t l);
+LUAI_FUNC void luaS_ownslice (lua_State *L, TString *ts);
 
 
 #endif
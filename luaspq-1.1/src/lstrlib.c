@@ -13,6 +13,8 @@
 #include <ctype.h>
 #include <float.h>
 #include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,10 +51,21 @@
 
 
 
-static int str_len (lua_State *L) {
+/*
+** length of the string argument 'arg'; unlike 'luaL_checklstring', it
+** does not give a slice its own copy of its bytes
+*/
+static size_t checkstrlen (lua_State *L, int arg) {
   size_t l;
-  luaL_checklstring(L, 1, &l);
-  lua_pushinteger(L, (lua_Integer)l);
+  if (lua_type(L, arg) == LUA_TSTRING)
+    return lua_rawlen(L, arg);
+  luaL_checklstring(L, arg, &l);
+  return l;
+}
+
+
+static int str_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)checkstrlen(L, 1));
   return 1;
 }
 
@@ -66,14 +79,15 @@ static lua_Integer posrelat (lua_Integer pos, size_t len) {
 
 
 static int str_sub (lua_State *L) {
-  size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
-  lua_Integer start = posrelat(luaL_checkinteger(L, 2), l);
-  lua_Integer end = posrelat(luaL_optinteger(L, 3, -1), l);
+  size_t l = checkstrlen(L, 1);
+  lua_Integer start;
+  lua_Integer end;
+  start = posrelat(luaL_checkinteger(L, 2), l);
+  end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
   if (end > (lua_Integer)l) end = l;
   if (start <= end)
-    lua_pushlstring(L, s + start - 1, (size_t)(end - start) + 1);
+    lua_pushsubstr(L, 1, (size_t)start - 1, (size_t)(end - start) + 1);
   else lua_pushliteral(L, "");
   return 1;
 }
@@ -91,14 +105,59 @@ static int str_reverse (lua_State *L) {
 }
 
 
+/* a 'size_t' with all its bytes equal to 'c' */
+#define allbytes(c)	(((size_t)-1 / 0xff) * (size_t)(c))
+
+
+/*
+** Changes the case of the ASCII letters in word 'w', which must have
+** only ASCII bytes: a byte 'c' gets its high bit set in 'ge' if
+** c >= first and in 'gt' if c > last, without carries between bytes.
+*/
+static size_t asciicase (size_t w, int first, int last) {
+  size_t ge = w + allbytes(0x80 - first);
+  size_t gt = w + allbytes(0x80 - last - 1);
+  size_t m = ge & ~gt & allbytes(0x80);  /* high bits of letters */
+  return w ^ (m >> 2);  /* flip their 0x20 bits */
+}
+
+
+/*
+** Converts 's' to lower (or upper) case into 'p'. Words with only ASCII
+** bytes are converted all at once, as long as the current locale maps
+** ASCII letters as the C locale does; other bytes go through
+** 'tolower'/'toupper'.
+*/
+static void changecase (char *p, const char *s, size_t l, int upper) {
+  size_t i = 0;
+  if (l >= sizeof(size_t) && tolower('I') == 'i' && toupper('i') == 'I') {
+    int first = upper ? 'a' : 'A';
+    int last = upper ? 'z' : 'Z';
+    for (; i + sizeof(size_t) <= l; i += sizeof(size_t)) {
+      size_t w;
+      memcpy(&w, s + i, sizeof(w));
+      if ((w & allbytes(0x80)) == 0) {  /* only ASCII bytes? */
+        w = asciicase(w, first, last);
+        memcpy(p + i, &w, sizeof(w));
+      }
+      else {
+        size_t j;
+        for (j = i; j < i + sizeof(size_t); j++)
+          p[j] = upper ? toupper(uchar(s[j])) : tolower(uchar(s[j]));
+      }
+    }
+  }
+  for (; i < l; i++)
+    p[i] = upper ? toupper(uchar(s[i])) : tolower(uchar(s[i]));
+}
+
+
 static int str_lower (lua_State *L) {
   size_t l;
-  size_t i;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = tolower(uchar(s[i]));
+  changecase(p, s, l, 0);
   luaL_pushresultsize(&b, l);
   return 1;
 }
@@ -106,17 +165,43 @@ static int str_lower (lua_State *L) {
 
 static int str_upper (lua_State *L) {
   size_t l;
-  size_t i;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
-    p[i] = toupper(uchar(s[i]));
+  changecase(p, s, l, 1);
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
+/*
+** string.translate(s, from [, to]): replaces each byte from[i] in 's'
+** by to[i], or removes it if 'to' has less than 'i' bytes. If a byte
+** appears more than once in 'from', its last occurrence counts.
+*/
+static int str_translate (lua_State *L) {
+  size_t l, lf, lt, i;
+  size_t n = 0;  /* length of the result */
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *from = luaL_checklstring(L, 2, &lf);
+  const char *to = luaL_optlstring(L, 3, "", &lt);
+  int map[UCHAR_MAX + 1];  /* new byte for each byte, or -1 to remove it */
+  luaL_Buffer b;
+  char *p;
+  for (i = 0; i <= UCHAR_MAX; i++)
+    map[i] = (int)i;
+  for (i = 0; i < lf; i++)
+    map[uchar(from[i])] = (i < lt) ? uchar(to[i]) : -1;
+  p = luaL_buffinitsize(L, &b, l);
+  for (i = 0; i < l; i++) {
+    int c = map[uchar(s[i])];
+    if (c >= 0) p[n++] = (char)c;
+  }
+  luaL_pushresultsize(&b, n);
+  return 1;
+}
+
+
 static int str_rep (lua_State *L) {
   size_t l, lsep;
   const char *s = luaL_checklstring(L, 1, &l);
@@ -127,16 +212,20 @@ static int str_rep (lua_State *L) {
     return luaL_error(L, "resulting string too large");
   else {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
+    size_t units = (size_t)(n - 1) * (l + lsep);  /* first n-1 copies */
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
+    if (units > 0) {  /* first n-1 copies (followed by separator) */
+      size_t done = l + lsep;
+      memcpy(p, s, l * sizeof(char));
+      memcpy(p + l, sep, lsep * sizeof(char));
+      while (done < units) {  /* double what is already there */
+        size_t c = (done <= units - done) ? done : units - done;
+        memcpy(p + done, p, c * sizeof(char));
+        done += c;
       }
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
+    memcpy(p + units, s, l * sizeof(char));  /* last copy (no separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -177,6 +266,46 @@ static int str_char (lua_State *L) {
 }
 
 
+/* maximum length of a field in 'string.tonumbers' */
+#define MAXNUMFIELD	200
+
+/*
+** string.tonumbers(s [, seps]): converts all fields of 's' separated by
+** any of the characters in 'seps' (default: commas and white space) into
+** numbers, returning them in a new sequence. Empty fields are skipped.
+*/
+static int str_tonumbers (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  const char *seps = luaL_optstring(L, 2, ", \t\r\n");
+  const char *e = s + l;
+  lua_Integer n = 0;
+  char sepmap[UCHAR_MAX + 1];
+  memset(sepmap, 0, sizeof(sepmap));
+  for (; *seps; seps++)
+    sepmap[uchar(*seps)] = 1;
+  lua_newtable(L);
+  while (s < e) {
+    const char *f = s;  /* start of field */
+    size_t fl;
+    while (s < e && !sepmap[uchar(*s)]) s++;
+    fl = s - f;
+    if (fl > 0) {
+      char buff[MAXNUMFIELD + 1];
+      if (fl > MAXNUMFIELD || memchr(f, '\0', fl) != NULL)
+        return luaL_error(L, "invalid number in field %I", (LUAI_UACINT)n + 1);
+      memcpy(buff, f, fl);
+      buff[fl] = '\0';
+      if (lua_stringtonumber(L, buff) == 0)
+        return luaL_error(L, "invalid number in field %I", (LUAI_UACINT)n + 1);
+      lua_rawseti(L, -2, ++n);
+    }
+    s++;  /* skip separator */
+  }
+  return 1;
+}
+
+
 static int writer (lua_State *L, const void *b, size_t size, void *B) {
   (void)L;
   luaL_addlstring((luaL_Buffer *) B, (const char *)b, size);
@@ -209,14 +338,49 @@ static int str_dump (lua_State *L) {
 #define CAP_POSITION	(-2)
 
 
+/*
+** A compiled pattern is a sequence of items, each one already parsed
+** and, for single-char classes, with the set of characters it matches
+** as a bitmap.
+*/
+#define PI_SINGLE	0	/* single char class, maybe with a suffix */
+#define PI_OPEN		1	/* '(' */
+#define PI_POSITION	2	/* '()' */
+#define PI_CLOSE	3	/* ')' */
+#define PI_EOS		4	/* final '$' */
+#define PI_BALANCE	5	/* '%bxy' */
+#define PI_FRONTIER	6	/* '%f[set]' */
+#define PI_BACKREF	7	/* '%0'-'%9' */
+#define PI_END		8	/* end of pattern */
+
+typedef struct PatItem {
+  unsigned char kind;  /* PI_* */
+  unsigned char rep;  /* suffix ('*', '+', '-', '?') or 0 */
+  unsigned char c1, c2;  /* '%b' delimiters or '%n' digit */
+  unsigned char onechar;  /* only char in 'set' or only one not in it */
+  unsigned short nchars;  /* number of chars in 'set' */
+  unsigned char set[(UCHAR_MAX + 1) / CHAR_BIT];  /* matched chars */
+} PatItem;
+
+typedef struct PatProg {
+  int nitems;  /* number of items (not counting final PI_END) */
+  int anchor;  /* pattern starts with '^'? */
+  int hasbackref;  /* pattern has back references? */
+  PatItem item[1];  /* items, ending with a PI_END */
+} PatProg;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
   const char *p_end;  /* end ('\0') of pattern */
   lua_State *L;
+  int srcidx;  /* stack index of source string */
   size_t nrep;  /* limit to avoid non-linear complexity */
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   int level;  /* total number of captures (finished or unfinished) */
+  const PatProg *prog;  /* compiled pattern, or NULL */
+  unsigned char *memo;  /* (item, position) pairs known to fail, or NULL */
   struct {
     const char *init;
     ptrdiff_t len;
@@ -536,152 +700,747 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 }
 
 
+/*
+** {======================================================
+** Compiled patterns
+** Patterns used by 'find', 'match', 'gmatch' and 'gsub' are compiled
+** once and kept in a cache (registry[LUA_PATCACHE], also the first
+** upvalue of the string functions). 'cmatch' runs a compiled pattern
+** in the same order as 'match', so it finds the same matches; but,
+** unless the pattern has back references, it also remembers which
+** (item, position) pairs failed, so that backtracking never tries them
+** twice and the exponential cases become polynomial.
+** =======================================================
+*/
 
-static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-  else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
+/* maximum number of items in a compiled pattern */
+#if !defined(MAXPATITEMS)
+#define MAXPATITEMS	64
+#endif
+
+/* maximum number of compiled patterns kept in the cache */
+#if !defined(PATCACHESIZE)
+#define PATCACHESIZE	64
+#endif
+
+/* key in a cache for its number of entries */
+#define CACHECOUNT	0
+
+/*
+** The memo takes one bit per item and subject position. Memos of up to
+** MEMOSIZE bytes live on the C stack, larger ones in a userdata. Above
+** MAXMEMOSIZE bytes (a subject of some 128K bytes for a pattern of 64
+** items), matches run without a memo, with plain backtracking.
+*/
+#if !defined(MEMOSIZE)
+#define MEMOSIZE	1024
+#endif
+
+#if !defined(MAXMEMOSIZE)
+#define MAXMEMOSIZE	(1024 * 1024)
+#endif
+
+
+#define setbit(set,c)	((set)[(c) / CHAR_BIT] |= (1u << ((c) % CHAR_BIT)))
+#define testbit(set,c)	((set)[(c) / CHAR_BIT] & (1u << ((c) % CHAR_BIT)))
+
+
+/* like 'classend', but returns NULL for a malformed class */
+static const char *cclassend (const char *p, const char *p_end) {
+  switch (*p++) {
+    case L_ESC: {
+      return (p == p_end) ? NULL : p + 1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == p_end)
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
     }
-    return NULL;  /* not found */
   }
 }
 
 
-static void push_onecapture (MatchState *ms, int i, const char *s,
-                                                    const char *e) {
-  if (i >= ms->level) {
-    if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
-    else
-      luaL_error(ms->L, "invalid capture index %%%d", i + 1);
+/* fills 'it->set' with all characters matched by class 'p'-'ep' */
+static void compileclass (PatItem *it, const char *p, const char *ep) {
+  int c;
+  int in = 0, out = 0;  /* some char in the set and some char out of it */
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    int res;
+    switch (*p) {
+      case '.': res = 1; break;
+      case L_ESC: res = match_class(c, uchar(*(p+1))); break;
+      case '[': res = matchbracketclass(c, p, ep-1); break;
+      default: res = (uchar(*p) == c); break;
+    }
+    if (res) {
+      setbit(it->set, c);
+      it->nchars++;
+      in = c;
+    }
+    else out = c;
   }
-  else {
-    ptrdiff_t l = ms->capture[i].len;
-    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
-    if (l == CAP_POSITION)
-      lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
-    else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+  it->onechar = uchar((it->nchars == 1) ? in : out);
+}
+
+
+/*
+** Compiles pattern 'p' (after any '^') into 'items'. Returns the number
+** of items, or -1 if the pattern is malformed or too long; such patterns
+** are left to 'match', which raises the proper errors only when (and
+** if) it reaches the malformed part.
+*/
+static int compilepattern (const char *p, const char *p_end,
+                           PatItem *items, int *hasbackref) {
+  int n = 0;
+  *hasbackref = 0;
+  for (;;) {
+    PatItem *it = &items[n];
+    if (n >= MAXPATITEMS) return -1;  /* too long */
+    memset(it, 0, sizeof(PatItem));
+    if (p == p_end) {
+      it->kind = PI_END;
+      return n;
+    }
+    n++;
+    switch (*p) {
+      case '(': {
+        if (*(p + 1) == ')') {
+          it->kind = PI_POSITION; p += 2;
+        }
+        else {
+          it->kind = PI_OPEN; p++;
+        }
+        continue;
+      }
+      case ')': {
+        it->kind = PI_CLOSE; p++;
+        continue;
+      }
+      case '$': {
+        if ((p + 1) != p_end)
+          goto dflt;
+        it->kind = PI_EOS; p++;
+        continue;
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1) return -1;
+            it->kind = PI_BALANCE;
+            it->c1 = uchar(*(p + 2)); it->c2 = uchar(*(p + 3));
+            p += 4;
+            continue;
+          }
+          case 'f': {
+            const char *ep;
+            p += 2;
+            if (*p != '[' || (ep = cclassend(p, p_end)) == NULL)
+              return -1;
+            it->kind = PI_FRONTIER;
+            compileclass(it, p, ep);
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            it->kind = PI_BACKREF;
+            it->c1 = uchar(*(p + 1));
+            *hasbackref = 1;
+            p += 2;
+            continue;
+          }
+          default: goto dflt;
+        }
+      }
+      default: dflt: {
+        const char *ep = cclassend(p, p_end);
+        if (ep == NULL) return -1;
+        it->kind = PI_SINGLE;
+        compileclass(it, p, ep);
+        if (ep < p_end &&
+            (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?')) {
+          it->rep = uchar(*ep);
+          ep++;
+        }
+        p = ep;
+        continue;
+      }
+    }
   }
 }
 
 
-static int push_captures (MatchState *ms, const char *s, const char *e) {
-  int i;
-  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
-  luaL_checkstack(ms->L, nlevels, "too many captures");
-  for (i = 0; i < nlevels; i++)
-    push_onecapture(ms, i, s, e);
-  return nlevels;  /* number of strings pushed */
+/*
+** Stores the value on the top of the stack (keeping it there) in the
+** cache at index 'cache' with the key at index 'k'. A cache with 'max'
+** entries is emptied first.
+*/
+static void cacheput (lua_State *L, int cache, int k, int max) {
+  int count;
+  lua_rawgeti(L, cache, CACHECOUNT);
+  count = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (count >= max) {  /* cache is full? */
+    lua_cleartable(L, cache, 1);  /* start it again */
+    count = 0;
+  }
+  lua_pushvalue(L, k);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, cache);  /* cache[k] = value */
+  lua_pushinteger(L, count + 1);
+  lua_rawseti(L, cache, CACHECOUNT);
 }
 
 
-/* check whether pattern has no special characters */
-static int nospecials (const char *p, size_t l) {
-  size_t upto = 0;
-  do {
-    if (strpbrk(p + upto, SPECIALS))
-      return 0;  /* pattern has a special character */
-    upto += strlen(p + upto) + 1;  /* may have more after \0 */
-  } while (upto <= l);
-  return 1;  /* no special chars found */
+/*
+** Pushes the compiled form of the pattern at index 'pidx' (a full
+** userdata) or nil if it cannot be compiled, and returns it.
+*/
+static const PatProg *getprog (lua_State *L, int pidx) {
+  size_t lp;
+  const char *p = lua_tolstring(L, pidx, &lp);
+  PatItem items[MAXPATITEMS];
+  PatProg *prog;
+  int anchor, n, hasbackref;
+  lua_pushvalue(L, pidx);
+  if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL)  /* cached? */
+    return (const PatProg *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  anchor = (*p == '^');
+  n = compilepattern(p + anchor, p + lp, items, &hasbackref);
+  if (n < 0) {  /* cannot be compiled? */
+    lua_pushnil(L);
+    return NULL;
+  }
+  prog = (PatProg *)lua_newuserdata(L, sizeof(PatProg) +
+                                       n * sizeof(PatItem));
+  prog->nitems = n;
+  prog->anchor = anchor;
+  prog->hasbackref = hasbackref;
+  memcpy(prog->item, items, (n + 1) * sizeof(PatItem));
+  cacheput(L, lua_upvalueindex(1), pidx, PATCACHESIZE);
+  return prog;
 }
 
 
-static void prepstate (MatchState *ms, lua_State *L,
-                       const char *s, size_t ls, const char *p, size_t lp) {
-  ms->L = L;
-  ms->matchdepth = MAXCCALLS;
-  ms->src_init = s;
-  ms->src_end = s + ls;
-  ms->p_end = p + lp;
-  if (ls < (MAX_SIZET - B_REPS) / A_REPS)
-    ms->nrep = A_REPS * ls + B_REPS;
-  else  /* overflow (very long subject) */
-    ms->nrep = MAX_SIZET;  /* no limit */
+/*
+** Number of memo bytes needed to match 'prog' against a subject of 'ls'
+** bytes, or 0 if it will not use a memo
+*/
+static size_t memosize (const PatProg *prog, size_t ls) {
+  if (prog == NULL || prog->hasbackref ||
+      ls >= (size_t)(MAXMEMOSIZE * CHAR_BIT) / ((size_t)prog->nitems + 1))
+    return 0;
+  return (((size_t)prog->nitems + 1) * (ls + 1) + CHAR_BIT - 1) / CHAR_BIT;
 }
 
 
-static void reprepstate (MatchState *ms) {
-  ms->level = 0;
-  lua_assert(ms->matchdepth == MAXCCALLS);
+/*
+** Gives 'ms' a cleared memo of 'sz' bytes: 'buff' (with MEMOSIZE bytes)
+** if it is large enough, otherwise a new userdata left on the stack.
+*/
+static void setmemo (MatchState *ms, size_t sz, unsigned char *buff) {
+  if (sz == 0)
+    return;  /* no memo */
+  if (sz > MEMOSIZE)
+    buff = (unsigned char *)lua_newuserdata(ms->L, sz);
+  memset(buff, 0, sz);
+  ms->memo = buff;
 }
 
 
-static int str_find_aux (lua_State *L, int find) {
-  size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
-  const char *p = luaL_checklstring(L, 2, &lp);
-  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
-  if (init < 1) init = 1;
-  else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
-    lua_pushnil(L);  /* cannot find anything */
-    return 1;
-  }
-  /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
-    /* do a plain search */
-    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
-    if (s2) {
-      lua_pushinteger(L, (s2 - s) + 1);
-      lua_pushinteger(L, (s2 - s) + lp);
-      return 2;
-    }
-  }
+/* memo bit for item 'i' at subject position 's' */
+#define memobit(ms,i,s) \
+  ((size_t)(i) * ((ms)->src_end - (ms)->src_init + 1) + ((s) - (ms)->src_init))
+
+
+static const char *cmatch (MatchState *ms, const char *s, int i);
+
+
+static int csinglematch (MatchState *ms, const char *s, const PatItem *it) {
+  return (s < ms->src_end && testbit(it->set, uchar(*s)));
+}
+
+
+static const char *cmatchbalance (MatchState *ms, const char *s,
+                                    int b, int e) {
+  if (uchar(*s) != b) return NULL;
   else {
-    MatchState ms;
-    const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    prepstate(&ms, L, s, ls, p, lp);
-    do {
-      const char *res;
-      reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
-        if (find) {
-          lua_pushinteger(L, (s1 - s) + 1);  /* start */
-          lua_pushinteger(L, res - s);   /* end */
-          return push_captures(&ms, NULL, 0) + 2;
-        }
-        else
-          return push_captures(&ms, s1, res);
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (uchar(*s) == e) {
+        if (--cont == 0) return s+1;
       }
-    } while (s1++ < ms.src_end && !anchor);
+      else if (uchar(*s) == b) cont++;
+    }
   }
-  lua_pushnil(L);  /* not found */
-  return 1;
+  return NULL;  /* string ends out of balance */
 }
 
 
-static int str_find (lua_State *L) {
-  return str_find_aux(L, 1);
+/*
+** Number of chars from 's' on matched by class 'it'. Sets with all
+** chars, or all but one (e.g. '.' and '[^,]'), are scanned by 'memchr';
+** others test the bitmap four chars per iteration.
+*/
+static ptrdiff_t classspan (MatchState *ms, const char *s,
+                            const PatItem *it) {
+  const char *e = ms->src_end;
+  const char *p = s;
+  if (it->nchars == UCHAR_MAX + 1)  /* any char? */
+    return e - s;
+  else if (it->nchars == UCHAR_MAX) {  /* any char but one? */
+    const char *f = (const char *)memchr(s, it->onechar, e - s);
+    return ((f != NULL) ? f : e) - s;
+  }
+  while (e - p >= 4 && testbit(it->set, uchar(p[0])) &&
+         testbit(it->set, uchar(p[1])) && testbit(it->set, uchar(p[2])) &&
+         testbit(it->set, uchar(p[3])))
+    p += 4;
+  while (p < e && testbit(it->set, uchar(*p)))
+    p++;
+  return p - s;
 }
 
 
-static int str_match (lua_State *L) {
-  return str_find_aux(L, 0);
+static const char *cmax_expand (MatchState *ms, const char *s, int i) {
+  const PatItem *it = &ms->prog->item[i];
+  ptrdiff_t n = classspan(ms, s, it);  /* counts maximum expand for item */
+  /* keeps trying to match with the maximum repetitions */
+  while (n>=0) {
+    const char *res = cmatch(ms, (s+n), i+1);
+    if (res) return res;
+    n--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
 }
 
 
-/* state for 'gmatch' */
-typedef struct GMatchState {
-  const char *src;  /* current position */
-  const char *p;  /* pattern */
+/*
+** If the rest of the pattern starts with a single char 'c' (e.g. '.-,'),
+** it can only match where 'c' is; returns the first such place at or
+** after 's', or NULL if there is none.
+*/
+static const char *nextstart (MatchState *ms, const char *s,
+                              const PatItem *next) {
+  if (next->kind == PI_SINGLE && next->nchars == 1 &&
+      (next->rep == 0 || next->rep == '+'))
+    return (const char *)memchr(s, next->onechar, ms->src_end - s);
+  return s;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s, int i) {
+  const PatItem *it = &ms->prog->item[i];
+  int anychar = (it->nchars == UCHAR_MAX + 1);  /* item is '.'? */
+  for (;;) {
+    const char *res;
+    if (anychar && (s = nextstart(ms, s, it + 1)) == NULL)
+      return NULL;  /* rest of pattern cannot match anywhere */
+    res = cmatch(ms, s, i+1);
+    if (res != NULL)
+      return res;
+    else if (csinglematch(ms, s, it))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                     int i, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, i)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s, int i) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, i)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+/* 'match' for compiled patterns, starting at item 'i' */
+static const char *cmatch (MatchState *ms, const char *s, int i) {
+  const char *s0 = s;  /* initial state, for the memo */
+  int i0 = i;
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  if (ms->memo != NULL && testbit(ms->memo, memobit(ms, i, s))) {
+    ms->matchdepth++;
+    return NULL;  /* already known to fail */
+  }
+  init: {
+    const PatItem *it = &ms->prog->item[i];
+    switch (it->kind) {
+      case PI_END: {
+        break;  /* end of pattern */
+      }
+      case PI_OPEN: {
+        s = cstart_capture(ms, s, i + 1, CAP_UNFINISHED);
+        break;
+      }
+      case PI_POSITION: {
+        s = cstart_capture(ms, s, i + 1, CAP_POSITION);
+        break;
+      }
+      case PI_CLOSE: {
+        s = cend_capture(ms, s, i + 1);
+        break;
+      }
+      case PI_EOS: {
+        s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+        break;
+      }
+      case PI_BALANCE: {
+        s = cmatchbalance(ms, s, it->c1, it->c2);
+        if (s != NULL) {
+          i++; goto init;
+        }
+        break;
+      }
+      case PI_FRONTIER: {
+        int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+        if (!testbit(it->set, previous) && testbit(it->set, uchar(*s))) {
+          i++; goto init;
+        }
+        s = NULL;  /* match failed */
+        break;
+      }
+      case PI_BACKREF: {
+        s = match_capture(ms, s, it->c1);
+        if (s != NULL) {
+          i++; goto init;
+        }
+        break;
+      }
+      default: {  /* single char class plus optional suffix */
+        lua_assert(it->kind == PI_SINGLE);
+        if (!csinglematch(ms, s, it)) {
+          if (it->rep == '*' || it->rep == '?' || it->rep == '-') {
+            i++; goto init;  /* accept empty */
+          }
+          else  /* '+' or no suffix */
+            s = NULL;  /* fail */
+        }
+        else {  /* matched once */
+          if (ms->nrep-- == 0)
+            luaL_error(ms->L, "pattern too complex");
+          switch (it->rep) {  /* handle optional suffix */
+            case '?': {  /* optional */
+              const char *res;
+              if ((res = cmatch(ms, s + 1, i + 1)) != NULL)
+                s = res;
+              else {
+                i++; goto init;
+              }
+              break;
+            }
+            case '+':  /* 1 or more repetitions */
+              s++;  /* 1 match already done */
+              /* FALLTHROUGH */
+            case '*':  /* 0 or more repetitions */
+              s = cmax_expand(ms, s, i);
+              break;
+            case '-':  /* 0 or more repetitions (minimum) */
+              s = cmin_expand(ms, s, i);
+              break;
+            default:  /* no suffix */
+              s++; i++; goto init;
+          }
+        }
+        break;
+      }
+    }
+  }
+  if (s == NULL && ms->memo != NULL)
+    setbit(ms->memo, memobit(ms, i0, s0));  /* remember failure */
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* match with the compiled pattern, if there is one */
+static const char *domatch (MatchState *ms, const char *s, const char *p) {
+  if (ms->prog != NULL)
+    return cmatch(ms, s, 0);
+  else
+    return match(ms, s, p);
+}
+
+/* }====================================================== */
+
+
+
+/*
+** Two-Way string matching (Crochemore-Perrin): finds 's2' (with 'l2'
+** bytes, at least 2) in 's1' in linear time even on repetitive inputs.
+** It also skips ahead using the last byte of each window, as Horspool
+** does.
+*/
+static const char *twowayfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  const unsigned char *h = (const unsigned char *)s1;
+  const unsigned char *hend = h + l1;
+  const unsigned char *n = (const unsigned char *)s2;
+  unsigned char inneedle[(UCHAR_MAX + 1) / CHAR_BIT];
+  size_t shift[UCHAR_MAX + 1];
+  size_t i, j, k, p, p0, ms, mem, mem0;
+  memset(inneedle, 0, sizeof(inneedle));
+  for (i = 0; i < l2; i++) {  /* bytes in needle and their last position */
+    inneedle[n[i] / CHAR_BIT] |= 1u << (n[i] % CHAR_BIT);
+    shift[n[i]] = i + 1;
+  }
+  /* maximal suffix for '<' (and its period) */
+  i = (size_t)-1; j = 0; k = p = 1;
+  while (j + k < l2) {
+    if (n[i + k] == n[j + k]) {
+      if (k == p) { j += p; k = 1; }
+      else k++;
+    }
+    else if (n[i + k] > n[j + k]) { j += k; k = 1; p = j - i; }
+    else { i = j++; k = p = 1; }
+  }
+  ms = i; p0 = p;
+  /* maximal suffix for '>' */
+  i = (size_t)-1; j = 0; k = p = 1;
+  while (j + k < l2) {
+    if (n[i + k] == n[j + k]) {
+      if (k == p) { j += p; k = 1; }
+      else k++;
+    }
+    else if (n[i + k] < n[j + k]) { j += k; k = 1; p = j - i; }
+    else { i = j++; k = p = 1; }
+  }
+  if (i + 1 > ms + 1) ms = i;  /* keep the longer suffix */
+  else p = p0;
+  if (memcmp(n, n + p, ms + 1) != 0) {  /* needle is not periodic? */
+    mem0 = 0;
+    p = ((ms > l2 - ms - 1) ? ms : l2 - ms - 1) + 1;
+  }
+  else mem0 = l2 - p;
+  mem = 0;
+  for (;;) {
+    unsigned char last;
+    if ((size_t)(hend - h) < l2) return NULL;  /* not enough haystack */
+    last = h[l2 - 1];
+    if (inneedle[last / CHAR_BIT] & (1u << (last % CHAR_BIT))) {
+      k = l2 - shift[last];
+      if (k) {  /* last byte does not match; align it */
+        if (k < mem) k = mem;
+        h += k; mem = 0;
+        continue;
+      }
+    }
+    else {  /* last byte is not in the needle; skip whole window */
+      h += l2; mem = 0;
+      continue;
+    }
+    for (k = (ms + 1 > mem) ? ms + 1 : mem; k < l2 && n[k] == h[k]; k++) ;
+    if (k < l2) {  /* mismatch in right half */
+      h += k - ms; mem = 0;
+      continue;
+    }
+    for (k = ms + 1; k > mem && n[k - 1] == h[k - 1]; k--) ;
+    if (k <= mem) return (const char *)h;  /* left half matches too */
+    h += p; mem = mem0;
+  }
+}
+
+
+/* needles shorter than this are searched with 'memchr' + 'memcmp' */
+#if !defined(TWOWAYMIN)
+#define TWOWAYMIN	3
+#endif
+
+
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else if (l2 >= TWOWAYMIN)
+    return twowayfind(s1, l1, s2, l2);
+  else {
+    const char *init;  /* to search for a '*s2' inside 's1' */
+    l2--;  /* 1st char will be checked by 'memchr' */
+    l1 = l1-l2;  /* 's2' cannot be found after that */
+    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+      init++;   /* 1st char is already checked */
+      if (memcmp(init, s2+1, l2) == 0)
+        return init-1;
+      else {  /* correct 'l1' and 's1' to try again */
+        l1 -= init-s1;
+        s1 = init;
+      }
+    }
+    return NULL;  /* not found */
+  }
+}
+
+
+/*
+** push the part of the source string starting at 's' with 'l' bytes
+** (sharing the source's bytes when possible)
+*/
+static void push_subsrc (MatchState *ms, const char *s, size_t l) {
+  lua_pushsubstr(ms->L, ms->srcidx, s - ms->src_init, l);
+}
+
+
+static void push_onecapture (MatchState *ms, int i, const char *s,
+                                                    const char *e) {
+  if (i >= ms->level) {
+    if (i == 0)  /* ms->level == 0, too */
+      push_subsrc(ms, s, e - s);  /* add whole match */
+    else
+      luaL_error(ms->L, "invalid capture index %%%d", i + 1);
+  }
+  else {
+    ptrdiff_t l = ms->capture[i].len;
+    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
+    if (l == CAP_POSITION)
+      lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
+    else
+      push_subsrc(ms, ms->capture[i].init, l);
+  }
+}
+
+
+static int push_captures (MatchState *ms, const char *s, const char *e) {
+  int i;
+  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+  luaL_checkstack(ms->L, nlevels, "too many captures");
+  for (i = 0; i < nlevels; i++)
+    push_onecapture(ms, i, s, e);
+  return nlevels;  /* number of strings pushed */
+}
+
+
+/* check whether pattern has no special characters */
+static int nospecials (const char *p, size_t l) {
+  size_t upto = 0;
+  do {
+    if (strpbrk(p + upto, SPECIALS))
+      return 0;  /* pattern has a special character */
+    upto += strlen(p + upto) + 1;  /* may have more after \0 */
+  } while (upto <= l);
+  return 1;  /* no special chars found */
+}
+
+
+static void prepstate (MatchState *ms, lua_State *L, int srcidx,
+                       const char *s, size_t ls, const char *p, size_t lp) {
+  ms->L = L;
+  ms->srcidx = srcidx;
+  ms->matchdepth = MAXCCALLS;
+  ms->src_init = s;
+  ms->src_end = s + ls;
+  ms->p_end = p + lp;
+  ms->prog = NULL;
+  ms->memo = NULL;
+  if (ls < (MAX_SIZET - B_REPS) / A_REPS)
+    ms->nrep = A_REPS * ls + B_REPS;
+  else  /* overflow (very long subject) */
+    ms->nrep = MAX_SIZET;  /* no limit */
+}
+
+
+static void reprepstate (MatchState *ms) {
+  ms->level = 0;
+  lua_assert(ms->matchdepth == MAXCCALLS);
+}
+
+
+static int str_find_aux (lua_State *L, int find) {
+  size_t ls, lp;
+  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *p = luaL_checklstring(L, 2, &lp);
+  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
+  if (init < 1) init = 1;
+  else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
+    lua_pushnil(L);  /* cannot find anything */
+    return 1;
+  }
+  /* explicit request or no special characters? */
+  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+    /* do a plain search */
+    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
+    if (s2) {
+      lua_pushinteger(L, (s2 - s) + 1);
+      lua_pushinteger(L, (s2 - s) + lp);
+      return 2;
+    }
+  }
+  else {
+    MatchState ms;
+    unsigned char memo[MEMOSIZE];
+    const char *s1 = s + init - 1;
+    int anchor = (*p == '^');
+    const PatProg *prog = getprog(L, 2);
+    if (anchor) {
+      p++; lp--;  /* skip anchor character */
+    }
+    prepstate(&ms, L, 1, s, ls, p, lp);
+    ms.prog = prog;
+    setmemo(&ms, memosize(prog, ls), memo);
+    do {
+      const char *res;
+      if (prog != NULL && !anchor &&
+          (s1 = nextstart(&ms, s1, &prog->item[0])) == NULL)
+        break;  /* first char of the pattern does not occur any more */
+      reprepstate(&ms);
+      if ((res=domatch(&ms, s1, p)) != NULL) {
+        if (find) {
+          lua_pushinteger(L, (s1 - s) + 1);  /* start */
+          lua_pushinteger(L, res - s);   /* end */
+          return push_captures(&ms, NULL, 0) + 2;
+        }
+        else
+          return push_captures(&ms, s1, res);
+      }
+    } while (s1++ < ms.src_end && !anchor);
+  }
+  lua_pushnil(L);  /* not found */
+  return 1;
+}
+
+
+static int str_find (lua_State *L) {
+  return str_find_aux(L, 1);
+}
+
+
+static int str_match (lua_State *L) {
+  return str_find_aux(L, 0);
+}
+
+
+/* state for 'gmatch' */
+typedef struct GMatchState {
+  const char *src;  /* current position */
+  const char *p;  /* pattern */
   MatchState ms;  /* match state */
+  unsigned char memo[1];  /* memo for the whole iteration (variable size) */
 } GMatchState;
 
 
@@ -690,8 +1449,11 @@ static int gmatch_aux (lua_State *L) {
   const char *src;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if (gm->ms.prog != NULL &&
+        (src = nextstart(&gm->ms, src, &gm->ms.prog->item[0])) == NULL)
+      break;  /* first char of the pattern does not occur any more */
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL) {
+    if ((e = domatch(&gm->ms, src, gm->p)) != NULL) {
       if (e == src)  /* empty match? */
         gm->src =src + 1;  /* go at least one position */
       else
@@ -708,45 +1470,67 @@ static int gmatch (lua_State *L) {
   const char *s = luaL_checklstring(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   GMatchState *gm;
+  const PatProg *prog;
+  size_t memosz;
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
-  gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState));
-  prepstate(&gm->ms, L, s, ls, p, lp);
+  prog = getprog(L, 2);  /* also kept on closure */
+  if (prog != NULL && prog->anchor)  /* '^' is not an anchor in 'gmatch' */
+    prog = NULL;
+  memosz = memosize(prog, ls);
+  gm = (GMatchState *)lua_newuserdata(L, sizeof(GMatchState) + memosz);
+  lua_insert(L, 3);  /* put state before the compiled pattern */
+  prepstate(&gm->ms, L, lua_upvalueindex(1), s, ls, p, lp);
+  gm->ms.prog = prog;
+  if (memosz > 0) {
+    memset(gm->memo, 0, memosz);
+    gm->ms.memo = gm->memo;
+  }
   gm->src = s; gm->p = p;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
 
+/*
+** Adds replacement string 'news' for a match, copying the runs of text
+** between escapes at once.
+*/
 static void add_s (MatchState *ms, luaL_Buffer *b, const char *s,
-                                                   const char *e) {
-  size_t l, i;
+                   const char *e, const char *news, size_t l) {
+  size_t i;
   lua_State *L = ms->L;
-  const char *news = lua_tolstring(L, 3, &l);
   for (i = 0; i < l; i++) {
-    if (news[i] != L_ESC)
+    const char *esc = (const char *)memchr(news + i, L_ESC, l - i);
+    if (esc == NULL) {  /* no more escapes? */
+      luaL_addlstring(b, news + i, l - i);
+      break;
+    }
+    luaL_addlstring(b, news + i, esc - (news + i));  /* text before ESC */
+    i = (esc - news) + 1;  /* skip ESC */
+    if (!isdigit(uchar(news[i]))) {
+      if (news[i] != L_ESC)
+        luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
       luaL_addchar(b, news[i]);
+    }
+    else if (news[i] == '0')
+        luaL_addlstring(b, s, e - s);
     else {
-      i++;  /* skip ESC */
-      if (!isdigit(uchar(news[i]))) {
-        if (news[i] != L_ESC)
-          luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
-        luaL_addchar(b, news[i]);
-      }
-      else if (news[i] == '0')
-          luaL_addlstring(b, s, e - s);
-      else {
-        push_onecapture(ms, news[i] - '1', s, e);
-        luaL_tolstring(L, -1, NULL);  /* if number, convert it to string */
-        lua_remove(L, -2);  /* remove original value */
-        luaL_addvalue(b);  /* add capture to accumulated result */
-      }
+      push_onecapture(ms, news[i] - '1', s, e);
+      luaL_tolstring(L, -1, NULL);  /* if number, convert it to string */
+      lua_remove(L, -2);  /* remove original value */
+      luaL_addvalue(b);  /* add capture to accumulated result */
     }
   }
 }
 
 
+/*
+** Adds the replacement for a match. A replacement string is at 'news'
+** ('l' bytes), already known to be literal when 'literal' is true.
+*/
 static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
-                                       const char *e, int tr) {
+                       const char *e, int tr, const char *news, size_t l,
+                       int literal) {
   lua_State *L = ms->L;
   switch (tr) {
     case LUA_TFUNCTION: {
@@ -756,19 +1540,28 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
       lua_call(L, n, 1);
       break;
     }
-    case LUA_TTABLE: {
-      push_onecapture(ms, 0, s, e);
-      lua_gettable(L, 3);
+    case LUA_TTABLE: {  /* look up the first capture (or whole match) */
+      if (ms->level == 0)
+        lua_getlfield(L, 3, s, e - s);  /* no need to create a string */
+      else if (ms->capture[0].len >= 0)
+        lua_getlfield(L, 3, ms->capture[0].init, ms->capture[0].len);
+      else {  /* position or unfinished capture */
+        push_onecapture(ms, 0, s, e);
+        lua_gettable(L, 3);
+      }
       break;
     }
     default: {  /* LUA_TNUMBER or LUA_TSTRING */
-      add_s(ms, b, s, e);
+      if (literal)
+        luaL_addlstring(b, news, l);
+      else
+        add_s(ms, b, s, e, news, l);
       return;
     }
   }
   if (!lua_toboolean(L, -1)) {  /* nil or false? */
     lua_pop(L, 1);
-    lua_pushlstring(L, s, e - s);  /* keep original text */
+    push_subsrc(ms, s, e - s);  /* keep original text */
   }
   else if (!lua_isstring(L, -1))
     luaL_error(L, "invalid replacement value (a %s)", luaL_typename(L, -1));
@@ -785,21 +1578,34 @@ static int str_gsub (lua_State *L) {
   int anchor = (*p == '^');
   lua_Integer n = 0;
   MatchState ms;
+  unsigned char memo[MEMOSIZE];
+  const PatProg *prog;
   luaL_Buffer b;
+  const char *news = NULL;  /* replacement string */
+  size_t lnews = 0;
+  int literal = 0;  /* true if 'news' has no escapes */
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
+  lua_settop(L, 4);
+  if (tr == LUA_TNUMBER || tr == LUA_TSTRING) {
+    news = lua_tolstring(L, 3, &lnews);
+    literal = (memchr(news, L_ESC, lnews) == NULL);
+  }
+  prog = getprog(L, 2);  /* keep it on the stack while in use */
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
-  prepstate(&ms, L, src, srcl, p, lp);
+  prepstate(&ms, L, 1, src, srcl, p, lp);
+  ms.prog = prog;
+  setmemo(&ms, memosize(prog, srcl), memo);  /* (before the buffer) */
+  luaL_buffinit(L, &b);
   while (n < max_s) {
     const char *e;
     reprepstate(&ms);
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = domatch(&ms, src, p)) != NULL) {
       n++;
-      add_value(&ms, &b, src, e, tr);
+      add_value(&ms, &b, src, e, tr, news, lnews, literal);
     }
     if (e && e>src) /* non empty match? */
       src = e;  /* skip it */
@@ -814,6 +1620,109 @@ static int str_gsub (lua_State *L) {
   return 2;
 }
 
+
+/* counts the occurrences of char 'c' in 's' (with 'l' bytes) */
+static size_t countchar (const char *s, size_t l, char c) {
+  const char *e = s + l;
+  size_t n = 0;
+  while ((s = (const char *)memchr(s, c, e - s)) != NULL) {
+    n++; s++;
+  }
+  return n;
+}
+
+
+/*
+** Splits the string at index 'arg' by the separator at 'arg + 1' (a
+** plain string if the value at 'arg + 2' is true, otherwise a pattern)
+** into at most 'maxn' fields ('arg + 3'), stored in the table at 't' (a
+** new one if absent). Fields are pushed directly in the table's array
+** part, presized when the number of fields is easy to know in advance.
+*/
+static int splitaux (lua_State *L, int arg, int t) {
+  size_t ls, lsep;
+  const char *s = luaL_checklstring(L, arg, &ls);
+  const char *s0 = s;  /* fields are pushed as substrings of 's' */
+  const char *sep = luaL_checklstring(L, arg + 1, &lsep);
+  int plain = lua_toboolean(L, arg + 2);
+  lua_Integer maxn = luaL_optinteger(L, arg + 3, LUA_MAXINTEGER);
+  const char *e = s + ls;
+  lua_Integer n = 0;
+  lua_Integer oldn = 0;  /* previous length of the destination table */
+  luaL_argcheck(L, lsep > 0, arg + 1, "empty separator");
+  luaL_argcheck(L, maxn > 0, arg + 3, "must be positive");
+  lua_settop(L, 5);
+  if (lua_isnil(L, t)) {
+    size_t size = 1;
+    if (plain && lsep == 1)  /* easy to count the fields? */
+      size += countchar(s, ls, *sep);
+    if (size > (size_t)maxn) size = (size_t)maxn;
+    lua_createtable(L, (size <= INT_MAX) ? (int)size : 0, 0);
+    lua_replace(L, t);
+  }
+  else {
+    luaL_checktype(L, t, LUA_TTABLE);
+    oldn = (lua_Integer)lua_rawlen(L, t);
+  }
+  if (plain) {
+    while (n < maxn - 1) {
+      const char *f = (lsep == 1)
+                    ? (const char *)memchr(s, *sep, e - s)
+                    : lmemfind(s, e - s, sep, lsep);
+      if (f == NULL) break;
+      lua_pushsubstr(L, arg, s - s0, f - s);
+      lua_rawseti(L, t, ++n);
+      s = f + lsep;
+    }
+  }
+  else {
+    MatchState ms;
+    unsigned char memo[MEMOSIZE];
+    const PatProg *prog = getprog(L, arg + 1);  /* keep it on the stack */
+    const char *p1;
+    if (prog != NULL && prog->anchor)  /* '^' is not an anchor here */
+      prog = NULL;
+    prepstate(&ms, L, arg, s, ls, sep, lsep);
+    ms.prog = prog;
+    setmemo(&ms, memosize(prog, ls), memo);
+    for (p1 = s; n < maxn - 1 && p1 < e; p1++) {
+      const char *me;
+      if (prog != NULL &&
+          (p1 = nextstart(&ms, p1, &prog->item[0])) == NULL)
+        break;  /* no more separators */
+      reprepstate(&ms);
+      if ((me = domatch(&ms, p1, sep)) != NULL && me > p1) {
+        lua_pushsubstr(L, arg, s - s0, p1 - s);  /* field before separator */
+        lua_rawseti(L, t, ++n);
+        s = me;
+        p1 = me - 1;  /* continue after the separator */
+      }
+    }
+  }
+  lua_pushsubstr(L, arg, s - s0, e - s);  /* last field */
+  lua_rawseti(L, t, ++n);
+  while (oldn > n) {  /* erase old extra fields of destination */
+    lua_pushnil(L);
+    lua_rawseti(L, t, oldn--);
+  }
+  lua_pushvalue(L, t);
+  lua_pushinteger(L, n);
+  return 2;
+}
+
+
+/* string.split(s, sep [, plain [, maxn [, dst]]]) */
+static int str_split (lua_State *L) {
+  return splitaux(L, 1, 5);
+}
+
+
+/* string.splitinto(dst, s, sep [, plain [, maxn]]) */
+static int str_splitinto (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  return splitaux(L, 2, 1);
+}
+
 /* }====================================================== */
 
 
@@ -913,79 +1822,372 @@ static int lua_number2strx (lua_State *L, char *buff, int sz,
 #define MAX_ITEM        (120 + l_mathlim(MAX_10_EXP))
 
 
-/* valid flags in a format specification */
-#define FLAGS	"-+ #0"
+/* valid flags in a format specification */
+#define FLAGS	"-+ #0"
+
+/*
+** maximum size of each format specification (such as "%-099.99d")
+*/
+#define MAX_FORMAT	32
+
+
+static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
+  size_t l;
+  const char *s = luaL_checklstring(L, arg, &l);
+  luaL_addchar(b, '"');
+  while (l--) {
+    if (*s == '"' || *s == '\\' || *s == '\n') {
+      luaL_addchar(b, '\\');
+      luaL_addchar(b, *s);
+    }
+    else if (*s == '\0' || iscntrl(uchar(*s))) {
+      char buff[10];
+      if (!isdigit(uchar(*(s+1))))
+        l_sprintf(buff, sizeof(buff), "\\%d", (int)uchar(*s));
+      else
+        l_sprintf(buff, sizeof(buff), "\\%03d", (int)uchar(*s));
+      luaL_addstring(b, buff);
+    }
+    else
+      luaL_addchar(b, *s);
+    s++;
+  }
+  luaL_addchar(b, '"');
+}
+
+static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+  const char *p = strfrmt;
+  while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
+  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
+    luaL_error(L, "invalid format (repeated flags)");
+  if (isdigit(uchar(*p))) p++;  /* skip width */
+  if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+  if (*p == '.') {
+    p++;
+    if (isdigit(uchar(*p))) p++;  /* skip precision */
+    if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+  }
+  if (isdigit(uchar(*p)))
+    luaL_error(L, "invalid format (width or precision too long)");
+  *(form++) = '%';
+  memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
+  form += (p - strfrmt) + 1;
+  *form = '\0';
+  return p;
+}
+
+
+/*
+** add length modifier into formats
+*/
+static void addlenmod (char *form, const char *lenmod) {
+  size_t l = strlen(form);
+  size_t lm = strlen(lenmod);
+  char spec = form[l - 1];
+  strcpy(form + l - 1, lenmod);
+  form[l + lm - 1] = spec;
+  form[l + lm] = '\0';
+}
+
+
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE	/* { */
+
+/* exact powers of 10 for 'fmtfixed' */
+static const double fixedpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15
+};
+
+
+/*
+** Formats 'x' as "%.<prec>f" would do it, when 'x * 10^prec' has at most
+** 52 bits and is not too close to a rounding tie to be rounded correctly
+** in double arithmetic (the product has a relative error of at most
+** 2^-53). Returns 0 otherwise.
+*/
+static int fmtfixed (char *buff, double x, int prec) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *d = end;
+  char *b = buff;
+  double a = (x < 0) ? -x : x;
+  double m, r, hi, lo;
+  int i, nd;
+  if (prec > 15 || !(a < 1e15))  /* too large (or not a number)? */
+    return 0;
+  m = a * fixedpow10[prec];
+  if (!(m < 4503599627370496.0))  /* 2^52 */
+    return 0;
+  r = floor(m);
+  if (fabs(m - r - 0.5) <= m * 8.8817841970012523e-16)  /* 2^-50 */
+    return 0;  /* too close to a tie */
+  if (m - r > 0.5) r += 1;
+  hi = floor(r / 1e8);  /* split 'r' in two parts with 8 digits at most */
+  lo = r - hi * 1e8;
+  if (lo < 0) { hi -= 1; lo += 1e8; }
+  else if (lo >= 1e8) { hi += 1; lo -= 1e8; }
+  for (i = 0; i < 8; i++) {  /* 8 low digits */
+    double q = floor(lo / 10);
+    *--d = (char)('0' + (int)(lo - q * 10));
+    lo = q;
+  }
+  while (hi > 0) {
+    double q = floor(hi / 10);
+    *--d = (char)('0' + (int)(hi - q * 10));
+    hi = q;
+  }
+  while (d > end - prec - 1)  /* at least one digit before the point */
+    *--d = '0';
+  while (d < end - prec - 1 && *d == '0')  /* remove leading zeros */
+    d++;
+  nd = (int)(end - d);
+  if (x < 0 || (x == 0 && 1 / x < 0))  /* negative (or -0.0)? */
+    *b++ = '-';
+  while (nd > prec) {  /* integral part */
+    *b++ = *d++; nd--;
+  }
+  if (prec > 0) {
+    *b++ = lua_getlocaledecpoint();
+    while (d < end) *b++ = *d++;
+  }
+  return (int)(b - buff);
+}
+
+#else				/* }{ */
+
+#define fmtfixed(b,x,prec)	0
+
+#endif				/* } */
+
+
+/* formats 'u' in hexadecimal, as "%x" or "%X" would do it */
+static int fmthex (char *buff, lua_Unsigned u, int upper) {
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char temp[2 * sizeof(lua_Unsigned)];
+  int n = 0, i;
+  do {
+    temp[n++] = digits[u & 0xf];
+    u >>= 4;
+  } while (u != 0);
+  for (i = 0; i < n; i++)
+    buff[i] = temp[n - 1 - i];
+  return n;
+}
+
+
+/*
+** Formats argument 'arg' according to conversion 'conv' with format
+** 'form' (as built by 'scanformat'), into 'buff' or directly into 'b'.
+** Returns the number of bytes put into 'buff'. Common conversions
+** without flags are done without 'sprintf'.
+*/
+static int formatitem (lua_State *L, luaL_Buffer *b, int arg, int conv,
+                       char *form, char *buff) {
+  int nb = 0;  /* number of bytes in added item */
+  switch (conv) {
+    case 'c': {
+      nb = l_sprintf(buff, MAX_ITEM, form, (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i':
+    case 'o': case 'u': case 'x': case 'X': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (form[2] == '\0' && lua_isinteger(L, arg)) {  /* plain integer? */
+        if (conv == 'd' || conv == 'i') {  /* avoid 'sprintf' */
+          nb = (int)lua_numbertobuff(L, arg, buff, 0);
+          break;
+        }
+        else if (conv == 'x' || conv == 'X') {
+          nb = fmthex(buff, (lua_Unsigned)n, conv == 'X');
+          break;
+        }
+      }
+      addlenmod(form, LUA_INTEGER_FRMLEN);
+      nb = l_sprintf(buff, MAX_ITEM, form, n);
+      break;
+    }
+    case 'a': case 'A':
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = lua_number2strx(L, buff, MAX_ITEM, form,
+                              luaL_checknumber(L, arg));
+      break;
+    case 'e': case 'E': case 'f':
+    case 'g': case 'G': {
+      if (form[2] == '\0' && conv == 'g' &&
+          lua_type(L, arg) == LUA_TNUMBER && !lua_isinteger(L, arg)) {
+        /* plain '%g' of a float; avoid 'sprintf' */
+        nb = (int)lua_numbertobuff(L, arg, buff, 6);
+        break;
+      }
+      else if (conv == 'f' && lua_type(L, arg) == LUA_TNUMBER &&
+               (form[2] == '\0' ||  /* '%f' or '%.Nf'? */
+                (form[1] == '.' && form[strspn(form + 2, "0123456789") + 2]
+                                   == 'f'))) {
+        int prec = (form[2] == '\0') ? 6 : atoi(form + 2);
+        if ((nb = fmtfixed(buff, lua_tonumber(L, arg), prec)) > 0)
+          break;
+      }
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = l_sprintf(buff, MAX_ITEM, form, luaL_checknumber(L, arg));
+      break;
+    }
+    case 'q': {
+      addquoted(L, b, arg);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_tolstring(L, arg, &l);
+      if (form[2] == '\0')  /* no modifiers? */
+        luaL_addvalue(b);  /* keep entire string */
+      else {
+        luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
+        if (!strchr(form, '.') && l >= 100) {
+          /* no precision and string is too long to be formatted */
+          luaL_addvalue(b);  /* keep entire string */
+        }
+        else {  /* format the string into 'buff' */
+          nb = l_sprintf(buff, MAX_ITEM, form, s);
+          lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+        }
+      }
+      break;
+    }
+    default: {  /* also treat cases 'pnLlh' */
+      return luaL_error(L, "invalid option '%%%c' to 'format'", conv);
+    }
+  }
+  lua_assert(nb < MAX_ITEM);
+  return nb;
+}
+
+
+/*
+** {======================================================
+** Preparsed formats
+** Each format string used by 'string.format' is parsed once into a
+** list of literal pieces and conversions, kept in a cache (the second
+** upvalue of the string functions) keyed by the format string. Formats
+** with errors are not cached; they are always handled by 'formatslow',
+** which raises errors where it finds them.
+** =======================================================
+*/
+
+/* maximum number of items in a preparsed format */
+#if !defined(MAXFMTITEMS)
+#define MAXFMTITEMS	32
+#endif
+
+/* formats shorter than this are not worth a cache lookup */
+#if !defined(FMTCACHEMIN)
+#define FMTCACHEMIN	8
+#endif
+
+/* maximum number of preparsed formats kept in the cache */
+#if !defined(FMTCACHESIZE)
+#define FMTCACHESIZE	64
+#endif
 
-/*
-** maximum size of each format specification (such as "%-099.99d")
-*/
-#define MAX_FORMAT	32
 
+typedef struct FmtItem {
+  size_t pos;  /* literal: its start in the format string */
+  size_t len;  /* literal: its length */
+  char conv;  /* conversion char, or '\0' for a literal */
+  char form[MAX_FORMAT];  /* conversion: '%...' as built by 'scanformat' */
+} FmtItem;
 
-static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
-  size_t l;
-  const char *s = luaL_checklstring(L, arg, &l);
-  luaL_addchar(b, '"');
-  while (l--) {
-    if (*s == '"' || *s == '\\' || *s == '\n') {
-      luaL_addchar(b, '\\');
-      luaL_addchar(b, *s);
+typedef struct FmtSpec {
+  int nitems;
+  FmtItem item[1];  /* variable size */
+} FmtSpec;
+
+
+/*
+** Parses a format into 'items', as 'formatslow' would traverse it.
+** Returns the number of items, or -1 if the format is invalid or too
+** long.
+*/
+static int parseformat (const char *strfrmt, size_t sfl, FmtItem *items) {
+  const char *strfrmt_end = strfrmt + sfl;
+  int n = 0;
+  while (strfrmt < strfrmt_end) {
+    FmtItem *it = &items[n];
+    if (n++ >= MAXFMTITEMS) return -1;  /* too long */
+    it->conv = '\0';
+    if (*strfrmt != L_ESC) {  /* literal text up to the next '%' */
+      const char *e = (const char *)memchr(strfrmt, L_ESC,
+                                           strfrmt_end - strfrmt);
+      if (e == NULL) e = strfrmt_end;
+      it->pos = strfrmt - (strfrmt_end - sfl);
+      it->len = e - strfrmt;
+      strfrmt = e;
     }
-    else if (*s == '\0' || iscntrl(uchar(*s))) {
-      char buff[10];
-      if (!isdigit(uchar(*(s+1))))
-        l_sprintf(buff, sizeof(buff), "\\%d", (int)uchar(*s));
-      else
-        l_sprintf(buff, sizeof(buff), "\\%03d", (int)uchar(*s));
-      luaL_addstring(b, buff);
+    else if (strfrmt + 1 < strfrmt_end && strfrmt[1] == L_ESC) {  /* %% */
+      it->pos = (strfrmt + 1) - (strfrmt_end - sfl);
+      it->len = 1;
+      strfrmt += 2;
+    }
+    else {  /* conversion (same rules as 'scanformat') */
+      const char *p = ++strfrmt;
+      while (p < strfrmt_end && *p != '\0' && strchr(FLAGS, *p) != NULL)
+        p++;  /* skip flags */
+      if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
+        return -1;  /* repeated flags */
+      if (isdigit(uchar(*p))) p++;  /* skip width */
+      if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+      if (*p == '.') {
+        p++;
+        if (isdigit(uchar(*p))) p++;  /* skip precision */
+        if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+      }
+      if (isdigit(uchar(*p)) || p >= strfrmt_end ||
+          strchr("cdiouxXaAeEfgGqs", *p) == NULL || *p == '\0')
+        return -1;  /* invalid format or option */
+      it->conv = *p;
+      it->form[0] = '%';
+      memcpy(it->form + 1, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
+      it->form[(p - strfrmt) + 2] = '\0';
+      strfrmt = p + 1;
     }
-    else
-      luaL_addchar(b, *s);
-    s++;
-  }
-  luaL_addchar(b, '"');
-}
-
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
-  const char *p = strfrmt;
-  while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
-    luaL_error(L, "invalid format (repeated flags)");
-  if (isdigit(uchar(*p))) p++;  /* skip width */
-  if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
-  if (*p == '.') {
-    p++;
-    if (isdigit(uchar(*p))) p++;  /* skip precision */
-    if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
-  *(form++) = '%';
-  memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
-  form += (p - strfrmt) + 1;
-  *form = '\0';
-  return p;
+  return n;
 }
 
 
 /*
-** add length modifier into formats
+** Pushes the preparsed form of the format at index 1 (a full userdata),
+** or nil if it is not cacheable, and returns it.
 */
-static void addlenmod (char *form, const char *lenmod) {
-  size_t l = strlen(form);
-  size_t lm = strlen(lenmod);
-  char spec = form[l - 1];
-  strcpy(form + l - 1, lenmod);
-  form[l + lm - 1] = spec;
-  form[l + lm] = '\0';
+static const FmtSpec *getfmtspec (lua_State *L) {
+  size_t sfl;
+  const char *strfrmt = lua_tolstring(L, 1, &sfl);
+  FmtItem items[MAXFMTITEMS];
+  FmtSpec *spec;
+  int n;
+  lua_pushvalue(L, 1);
+  if (lua_rawget(L, lua_upvalueindex(2)) != LUA_TNIL)  /* cached? */
+    return (const FmtSpec *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if ((n = parseformat(strfrmt, sfl, items)) < 0) {
+    lua_pushnil(L);
+    return NULL;
+  }
+  spec = (FmtSpec *)lua_newuserdata(L, sizeof(FmtSpec) +
+                                       n * sizeof(FmtItem));
+  spec->nitems = n;
+  memcpy(spec->item, items, n * sizeof(FmtItem));
+  cacheput(L, lua_upvalueindex(2), 1, FMTCACHESIZE);
+  return spec;
 }
 
+/* }====================================================== */
 
-static int str_format (lua_State *L) {
-  int top = lua_gettop(L);
+
+/* 'string.format' for formats that were not preparsed */
+static int formatslow (lua_State *L, int top) {
   int arg = 1;
   size_t sfl;
-  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
+  const char *strfrmt = lua_tolstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
@@ -997,62 +2199,43 @@ static int str_format (lua_State *L) {
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
       char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
-      int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
       strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          nb = l_sprintf(buff, MAX_ITEM, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-        case 'o': case 'u': case 'x': case 'X': {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, n);
-          break;
-        }
-        case 'a': case 'A':
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, MAX_ITEM, form,
-                                  luaL_checknumber(L, arg));
-          break;
-        case 'e': case 'E': case 'f':
-        case 'g': case 'G': {
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = l_sprintf(buff, MAX_ITEM, form, luaL_checknumber(L, arg));
-          break;
-        }
-        case 'q': {
-          addquoted(L, &b, arg);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
-          else {
-            luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
-            if (!strchr(form, '.') && l >= 100) {
-              /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
-            }
-            else {  /* format the string into 'buff' */
-              nb = l_sprintf(buff, MAX_ITEM, form, s);
-              lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-            }
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
-        }
-      }
-      lua_assert(nb < MAX_ITEM);
-      luaL_addsize(&b, nb);
+      luaL_addsize(&b, formatitem(L, &b, arg, *strfrmt++, form, buff));
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int str_format (lua_State *L) {
+  int top = lua_gettop(L);
+  int arg = 1;
+  const FmtSpec *spec;
+  int i;
+  size_t sfl;
+  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
+  luaL_Buffer b;
+  if (sfl < FMTCACHEMIN)  /* short format? */
+    return formatslow(L, top);
+  if ((spec = getfmtspec(L)) == NULL) {  /* not preparsed? */
+    lua_settop(L, top);
+    return formatslow(L, top);
+  }
+  luaL_buffinit(L, &b);  /* (spec stays below the buffer) */
+  for (i = 0; i < spec->nitems; i++) {
+    const FmtItem *it = &spec->item[i];
+    if (it->conv == '\0')  /* literal? */
+      luaL_addlstring(&b, strfrmt + it->pos, it->len);
+    else {
+      char form[MAX_FORMAT];  /* copy, as 'formatitem' may change it */
+      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
+      if (++arg > top)
+        luaL_argerror(L, arg, "no value");
+      strcpy(form, it->form);
+      luaL_addsize(&b, formatitem(L, &b, arg, it->conv, form, buff));
     }
   }
   luaL_pushresult(&b);
@@ -1139,6 +2322,9 @@ typedef enum KOption {
   Knop		/* no-op (configuration or spaces) */
 } KOption;
 
+/* options before Kpadding take (or give back) a value */
+#define takesvalue(opt)		((opt) < Kpadding)
+
 
 /*
 ** Read an integer numeral from string 'fmt' or return 'df' if
@@ -1224,16 +2410,15 @@ static KOption getoption (Header *h, const char **fmt, int *size) {
 
 
 /*
-** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
-** always gets its full alignment, other options are limited by 
+** Read and classify the next option, filling 'psize' with its size and
+** 'palign' with its alignment (1 if it needs none).
+** Local variable 'align' starts with the size to be aligned. (Kpadal
+** option always gets its full alignment, other options are limited by
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
+static KOption getoptalign (Header *h, const char **fmt,
+                            int *psize, int *palign) {
   KOption opt = getoption(h, fmt, psize);
   int align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1241,14 +2426,33 @@ static KOption getdetails (Header *h, size_t totalsize,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    align = 1;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
   }
+  *palign = align;
+  return opt;
+}
+
+
+/* number of padding bytes to align position 'pos' to 'align' */
+#define padding(pos,align)  \
+	((int)(((align) - ((pos) & ((align) - 1))) & ((align) - 1)))
+
+
+/*
+** Read, classify, and fill other details about the next option.
+** 'psize' is filled with option's size, 'notoalign' with the padding
+** needed to align it after 'totalsize' bytes.
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+  int align;
+  KOption opt = getoptalign(h, fmt, psize, &align);
+  *ntoalign = padding(totalsize, (size_t)align);
   return opt;
 }
 
@@ -1294,6 +2498,104 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
+/*
+** Add to 'b' the value at index 'arg' packed as option 'opt' (the
+** caller adds its alignment), updating 'totalsize' for variable-length
+** options. Return NULL on success, an empty message if the value has
+** the wrong type, or an error message.
+*/
+static const char *packitem (lua_State *L, luaL_Buffer *b, KOption opt,
+                             int size, int islittle, int arg,
+                             size_t *totalsize) {
+  switch (opt) {
+    case Kint: {  /* signed integers */
+      int isnum;
+      lua_Integer n = lua_tointegerx(L, arg, &isnum);
+      if (!isnum) return "";
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        if (!(-lim <= n && n < lim)) return "integer overflow";
+      }
+      packint(b, (lua_Unsigned)n, islittle, size, (n < 0));
+      break;
+    }
+    case Kuint: {  /* unsigned integers */
+      int isnum;
+      lua_Integer n = lua_tointegerx(L, arg, &isnum);
+      if (!isnum) return "";
+      if (size < SZINT &&  /* need overflow check? */
+          (lua_Unsigned)n >= ((lua_Unsigned)1 << (size * NB)))
+        return "unsigned overflow";
+      packint(b, (lua_Unsigned)n, islittle, size, 0);
+      break;
+    }
+    case Kfloat: {  /* floating-point options */
+      volatile Ftypes u;
+      char *buff;
+      int isnum;
+      lua_Number n = lua_tonumberx(L, arg, &isnum);  /* get argument */
+      if (!isnum) return "";
+      buff = luaL_prepbuffsize(b, size);
+      if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+      else if (size == sizeof(u.d)) u.d = (double)n;
+      else u.n = n;
+      /* move 'u' to final result, correcting endianness if needed */
+      copywithendian(buff, u.buff, size, islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Kchar: {  /* fixed-size string */
+      size_t len;
+      const char *s = lua_tolstring(L, arg, &len);
+      if (s == NULL) return "";
+      if ((size_t)size <= len)  /* string larger than (or equal to) needed? */
+        luaL_addlstring(b, s, size);  /* truncate string to asked size */
+      else {  /* string smaller than needed */
+        luaL_addlstring(b, s, len);  /* add it all */
+        while (len++ < (size_t)size)  /* pad extra space */
+          luaL_addchar(b, LUA_PACKPADBYTE);
+      }
+      break;
+    }
+    case Kstring: {  /* strings with length count */
+      size_t len;
+      const char *s = lua_tolstring(L, arg, &len);
+      if (s == NULL) return "";
+      if (size < (int)sizeof(size_t) && len >= ((size_t)1 << (size * NB)))
+        return "string length does not fit in given size";
+      packint(b, (lua_Unsigned)len, islittle, size, 0);  /* pack length */
+      luaL_addlstring(b, s, len);
+      *totalsize += len;
+      break;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      size_t len;
+      const char *s = lua_tolstring(L, arg, &len);
+      if (s == NULL) return "";
+      if (strlen(s) != len) return "string contains zeros";
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      *totalsize += len + 1;
+      break;
+    }
+    case Kpadding: luaL_addchar(b, LUA_PACKPADBYTE);  /* FALLTHROUGH */
+    case Kpaddalign: case Knop:
+      break;
+  }
+  return NULL;
+}
+
+
+/* name of the type expected by an option that packs a value */
+static const char *packtypename (KOption opt) {
+  switch (opt) {
+    case Kint: case Kuint: return "integer";
+    case Kfloat: return "number";
+    default: return "string";
+  }
+}
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
   Header h;
@@ -1305,77 +2607,21 @@ static int str_pack (lua_State *L) {
   luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     int size, ntoalign;
+    const char *msg;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
      luaL_addchar(&b, LUA_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
-        break;
-      }
-      case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        if ((size_t)size <= len)  /* string larger than (or equal to) needed? */
-          luaL_addlstring(&b, s, size);  /* truncate string to asked size */
-        else {  /* string smaller than needed */
-          luaL_addlstring(&b, s, len);  /* add it all */
-          while (len++ < (size_t)size)  /* pad extra space */
-            luaL_addchar(&b, LUA_PACKPADBYTE);
-        }
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-                         len < ((size_t)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
-        break;
-      }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
-        break;
+    if (!takesvalue(opt))
+      msg = packitem(L, &b, opt, size, h.islittle, 0, &totalsize);
+    else if ((msg = packitem(L, &b, opt, size, h.islittle, ++arg,
+                             &totalsize)) != NULL) {
+      if (*msg == '\0') {  /* wrong type? let the usual checks complain */
+        if (opt == Kfloat) luaL_checknumber(L, arg);
+        else if (opt == Kint || opt == Kuint) luaL_checkinteger(L, arg);
+        else luaL_checkstring(L, arg);
       }
-      case Kpadding: luaL_addchar(&b, LUA_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
+      luaL_argerror(L, arg, msg);
     }
   }
   luaL_pushresult(&b);
@@ -1442,6 +2688,18 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/*
+** Unpack a float with 'size' bytes and 'islittle' endianness.
+*/
+static lua_Number unpackfloat (const char *str, int islittle, int size) {
+  volatile Ftypes u;
+  copywithendian(u.buff, str, size, islittle);
+  if (size == sizeof(u.f)) return (lua_Number)u.f;
+  else if (size == sizeof(u.d)) return (lua_Number)u.d;
+  else return u.n;
+}
+
+
 static int str_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
@@ -1469,13 +2727,7 @@ static int str_unpack (lua_State *L) {
         break;
       }
       case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
+        lua_pushnumber(L, unpackfloat(data + pos, h.islittle, size));
         break;
       }
       case Kchar: {
@@ -1505,6 +2757,268 @@ static int str_unpack (lua_State *L) {
   return n + 1;
 }
 
+
+/*
+** Compiled pack format: one item per option, with its alignment and
+** endianness already resolved, so that many records can be (un)packed
+** without reading the format again.
+*/
+typedef struct PackItem {
+  KOption opt;
+  int size;
+  int align;  /* 1 for options that need no alignment */
+  int islittle;
+} PackItem;
+
+
+/*
+** Compile the format at index 1 into a userdata pushed on the stack.
+** Set 'ni' to the number of items and 'nf' to the number of values
+** in each record, which must not be zero.
+*/
+static const PackItem *compilepack (lua_State *L, int *ni, int *nf) {
+  Header h;
+  size_t lf;
+  const char *fmt = luaL_checklstring(L, 1, &lf);
+  PackItem *items = (PackItem *)lua_newuserdata(L, (lf + 1) * sizeof(PackItem));
+  *ni = *nf = 0;
+  initheader(L, &h);
+  while (*fmt != '\0') {
+    PackItem *it = &items[*ni];
+    it->opt = getoptalign(&h, &fmt, &it->size, &it->align);
+    it->islittle = h.islittle;
+    if (it->opt != Knop) (*ni)++;
+    if (takesvalue(it->opt)) (*nf)++;
+  }
+  luaL_argcheck(L, *nf > 0, 1, "format has no values");
+  luaL_checkstack(L, *nf + LUA_MINSTACK, "too many values in format");
+  return items;
+}
+
+
+/*
+** Decode a record at 'data + *ppos', pushing its values. If 'data'
+** ends before the record, push nothing and return 0; otherwise update
+** '*ppos' to the end of the record.
+*/
+static int unpackrecord (lua_State *L, const PackItem *items, int ni,
+                         const char *data, size_t ld, size_t *ppos) {
+  size_t pos = *ppos;
+  int i;
+  int n = 0;  /* number of values pushed */
+  for (i = 0; i < ni; i++) {
+    const PackItem *it = &items[i];
+    size_t size = (size_t)it->size;
+    size_t ntoalign = (size_t)padding(pos, (size_t)it->align);
+    if (ntoalign + size > ld - pos) break;  /* incomplete record */
+    pos += ntoalign;
+    switch (it->opt) {
+      case Kint: case Kuint:
+        lua_pushinteger(L, unpackint(L, data + pos, it->islittle, it->size,
+                                        (it->opt == Kint)));
+        break;
+      case Kfloat:
+        lua_pushnumber(L, unpackfloat(data + pos, it->islittle, it->size));
+        break;
+      case Kchar:
+        lua_pushlstring(L, data + pos, size);
+        break;
+      case Kstring: {
+        size_t len = (size_t)unpackint(L, data + pos, it->islittle,
+                                          it->size, 0);
+        if (len > ld - pos - size) goto incomplete;
+        lua_pushlstring(L, data + pos + size, len);
+        pos += len;  /* skip string */
+        break;
+      }
+      case Kzstr: {
+        size_t len = strlen(data + pos);
+        if (len >= ld - pos) goto incomplete;  /* no final '\0' in data? */
+        lua_pushlstring(L, data + pos, len);
+        pos += len + 1;  /* skip string plus final '\0' */
+        break;
+      }
+      default: break;
+    }
+    if (takesvalue(it->opt)) n++;
+    pos += size;
+  }
+  if (i == ni) {
+    *ppos = pos;
+    return 1;
+  }
+ incomplete:
+  lua_pop(L, n);
+  return 0;
+}
+
+
+/*
+** string.unpackmany(fmt, data [, pos [, n [, dst [, columns]]]]):
+** decodes up to 'n' consecutive records of format 'fmt' (all complete
+** ones by default) starting at 'pos'. Values go to 'dst' (a new table
+** if absent): one after the other from index 1, or, if 'columns' is
+** true, with field 'i' of each record in the table dst[i] (created if
+** needed). Older entries after the new ones are erased. Returns 'dst',
+** the number of records, and the position of the first byte not read,
+** which is where an incomplete last record starts.
+*/
+static int str_unpackmany (lua_State *L) {
+  size_t ld;
+  const char *data = luaL_checklstring(L, 2, &ld);
+  size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
+  lua_Integer maxn = luaL_optinteger(L, 4, LUA_MAXINTEGER);
+  int columns = lua_toboolean(L, 6);
+  lua_Integer n = 0;
+  int ni, nf, f;
+  const PackItem *items;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  luaL_argcheck(L, maxn >= 0, 4, "must be non-negative");
+  lua_settop(L, 6);
+  items = compilepack(L, &ni, &nf);  /* at index 7 */
+  if (lua_isnil(L, 5)) {
+    size_t est = 0;  /* estimate number of records when easy */
+    int i, minsize = 0;
+    for (i = 0; i < ni; i++)
+      minsize += items[i].size;
+    if (minsize > 0) est = (ld - pos) / (size_t)minsize;
+    if (est > (size_t)maxn) est = (size_t)maxn;
+    if (est > (size_t)(INT_MAX / nf)) est = 0;
+    if (columns) {
+      lua_createtable(L, nf, 0);
+      for (f = 1; f <= nf; f++) {
+        lua_createtable(L, (int)est, 0);
+        lua_rawseti(L, -2, f);
+      }
+    }
+    else
+      lua_createtable(L, (int)est * nf, 0);
+    lua_replace(L, 5);
+  }
+  else
+    luaL_checktype(L, 5, LUA_TTABLE);
+  if (columns) {  /* push the columns (at indices 8 to 7 + nf) */
+    for (f = 1; f <= nf; f++) {
+      if (lua_rawgeti(L, 5, f) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 0);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, 5, f);
+      }
+    }
+    /* each record is pushed above the columns */
+    luaL_checkstack(L, nf + LUA_MINSTACK, "too many values in format");
+  }
+  while (n < maxn) {
+    size_t start = pos;
+    if (!unpackrecord(L, items, ni, data, ld, &pos))
+      break;  /* no more complete records */
+    for (f = nf; f >= 1; f--) {  /* store values (from the top) */
+      if (columns)
+        lua_rawseti(L, 7 + f, n + 1);
+      else
+        lua_rawseti(L, 5, n * nf + f);
+    }
+    n++;
+    if (pos == start && lua_isnoneornil(L, 4))
+      luaL_argerror(L, 4, "records with no bytes need a count");
+  }
+  if (columns) {  /* erase old extra entries */
+    for (f = 1; f <= nf; f++) {
+      lua_Integer k = (lua_Integer)lua_rawlen(L, 7 + f);
+      for (; k > n; k--) {
+        lua_pushnil(L);
+        lua_rawseti(L, 7 + f, k);
+      }
+    }
+  }
+  else {
+    lua_Integer k = (lua_Integer)lua_rawlen(L, 5);
+    for (; k > n * nf; k--) {
+      lua_pushnil(L);
+      lua_rawseti(L, 5, k);
+    }
+  }
+  lua_pushvalue(L, 5);
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, (lua_Integer)pos + 1);
+  return 3;
+}
+
+
+/*
+** string.packmany(fmt, src [, n [, columns]]): packs 'n' records of
+** format 'fmt' in a single string, reversing 'string.unpackmany': the
+** values come one after the other from src[1], or, if 'columns' is
+** true, field 'i' of each record comes from the table src[i]. By
+** default 'n' is the length of the first column or the length of 'src'
+** divided by the number of values in a record.
+*/
+static int str_packmany (lua_State *L) {
+  luaL_Buffer b;
+  int columns = lua_toboolean(L, 4);
+  int ni, nf, i, f;
+  lua_Integer n, r;
+  size_t totalsize = 0;
+  const PackItem *items;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 4);
+  items = compilepack(L, &ni, &nf);  /* at index 5 */
+  lua_pushnil(L);  /* slot for the value being packed (index 6) */
+  if (columns) {  /* push the columns (at indices 7 to 6 + nf) */
+    for (f = 1; f <= nf; f++) {
+      if (lua_rawgeti(L, 2, f) != LUA_TTABLE)
+        luaL_error(L, "bad column %d (table expected, got %s)",
+                      f, luaL_typename(L, -1));
+    }
+    n = luaL_opt(L, luaL_checkinteger, 3, (lua_Integer)lua_rawlen(L, 7));
+  }
+  else {
+    lua_Integer len = (lua_Integer)lua_rawlen(L, 2);
+    if (lua_isnoneornil(L, 3)) {
+      luaL_argcheck(L, len % nf == 0, 2,
+                       "length is not a multiple of the values in a record");
+      n = len / nf;
+    }
+    else
+      n = luaL_checkinteger(L, 3);
+  }
+  luaL_argcheck(L, n >= 0, 3, "must be non-negative");
+  luaL_buffinit(L, &b);
+  for (r = 0; r < n; r++) {
+    f = 0;
+    for (i = 0; i < ni; i++) {
+      const PackItem *it = &items[i];
+      int ntoalign = padding(totalsize, (size_t)it->align);
+      const char *msg;
+      totalsize += ntoalign + it->size;
+      while (ntoalign-- > 0)
+        luaL_addchar(&b, LUA_PACKPADBYTE);  /* fill alignment */
+      if (!takesvalue(it->opt))
+        msg = packitem(L, &b, it->opt, it->size, it->islittle, 0, &totalsize);
+      else {
+        lua_Integer k = columns ? r + 1 : r * nf + f + 1;
+        lua_rawgeti(L, columns ? 7 + f : 2, k);
+        lua_replace(L, 6);  /* keep the buffer on the top */
+        f++;
+        msg = packitem(L, &b, it->opt, it->size, it->islittle, 6,
+                          &totalsize);
+        if (msg != NULL) {
+          if (*msg == '\0')  /* wrong type? */
+            msg = lua_pushfstring(L, "%s expected, got %s",
+                                  packtypename(it->opt), luaL_typename(L, 6));
+          if (columns)
+            luaL_error(L, "bad value #%I in column %d (%s)", k, f, msg);
+          else
+            luaL_error(L, "bad value #%I (%s)", k, msg);
+        }
+      }
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
 /* }====================================================== */
 
 
@@ -1521,11 +3035,17 @@ static const luaL_Reg strlib[] = {
   {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
+  {"split", str_split},
+  {"splitinto", str_splitinto},
   {"sub", str_sub},
+  {"tonumbers", str_tonumbers},
+  {"translate", str_translate},
   {"upper", str_upper},
   {"pack", str_pack},
+  {"packmany", str_packmany},
   {"packsize", str_packsize},
   {"unpack", str_unpack},
+  {"unpackmany", str_unpackmany},
   {NULL, NULL}
 };
 
@@ -1546,7 +3066,12 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_newlibtable(L, strlib);
+  lua_newtable(L);  /* cache of compiled patterns */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_PATCACHE);
+  lua_newtable(L);  /* cache of preparsed formats */
+  luaL_setfuncs(L, strlib, 2);  /* all functions share the caches */
   createmetatable(L);
   return 1;
 }
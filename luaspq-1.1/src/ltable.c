@@ -25,6 +25,7 @@
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -82,6 +83,184 @@ static const Node dummynode_ = {
 };
 
 
+#if defined(LUA_USE_SHAPES)	/* { */
+
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+/* maximum number of keys in a shape */
+#if !defined(LUAI_MAXSHAPEKEYS)
+#define LUAI_MAXSHAPEKEYS	32
+#endif
+
+#define isrootshape(g,s)	((s) == &(g)->rootshape)
+
+/* size of the block holding a shape with 'n' keys */
+#define shapesize(n,lsi)  \
+	(sizeof(Shape) + sizeof(TString *) * (n) + cast(size_t, twoto(lsi)))
+
+
+/*
+** returns the slot of 'key' in shape 's', or -1 if it is not there
+*/
+static int shapeslot (const Shape *s, const TString *key) {
+  if (s->nkeys > 0) {
+    unsigned int mask = twoto(s->lsizeindex) - 1;
+    unsigned int i = key->hash & mask;
+    int slot;
+    while ((slot = s->index[i]) != 0) {
+      if (s->keys[slot - 1] == key)
+        return slot - 1;
+      i = (i + 1) & mask;
+    }
+  }
+  return -1;
+}
+
+
+/*
+** creates the shape that extends 'parent' with 'key'. The index has
+** at least twice as many entries as keys, so probes always end.
+*/
+static Shape *newshape (lua_State *L, Shape *parent, TString *key) {
+  int n = parent->nkeys + 1;
+  int lsi = luaO_ceillog2(cast(unsigned int, 2 * n));
+  unsigned int mask = twoto(lsi) - 1;
+  Shape *s = cast(Shape *, luaM_malloc(L, shapesize(n, lsi)));
+  int i;
+  s->keys = cast(TString **, s + 1);
+  s->index = cast(lu_byte *, s->keys + n);
+  memset(s->index, 0, twoto(lsi));
+  for (i = 0; i < n; i++) {
+    TString *k = (i < n - 1) ? parent->keys[i] : key;
+    unsigned int h = k->hash & mask;
+    while (s->index[h] != 0)
+      h = (h + 1) & mask;
+    s->index[h] = cast_byte(i + 1);
+    s->keys[i] = k;
+  }
+  s->lasthash = key->hash;
+  s->nkeys = n;
+  s->refcount = 0;
+  s->lsizeindex = cast_byte(lsi);
+  s->kids = NULL;
+  s->parent = parent;
+  parent->refcount++;  /* kid keeps its parent alive */
+  s->sibling = parent->kids;
+  parent->kids = s;
+  return s;
+}
+
+
+/*
+** drops a reference to shape 's', freeing it (and then its ancestors)
+** when nothing else uses it
+*/
+static void releaseshape (lua_State *L, Shape *s) {
+  global_State *g = G(L);
+  while (!isrootshape(g, s) && --s->refcount == 0) {
+    Shape *p = s->parent;
+    Shape **l = &p->kids;
+    lua_assert(s->kids == NULL);
+    while (*l != s)  /* unlink 's' from its parent */
+      l = &(*l)->sibling;
+    *l = s->sibling;
+    luaM_freemem(L, s, shapesize(s->nkeys, s->lsizeindex));
+    s = p;
+  }
+}
+
+
+static void setslots (lua_State *L, Table *t, int size) {
+  int i;
+  luaM_reallocvector(L, t->slots, t->sizeslots, size, TValue);
+  for (i = t->sizeslots; i < size; i++)
+    setnilvalue(&t->slots[i]);
+  t->sizeslots = cast_byte(size);
+}
+
+
+/*
+** moves table 't' to the shape with one more key, 'key'; returns its
+** (empty) slot, or NULL if the table cannot keep a shape
+*/
+static TValue *newshapedkey (lua_State *L, Table *t, TString *key) {
+  Shape *s = t->shape;
+  Shape *kid;
+  int n = s->nkeys;
+  if (n >= LUAI_MAXSHAPEKEYS)
+    return NULL;  /* too many keys */
+  if (n == t->sizeslots)  /* no free slot? */
+    setslots(L, t, (n < 2) ? 4 : (2 * n < LUAI_MAXSHAPEKEYS)
+                                 ? 2 * n : LUAI_MAXSHAPEKEYS);
+  for (kid = s->kids; kid != NULL; kid = kid->sibling) {
+    /* (the hash check protects against a freed key reusing the
+       address of a live one while its dead tables wait for the sweep) */
+    if (kid->keys[n] == key && kid->lasthash == key->hash)
+      break;
+  }
+  if (kid == NULL)  /* first table getting this layout? */
+    kid = newshape(L, s, key);
+  kid->refcount++;
+  t->shape = kid;
+  releaseshape(L, s);  /* (cannot free 's', as 'kid' uses it) */
+  lua_assert(ttisnil(&t->slots[n]));
+  return &t->slots[n];
+}
+
+
+static void setnodevector (lua_State *L, Table *t, unsigned int size);
+
+/*
+** converts a shaped table into a regular one, moving its non-nil
+** fields into a new hash part
+*/
+static void deshape (lua_State *L, Table *t) {
+  Shape *s = t->shape;
+  TValue *slots = t->slots;
+  int size = t->sizeslots;
+  unsigned int nuse = 0;
+  int i;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i]))
+      nuse++;
+  }
+  lua_assert(isdummy(t->node));
+  setnodevector(L, t, nuse);  /* (on errors, table is left unchanged) */
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i])) {
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      /* doesn't need barrier/invalidate cache, as entry was
+         already present in the table */
+      setobjt2t(L, luaH_set(L, t, &k), &slots[i]);
+    }
+  }
+  luaM_freearray(L, slots, size);
+  releaseshape(L, s);
+}
+
+
+/*
+** makes empty table 't' share its string keys with other tables
+** built the same way
+*/
+void luaH_setshape (lua_State *L, Table *t) {
+  lua_assert(!isshaped(t) && isdummy(t->node));
+  t->shape = &G(L)->rootshape;
+}
+
+/* }============================================================= */
+
+#endif				/* } */
+
+
 /*
 ** Hash for floating-point numbers.
 ** The main computation should be just
@@ -156,7 +335,9 @@ static unsigned int arrayindex (const TValue *key) {
 /*
 ** returns the index of a 'key' for table traversals. First goes all
 ** elements in the array part, then elements in the hash part. The
-** beginning of a traversal is signaled by 0.
+** beginning of a traversal is signaled by 0. A traversal usually asks
+** for the key that 'luaH_next' has just returned, so the position of
+** that key is remembered and checked before searching for 'key'.
 */
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
@@ -164,9 +345,23 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   i = arrayindex(key);
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
+#if defined(LUA_USE_SHAPES)
+  else if (isshaped(t)) {
+    int slot = ttisshrstring(key) ? shapeslot(t->shape, tsvalue(key)) : -1;
+    if (slot < 0)
+      luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+    /* slots are numbered after array elements */
+    return (slot + 1) + t->sizearray;
+  }
+#endif
   else {
     int nx;
-    Node *n = mainposition(t, key);
+    Node *n;
+    global_State *g = G(L);
+    if (g->nexttable == t && cast_int(g->nextnode) < sizenode(t) &&
+        luaV_rawequalobj(gkey(gnode(t, g->nextnode)), key))
+      return (g->nextnode + 1) + t->sizearray;  /* hint was right */
+    n = mainposition(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
       /* key may be dead already, but it is ok to use it in 'next' */
       if (luaV_rawequalobj(gkey(n), key) ||
@@ -194,10 +389,24 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    for (i -= t->sizearray; cast_int(i) < t->shape->nkeys; i++) {
+      if (!ttisnil(&t->slots[i])) {  /* a non-nil value? */
+        setsvalue2s(L, key, t->shape->keys[i]);
+        setobj2s(L, key+1, &t->slots[i]);
+        return 1;
+      }
+    }
+    return 0;  /* no more elements */
+  }
+#endif
   for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
       setobj2s(L, key, gkey(gnode(t, i)));
       setobj2s(L, key+1, gval(gnode(t, i)));
+      G(L)->nexttable = t;  /* remember where 'key' is */
+      G(L)->nextnode = i;
       return 1;
     }
   }
@@ -337,8 +546,22 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
   unsigned int i;
   int j;
   unsigned int oldasize = t->sizearray;
-  int oldhsize = t->lsizenode;
-  Node *nold = t->node;  /* save old hash ... */
+  int oldhsize;
+  Node *nold;
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    if (nasize >= oldasize && nhsize <= LUAI_MAXSHAPEKEYS) {  /* keep it? */
+      if (nasize > oldasize)
+        setarrayvector(L, t, nasize);
+      if (nhsize > t->sizeslots)
+        setslots(L, t, nhsize);  /* 'nhsize' is a hint for its fields */
+      return;
+    }
+    deshape(L, t);
+  }
+#endif
+  oldhsize = t->lsizenode;
+  nold = t->node;  /* save old hash ... */
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
@@ -372,6 +595,45 @@ void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
   luaH_resize(L, t, nasize, nsize);
 }
 
+
+/*
+** removes all entries from table 't'. With 'keep', its array and hash
+** parts keep their current sizes, ready to be filled again without
+** new allocations; otherwise, they are freed.
+*/
+void luaH_clear (lua_State *L, Table *t, int keep) {
+  unsigned int i;
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  if (!isdummy(t->node)) {
+    int j;
+    for (j = 0; j < sizenode(t); j++) {
+      Node *n = gnode(t, j);
+      gnext(n) = 0;
+      setnilvalue(wgkey(n));
+      setnilvalue(gval(n));
+    }
+    t->lastfree = gnode(t, sizenode(t));  /* all positions are free */
+  }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    Shape *s = t->shape;
+    for (i = 0; i < t->sizeslots; i++)
+      setnilvalue(&t->slots[i]);
+    t->shape = &G(L)->rootshape;  /* no keys */
+    releaseshape(L, s);
+    if (!keep) {  /* 'luaH_resize' would keep the slots */
+      luaM_freearray(L, t->slots, t->sizeslots);
+      t->slots = NULL;
+      t->sizeslots = 0;
+    }
+  }
+#endif
+  invalidateTMcache(t);
+  if (!keep)
+    luaH_resize(L, t, 0, 0);  /* free parts (all entries are empty) */
+}
+
 /*
 ** nums[i] = number of keys 'k' where 2^(i - 1) < k <= 2^i
 */
@@ -405,15 +667,26 @@ Table *luaH_new (lua_State *L) {
   GCObject *o = luaC_newobj(L, LUA_TTABLE, sizeof(Table));
   Table *t = gco2t(o);
   t->metatable = NULL;
-  t->flags = cast_byte(~0);
+  t->flags = cast_byte(~FROZENBIT);
   t->array = NULL;
   t->sizearray = 0;
+#if defined(LUA_USE_SHAPES)
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+#endif
   setnodevector(L, t, 0);
   return t;
 }
 
 
 void luaH_free (lua_State *L, Table *t) {
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    luaM_freearray(L, t->slots, t->sizeslots);
+    releaseshape(L, t->shape);
+  }
+#endif
   if (!isdummy(t->node))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
   luaM_freearray(L, t->array, t->sizearray);
@@ -452,6 +725,18 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
     else if (luai_numisnan(fltvalue(key)))
       luaG_runerror(L, "table index is NaN");
   }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    if (ttisshrstring(key)) {
+      TValue *slot = newshapedkey(L, t, tsvalue(key));
+      if (slot != NULL) {
+        luaC_barrierback(L, t, key);
+        return slot;
+      }
+    }
+    deshape(L, t);  /* key does not fit in a shape */
+  }
+#endif
   mp = mainposition(t, key);
   if (!ttisnil(gval(mp)) || isdummy(mp)) {  /* main position is taken? */
     Node *othern;
@@ -518,8 +803,15 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
 ** search function for short strings
 */
 const TValue *luaH_getshortstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+  Node *n;
   lua_assert(key->tt == LUA_TSHRSTR);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    int slot = shapeslot(t->shape, key);
+    return (slot < 0) ? luaO_nilobject : &t->slots[slot];
+  }
+#endif
+  n = hashstr(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     const TValue *k = gkey(n);
     if (ttisshrstring(k) && eqshrstr(tsvalue(k), key))
@@ -534,6 +826,48 @@ const TValue *luaH_getshortstr (Table *t, TString *key) {
 }
 
 
+/*
+** search function for a string given by its contents: 'str' with 'l'
+** bytes and hash 'h' (computed with the global seed, which is what both
+** short and long string keys use), so that there is no need to create
+** a string only to look it up
+*/
+const TValue *luaH_getlstr (Table *t, const char *str, size_t l,
+                            unsigned int h) {
+  Node *n;
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    const Shape *s = t->shape;
+    if (s->nkeys > 0) {  /* same probing as 'shapeslot' */
+      unsigned int mask = twoto(s->lsizeindex) - 1;
+      unsigned int i = h & mask;
+      int slot;
+      while ((slot = s->index[i]) != 0) {
+        const TString *k = s->keys[slot - 1];
+        if (k->shrlen == l && memcmp(getstr(k), str, l) == 0)
+          return &t->slots[slot - 1];
+        i = (i + 1) & mask;
+      }
+    }
+    return luaO_nilobject;
+  }
+#endif
+  n = hashpow2(t, h);
+  for (;;) {  /* check whether the string is somewhere in the chain */
+    const TValue *k = gkey(n);
+    if (ttisstring(k) && tsslen(tsvalue(k)) == l &&
+        memcmp(getstr(tsvalue(k)), str, l) == 0)
+      return gval(n);  /* that's it */
+    else {
+      int nx = gnext(n);
+      if (nx == 0)
+        return luaO_nilobject;  /* not found */
+      n += nx;
+    }
+  }
+}
+
+
 /*
 ** "Generic" get version. (Not that generic: not valid for integers,
 ** which may be in array part, nor for floats with integral values.)
@@ -658,6 +992,649 @@ int luaH_getn (Table *t) {
 
 
 
+
+/*
+** {=============================================================
+** Sorting of array parts
+** (pattern-defeating quicksort, after Orson Peters' 'pdqsort')
+** ==============================================================
+*/
+
+/* kinds of arrays whose order needs no metamethods */
+#define SORTINT		1	/* integers */
+#define SORTFLT		2	/* floats (no NaN) */
+#define SORTNUM		3	/* mixed integers and floats (no NaN) */
+#define SORTSTR		4	/* strings */
+
+/* intervals smaller than this are sorted by insertion */
+#define INSSORTLIMIT	24
+
+/* intervals larger than this get a pseudomedian of 9 as pivot */
+#define NINTHERLIMIT	128
+
+/* maximum number of moves of a partial insertion sort */
+#define PARTINSLIMIT	8
+
+
+typedef struct SortState {
+  lua_State *L;
+  TValue *a;  /* values that define the order */
+  TValue *b;  /* values moved along with them (or NULL) */
+  int kind;
+} SortState;
+
+
+/*
+** returns the kind of the 'n' values in 'a', or 0 if they cannot be
+** compared without metamethods (or include a NaN, which has no order)
+*/
+static int sortkind (const TValue *a, unsigned int n) {
+  int kind = 0;
+  unsigned int i;
+  for (i = 0; i < n; i++) {
+    const TValue *o = &a[i];
+    int k;
+    if (ttisinteger(o)) k = SORTINT;
+    else if (ttisfloat(o)) {
+      if (luai_numisnan(fltvalue(o))) return 0;
+      k = SORTFLT;
+    }
+    else if (ttisstring(o)) k = SORTSTR;
+    else return 0;
+    if (k != kind) {
+      if (kind == 0) kind = k;
+      else if (k != SORTSTR && kind != SORTSTR) kind = SORTNUM;
+      else return 0;  /* strings mixed with numbers */
+    }
+  }
+  return kind;
+}
+
+
+static int valuelt (SortState *S, const TValue *x, const TValue *y) {
+  switch (S->kind) {
+    case SORTINT: return ivalue(x) < ivalue(y);
+    case SORTFLT: return luai_numlt(fltvalue(x), fltvalue(y));
+    case SORTNUM: return luaV_lessthan(S->L, x, y);  /* no metamethods */
+    default: return tsvalue(x) != tsvalue(y) &&
+                    luaV_strcmp(tsvalue(x), tsvalue(y)) < 0;
+  }
+}
+
+
+#define sortlt(S,i,j)	valuelt(S, &(S)->a[i], &(S)->a[j])
+
+
+static void sortswap (SortState *S, unsigned int i, unsigned int j) {
+  TValue temp;
+  setobj(S->L, &temp, &S->a[i]);
+  setobj(S->L, &S->a[i], &S->a[j]);
+  setobj(S->L, &S->a[j], &temp);
+  if (S->b != NULL) {
+    setobj(S->L, &temp, &S->b[i]);
+    setobj(S->L, &S->b[i], &S->b[j]);
+    setobj(S->L, &S->b[j], &temp);
+  }
+}
+
+
+/*
+** moves a[i] down to position 'j' (j < i), shifting a[j .. i - 1] up
+*/
+static void sortrotate (SortState *S, unsigned int i, unsigned int j) {
+  TValue temp;
+  unsigned int k;
+  setobj(S->L, &temp, &S->a[i]);
+  for (k = i; k > j; k--)
+    setobj(S->L, &S->a[k], &S->a[k - 1]);
+  setobj(S->L, &S->a[j], &temp);
+  if (S->b != NULL) {
+    setobj(S->L, &temp, &S->b[i]);
+    for (k = i; k > j; k--)
+      setobj(S->L, &S->b[k], &S->b[k - 1]);
+    setobj(S->L, &S->b[j], &temp);
+  }
+}
+
+
+/*
+** insertion sort of [lo, hi). With 'limit' > 0, gives up (returning 0)
+** after moving more than 'limit' elements.
+*/
+static int insertionsort (SortState *S, unsigned int lo, unsigned int hi,
+                          unsigned int limit) {
+  unsigned int moves = 0;
+  unsigned int i;
+  for (i = lo + 1; i < hi; i++) {
+    unsigned int j = i;
+    if (limit > 0 && moves > limit)
+      return 0;
+    while (j > lo && sortlt(S, i, j - 1))  /* find place for a[i] */
+      j--;
+    if (j < i) {
+      sortrotate(S, i, j);
+      moves += i - j;
+    }
+  }
+  return 1;
+}
+
+
+/* sorts a[i], a[j], and a[k] */
+static void sort3 (SortState *S, unsigned int i, unsigned int j,
+                                 unsigned int k) {
+  if (sortlt(S, j, i)) sortswap(S, i, j);
+  if (sortlt(S, k, j)) {
+    sortswap(S, j, k);
+    if (sortlt(S, j, i)) sortswap(S, i, j);
+  }
+}
+
+
+/*
+** partitions [lo, hi) around pivot a[lo], with elements equal to the
+** pivot going right; returns the pivot's final position and whether the
+** interval was already partitioned. Needs a[hi - 1] >= pivot.
+*/
+static unsigned int partright (SortState *S, unsigned int lo, unsigned int hi,
+                               int *already) {
+  unsigned int first = lo;
+  unsigned int last = hi;
+  while (sortlt(S, ++first, lo)) ;  /* a[hi - 1] stops it */
+  if (first - 1 == lo) {
+    while (first < last && !sortlt(S, --last, lo)) ;
+  }
+  else
+    while (!sortlt(S, --last, lo)) ;  /* a[first - 1] stops it */
+  *already = (first >= last);
+  while (first < last) {
+    sortswap(S, first, last);
+    while (sortlt(S, ++first, lo)) ;
+    while (!sortlt(S, --last, lo)) ;
+  }
+  sortswap(S, lo, first - 1);  /* put pivot in its place */
+  return first - 1;
+}
+
+
+/*
+** partitions [lo, hi) around pivot a[lo], with elements equal to the
+** pivot going left; returns the pivot's final position. Used when the
+** element before 'lo' equals the pivot, so that there is no need to
+** sort the left part.
+*/
+static unsigned int partleft (SortState *S, unsigned int lo, unsigned int hi) {
+  unsigned int first = lo;
+  unsigned int last = hi;
+  while (sortlt(S, lo, --last)) ;  /* the pivot itself stops it */
+  if (last + 1 == hi) {
+    while (first < last && !sortlt(S, lo, ++first)) ;
+  }
+  else
+    while (!sortlt(S, lo, ++first)) ;  /* a[last + 1] stops it */
+  while (first < last) {
+    sortswap(S, first, last);
+    while (sortlt(S, lo, --last)) ;
+    while (!sortlt(S, lo, ++first)) ;
+  }
+  sortswap(S, lo, last);
+  return last;
+}
+
+
+static void siftdown (SortState *S, unsigned int lo, unsigned int i,
+                                    unsigned int n) {
+  for (;;) {
+    unsigned int c = 2 * i + 1;  /* first child */
+    if (c >= n) break;
+    if (c + 1 < n && sortlt(S, lo + c, lo + c + 1)) c++;
+    if (!sortlt(S, lo + i, lo + c)) break;
+    sortswap(S, lo + i, lo + c);
+    i = c;
+  }
+}
+
+
+static void heapsort (SortState *S, unsigned int lo, unsigned int hi) {
+  unsigned int n = hi - lo;
+  unsigned int i;
+  for (i = n / 2; i-- > 0; )
+    siftdown(S, lo, i, n);
+  while (n > 1) {
+    sortswap(S, lo, lo + --n);
+    siftdown(S, lo, 0, n);
+  }
+}
+
+
+/*
+** swaps some elements of [lo, hi) (a side of a badly unbalanced
+** partition) with others from its middle, to break patterns
+*/
+static void breakpatterns (SortState *S, unsigned int lo, unsigned int hi) {
+  unsigned int n = hi - lo;
+  if (n >= INSSORTLIMIT) {
+    unsigned int q = n / 4;
+    sortswap(S, lo, lo + q);
+    sortswap(S, hi - 1, hi - q);
+    if (n > NINTHERLIMIT) {
+      sortswap(S, lo + 1, lo + q + 1);
+      sortswap(S, lo + 2, lo + q + 2);
+      sortswap(S, hi - 2, hi - q - 1);
+      sortswap(S, hi - 3, hi - q - 2);
+    }
+  }
+}
+
+
+/*
+** sorts [lo, hi); 'badallowed' is how many badly unbalanced partitions
+** are tolerated before switching to heapsort; 'leftmost' tells whether
+** there is no smaller element before 'lo'
+*/
+static void pdqsort (SortState *S, unsigned int lo, unsigned int hi,
+                     int badallowed, int leftmost) {
+  while (hi - lo >= INSSORTLIMIT) {
+    unsigned int n = hi - lo;
+    unsigned int m = lo + n / 2;
+    unsigned int p;
+    int already;
+    if (n > NINTHERLIMIT) {  /* pseudomedian of 9 */
+      sort3(S, lo, m, hi - 1);
+      sort3(S, lo + 1, m - 1, hi - 2);
+      sort3(S, lo + 2, m + 1, hi - 3);
+      sort3(S, m - 1, m, m + 1);
+      sortswap(S, lo, m);
+    }
+    else
+      sort3(S, m, lo, hi - 1);  /* median of 3 goes to 'lo' */
+    if (!leftmost && !sortlt(S, lo - 1, lo)) {
+      /* pivot equals the element before: no smaller ones are left */
+      lo = partleft(S, lo, hi) + 1;
+      continue;
+    }
+    p = partright(S, lo, hi, &already);
+    if (p - lo < n / 8 || hi - p - 1 < n / 8) {  /* badly unbalanced? */
+      if (--badallowed == 0) {
+        heapsort(S, lo, hi);
+        return;
+      }
+      breakpatterns(S, lo, p);
+      breakpatterns(S, p + 1, hi);
+    }
+    else if (already && insertionsort(S, lo, p, PARTINSLIMIT) &&
+                        insertionsort(S, p + 1, hi, PARTINSLIMIT))
+      return;  /* interval was (almost) sorted */
+    if (p - lo < hi - p) {  /* recurse into the smaller side */
+      pdqsort(S, lo, p, badallowed, leftmost);
+      lo = p + 1;
+      leftmost = 0;
+    }
+    else {
+      pdqsort(S, p + 1, hi, badallowed, 0);
+      hi = p;
+    }
+  }
+  insertionsort(S, lo, hi, 0);
+}
+
+
+static void reversearray (lua_State *L, TValue *a, unsigned int n) {
+  unsigned int i = 0;
+  while (n > i + 1) {
+    TValue temp;
+    n--;
+    setobj(L, &temp, &a[i]);
+    setobj2t(L, &a[i], &a[n]);
+    setobj2t(L, &a[n], &temp);
+    i++;
+  }
+}
+
+
+/* number of bad partitions tolerated when sorting 'n' elements */
+static int badlimit (unsigned int n) {
+  int bad = 1;
+  while ((n >> bad) > 0) bad++;
+  return bad;
+}
+
+
+/*
+** {------------------------------------------------------
+** Stable sort (natural merge sort, after Tim Peters' 'timsort')
+** -------------------------------------------------------
+*/
+
+/* maximum number of pending runs (enough for 2^64 elements) */
+#define MAXRUNS		96
+
+
+/* copies 'n' elements from position 'i' to the buffers 'ta'/'tb' */
+static void tobuffer (SortState *S, TValue *ta, TValue *tb, unsigned int i,
+                                    unsigned int n) {
+  memcpy(ta, S->a + i, n * sizeof(TValue));
+  if (S->b != NULL)
+    memcpy(tb, S->b + i, n * sizeof(TValue));
+}
+
+
+/* copies 'n' elements from position 'j' of the buffers to position 'i' */
+static void frombuffer (SortState *S, const TValue *ta, const TValue *tb,
+                        unsigned int j, unsigned int i, unsigned int n) {
+  memcpy(S->a + i, ta + j, n * sizeof(TValue));
+  if (S->b != NULL)
+    memcpy(S->b + i, tb + j, n * sizeof(TValue));
+}
+
+
+/* minimum length of a run: 'n' scaled down to [32, 64] */
+static unsigned int minrun (unsigned int n) {
+  unsigned int r = 0;
+  while (n >= 64) {
+    r |= n & 1;
+    n >>= 1;
+  }
+  return n + r;
+}
+
+
+/*
+** returns the end of the run that starts at 'lo', which is made
+** ascending if it was strictly descending
+*/
+static unsigned int countrun (SortState *S, unsigned int lo,
+                                            unsigned int hi) {
+  unsigned int i = lo + 1;
+  if (i == hi)
+    return hi;
+  if (sortlt(S, i, lo)) {  /* strictly descending? */
+    while (++i < hi && sortlt(S, i, i - 1)) ;
+    reversearray(S->L, S->a + lo, i - lo);
+    if (S->b != NULL) reversearray(S->L, S->b + lo, i - lo);
+  }
+  else
+    while (++i < hi && !sortlt(S, i, i - 1)) ;
+  return i;
+}
+
+
+/* stable insertion of a[start .. hi - 1] into sorted [lo, start) */
+static void binaryinsertion (SortState *S, unsigned int lo,
+                             unsigned int start, unsigned int hi) {
+  for (; start < hi; start++) {
+    unsigned int l = lo, r = start;
+    while (l < r) {  /* find first element greater than a[start] */
+      unsigned int m = l + (r - l) / 2;
+      if (sortlt(S, start, m)) r = m;
+      else l = m + 1;
+    }
+    if (l < start)
+      sortrotate(S, start, l);
+  }
+}
+
+
+/*
+** merges sorted [lo, mid) and [mid, hi). Elements already in place at
+** both ends are skipped first (found by binary search), so only the
+** rest goes through the buffer, and then only its smaller side.
+*/
+static void mergeruns (SortState *S, TValue *ta, TValue *tb, unsigned int lo,
+                       unsigned int mid, unsigned int hi) {
+  TValue *a = S->a;
+  TValue *b = S->b;
+  unsigned int l = lo, r = mid;
+  while (l < r) {  /* find first element of left run greater than a[mid] */
+    unsigned int m = l + (r - l) / 2;
+    if (sortlt(S, mid, m)) r = m;
+    else l = m + 1;
+  }
+  lo = l;
+  if (lo == mid) return;  /* already in order */
+  l = mid; r = hi;
+  while (l < r) {  /* find first element of right run not less than last */
+    unsigned int m = l + (r - l) / 2;
+    if (sortlt(S, m, mid - 1)) l = m + 1;
+    else r = m;
+  }
+  hi = l;
+  if (mid - lo <= hi - mid) {  /* left side is smaller: merge forward */
+    unsigned int n = mid - lo, i = 0, j = mid, k = lo;
+    tobuffer(S, ta, tb, lo, n);
+    while (i < n && j < hi) {
+      if (valuelt(S, &a[j], &ta[i])) {
+        setobj(S->L, &a[k], &a[j]);
+        if (b != NULL) setobj(S->L, &b[k], &b[j]);
+        j++;
+      }
+      else {
+        setobj(S->L, &a[k], &ta[i]);
+        if (b != NULL) setobj(S->L, &b[k], &tb[i]);
+        i++;
+      }
+      k++;
+    }
+    frombuffer(S, ta, tb, i, k, n - i);
+  }
+  else {  /* right side is smaller: merge backward */
+    unsigned int n = hi - mid, i = mid, j = n, k = hi;
+    tobuffer(S, ta, tb, mid, n);
+    while (j > 0 && i > lo) {
+      if (valuelt(S, &ta[j - 1], &a[i - 1])) {
+        i--; k--;
+        setobj(S->L, &a[k], &a[i]);
+        if (b != NULL) setobj(S->L, &b[k], &b[i]);
+      }
+      else {
+        j--; k--;
+        setobj(S->L, &a[k], &ta[j]);
+        if (b != NULL) setobj(S->L, &b[k], &tb[j]);
+      }
+    }
+    frombuffer(S, ta, tb, 0, lo, j);
+  }
+}
+
+
+/*
+** stable sort of [0, n), with buffers 'ta' and 'tb' for n/2 elements.
+** Pending runs are merged so that their lengths shrink at least as
+** fast as the Fibonacci numbers, keeping merges balanced.
+*/
+static void timsort (SortState *S, TValue *ta, TValue *tb, unsigned int n) {
+  unsigned int base[MAXRUNS], len[MAXRUNS];
+  int nruns = 0;
+  unsigned int lo = 0;
+  unsigned int mr = minrun(n);
+  while (lo < n) {
+    unsigned int hi = countrun(S, lo, n);
+    if (hi - lo < mr) {  /* short run? extend it */
+      unsigned int end = (n - lo < mr) ? n : lo + mr;
+      binaryinsertion(S, lo, hi, end);
+      hi = end;
+    }
+    base[nruns] = lo; len[nruns] = hi - lo; nruns++;
+    lo = hi;
+    while (nruns > 1) {  /* restore invariants on the pending runs */
+      int i = nruns - 2;
+      if ((i > 0 && len[i - 1] <= len[i] + len[i + 1]) ||
+          (i > 1 && len[i - 2] <= len[i - 1] + len[i])) {
+        if (len[i - 1] < len[i + 1]) i--;
+      }
+      else if (len[i] > len[i + 1])
+        break;  /* invariants hold */
+      mergeruns(S, ta, tb, base[i], base[i + 1], base[i + 1] + len[i + 1]);
+      len[i] += len[i + 1];
+      if (i == nruns - 3) {  /* merged the two runs below the top? */
+        base[i + 1] = base[i + 2]; len[i + 1] = len[i + 2];
+      }
+      nruns--;
+    }
+  }
+  while (nruns > 1) {  /* merge what is left, from the top */
+    int i = nruns - 2;
+    if (i > 0 && len[i - 1] < len[i + 1]) i--;
+    mergeruns(S, ta, tb, base[i], base[i + 1], base[i + 1] + len[i + 1]);
+    len[i] += len[i + 1];
+    if (i == nruns - 3) {
+      base[i + 1] = base[i + 2]; len[i + 1] = len[i + 2];
+    }
+    nruns--;
+  }
+}
+
+/* }------------------------------------------------------ */
+
+
+/*
+** introselect: moves the element that belongs at position 'k' of
+** [lo, hi) in sorted order to there, with no greater element before
+** it and no smaller one after it. Too many bad partitions switch to
+** sorting the rest of the interval.
+*/
+static void selectk (SortState *S, unsigned int lo, unsigned int hi,
+                     unsigned int k, int badallowed) {
+  while (hi - lo >= INSSORTLIMIT) {
+    unsigned int n = hi - lo;
+    unsigned int m = lo + n / 2;
+    unsigned int p;
+    int already;
+    if (n > NINTHERLIMIT) {  /* pseudomedian of 9 */
+      sort3(S, lo, m, hi - 1);
+      sort3(S, lo + 1, m - 1, hi - 2);
+      sort3(S, lo + 2, m + 1, hi - 3);
+      sort3(S, m - 1, m, m + 1);
+      sortswap(S, lo, m);
+    }
+    else
+      sort3(S, m, lo, hi - 1);  /* median of 3 goes to 'lo' */
+    if (lo > 0 && !sortlt(S, lo - 1, lo)) {  /* pivot equals a[lo - 1]? */
+      p = partleft(S, lo, hi);  /* [lo, p] are all equal to the pivot */
+      if (k <= p) return;
+      lo = p + 1;
+      continue;
+    }
+    p = partright(S, lo, hi, &already);
+    if (p == k) return;
+    if (p - lo < n / 8 || hi - p - 1 < n / 8) {  /* badly unbalanced? */
+      if (--badallowed == 0) {
+        pdqsort(S, lo, hi, badlimit(hi - lo), (lo == 0));
+        return;
+      }
+      breakpatterns(S, lo, p);
+      breakpatterns(S, p + 1, hi);
+    }
+    if (k < p) hi = p;
+    else lo = p + 1;
+  }
+  insertionsort(S, lo, hi, 0);
+}
+
+
+/*
+** prepares 'S' to sort the first 'n' elements of the array part of 't'
+** by their own values or, if 'k' is not NULL, by the first 'n' elements
+** of the array part of 'k'. Returns 0 if these values cannot all be
+** compared without metamethods or, when sorting by 'k', if an element
+** of 't' is nil (the generic sort would go through its metamethods).
+*/
+static int initsort (lua_State *L, SortState *S, Table *t, Table *k,
+                                   unsigned int n) {
+  if (n > t->sizearray || (k != NULL && n > k->sizearray))
+    return 0;
+  if (k != NULL) {
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+      if (ttisnil(&t->array[i]))
+        return 0;
+    }
+  }
+  S->L = L;
+  S->a = (k != NULL) ? k->array : t->array;
+  S->b = (k != NULL) ? t->array : NULL;
+  S->kind = sortkind(S->a, n);
+  if (S->kind == SORTSTR) {  /* 'luaV_strcmp' needs the '\0's */
+    unsigned int i;
+    for (i = 0; i < n; i++)  /* (the sort itself cannot allocate) */
+      luaS_terminate(L, tsvalue(&S->a[i]));
+  }
+  return (S->kind != 0);
+}
+
+
+static void reversesort (SortState *S, unsigned int n) {
+  reversearray(S->L, S->a, n);
+  if (S->b != NULL) reversearray(S->L, S->b, n);
+}
+
+
+/*
+** Sorts the first 'n' elements of the array part of 't' (see 'initsort'
+** for 'k') as 'how' asks: LUA_SORTDESC for descending order and
+** LUA_SORTSTABLE to keep equal elements in their relative order.
+** Returns 0, touching nothing, if the values that define the order
+** cannot all be compared without metamethods.
+*/
+int luaH_sortarray (lua_State *L, Table *t, Table *k, unsigned int n,
+                                  int how) {
+  SortState S;
+  if (!initsort(L, &S, t, k, n))
+    return 0;
+  if (how & LUA_SORTSTABLE) {
+    /* descending: reverse, sort, and reverse again keeps equal ones */
+    size_t nb = n / 2 + 1;  /* buffer size */
+    Udata *u;  /* buffers live in a userdata, so an error cannot leak them */
+    TValue *ta, *tb;
+    luaD_checkstack(L, 1);
+    u = luaS_newudata(L, ((S.b != NULL) ? 2 : 1) * nb * sizeof(TValue));
+    setuvalue(L, L->top, u);  /* anchor it */
+    L->top++;
+    ta = cast(TValue *, getudatamem(u));
+    tb = (S.b != NULL) ? ta + nb : NULL;
+    if (how & LUA_SORTDESC) reversesort(&S, n);
+    timsort(&S, ta, tb, n);
+    L->top--;  /* let the collector free the buffers */
+  }
+  else
+    pdqsort(&S, 0, n, badlimit(n), 1);
+  if (how & LUA_SORTDESC)
+    reversesort(&S, n);
+  return 1;
+}
+
+
+/*
+** Puts at position 'k' (0-based) of the first 'n' elements of the
+** array part of 't' the element that belongs there in sorted order,
+** with no greater element before it and no smaller one after it.
+** With LUA_SORTPARTIAL in 'how', also sorts the first 'k' elements.
+** Returns 0 as 'luaH_sortarray' does.
+*/
+int luaH_selectarray (lua_State *L, Table *t, unsigned int n,
+                                    unsigned int k, int how) {
+  SortState S;
+  if (!initsort(L, &S, t, NULL, n) || k >= n)
+    return 0;
+  if (how & LUA_SORTDESC) {  /* select from the other end and reverse */
+    unsigned int ka = n - 1 - k;
+    selectk(&S, 0, n, ka, badlimit(n));
+    if (how & LUA_SORTPARTIAL)
+      pdqsort(&S, ka, n, badlimit(n - ka), (ka == 0));
+    reversesort(&S, n);
+  }
+  else {
+    selectk(&S, 0, n, k, badlimit(n));
+    if (how & LUA_SORTPARTIAL)
+      pdqsort(&S, 0, k, badlimit(k), 1);
+  }
+  return 1;
+}
+
+/* }============================================================= */
+
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
@@ -24,7 +24,25 @@
 */
 #define wgkey(n)		(&(n)->i_key.nk)
 
-#define invalidateTMcache(t)	((t)->flags = 0)
+/*
+** bit in 'flags' marking a table that cannot be modified; the other
+** bits cache the absence of metamethods (see 'fasttm')
+*/
+#define FROZENBIT	(1 << 7)
+
+#define isfrozen(t)	((t)->flags & FROZENBIT)
+
+#define invalidateTMcache(t)	((t)->flags &= FROZENBIT)
+
+/* raise an error if table 't' is frozen */
+#define checkwritable(L,t)  \
+	{ if (isfrozen(t)) luaG_runerror(L, "attempt to modify a frozen table"); }
+
+
+#if defined(LUA_USE_SHAPES)
+/* true if table keeps its string keys in a shape */
+#define isshaped(t)	((t)->shape != NULL)
+#endif
 
 
 /* returns the key, given the value of a table entry */
@@ -37,6 +55,8 @@ LUAI_FUNC void luaH_setint (lua_State *L, Table *t, lua_Integer key,
                                                     TValue *value);
 LUAI_FUNC const TValue *luaH_getshortstr (Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
+LUAI_FUNC const TValue *luaH_getlstr (Table *t, const char *str, size_t l,
+                                                unsigned int h);
 LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
@@ -44,9 +64,17 @@ LUAI_FUNC Table *luaH_new (lua_State *L);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
+LUAI_FUNC void luaH_clear (lua_State *L, Table *t, int keep);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC int luaH_sortarray (lua_State *L, Table *t, Table *k,
+                                            unsigned int n, int how);
+LUAI_FUNC int luaH_selectarray (lua_State *L, Table *t, unsigned int n,
+                                              unsigned int k, int how);
+#if defined(LUA_USE_SHAPES)
+LUAI_FUNC void luaH_setshape (lua_State *L, Table *t);
+#endif
 
 
 #if defined(LUA_DEBUG)
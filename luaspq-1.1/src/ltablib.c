@@ -88,6 +88,8 @@ static int tinsert (lua_State *L) {
       lua_Integer i;
       pos = luaL_checkinteger(L, 2);  /* 2nd argument is the position */
       luaL_argcheck(L, 1 <= pos && pos <= e, 2, "position out of bounds");
+      if (pos < e && lua_movearray(L, 1, pos, e - 1, pos + 1, 1))
+        break;  /* moved up all at once */
       for (i = e; i > pos; i--) {  /* move up elements */
         lua_geti(L, 1, i - 1);
         lua_seti(L, 1, i);  /* t[i] = t[i - 1] */
@@ -109,6 +111,8 @@ static int tremove (lua_State *L) {
   if (pos != size)  /* validate 'pos' if given */
     luaL_argcheck(L, 1 <= pos && pos <= size + 1, 1, "position out of bounds");
   lua_geti(L, 1, pos);  /* result = t[pos] */
+  if (pos < size && lua_movearray(L, 1, pos + 1, size, pos, 1))
+    pos = size;  /* moved down all at once */
   for ( ; pos < size; pos++) {
     lua_geti(L, 1, pos + 1);
     lua_seti(L, 1, pos);  /* t[pos] = t[pos + 1] */
@@ -139,6 +143,10 @@ static int tmove (lua_State *L) {
     n = e - f + 1;  /* number of elements to move */
     luaL_argcheck(L, t <= LUA_MAXINTEGER - n + 1, 4,
                   "destination wrap around");
+    /* (a table given again as destination keeps the forward copy) */
+    if ((tt == 1 || !lua_rawequal(L, 1, tt)) &&
+        lua_movearray(L, 1, f, e, t, tt))
+      n = 0;  /* moved all at once */
     if (t > e || t <= f || tt != 1) {
       for (i = 0; i < n; i++) {
         lua_geti(L, 1, f + i);
@@ -157,6 +165,75 @@ static int tmove (lua_State *L) {
 }
 
 
+/*
+** Remove all entries from a table. With a true second argument, the
+** table keeps its storage, so that refilling it does not allocate.
+*/
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1, lua_toboolean(L, 2));
+  return 0;
+}
+
+
+/*
+** {======================================================
+** Freeze
+** =======================================================
+*/
+
+/*
+** If the value at 'idx' is a table not yet frozen, freeze it and add
+** it to the list of tables still to be traversed (at index 2).
+*/
+static lua_Integer freezeitem (lua_State *L, int idx, lua_Integer n) {
+  if (lua_type(L, idx) == LUA_TTABLE && !lua_isfrozen(L, idx)) {
+    lua_freeze(L, idx);
+    lua_pushvalue(L, idx);
+    lua_rawseti(L, 2, ++n);
+  }
+  return n;
+}
+
+
+/*
+** Make a table, and all tables reachable from its keys and values,
+** read-only. (Metatables are not frozen, and tables already frozen
+** are not traversed again.) The traversal uses an explicit list, so
+** deep structures do not consume C stack.
+*/
+static int tfreeze (lua_State *L) {
+  lua_Integer n = 0;  /* number of tables still to be traversed */
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_newtable(L);  /* list of tables to be traversed */
+  n = freezeitem(L, 1, n);
+  while (n > 0) {
+    lua_rawgeti(L, 2, n);  /* 3: table to traverse */
+    lua_pushnil(L);
+    lua_rawseti(L, 2, n--);
+    lua_pushnil(L);  /* first key */
+    while (lua_next(L, 3)) {
+      n = freezeitem(L, 4, n);  /* key */
+      n = freezeitem(L, 5, n);  /* value */
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return the table */
+}
+
+
+static int tisfrozen (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushboolean(L, lua_isfrozen(L, 1));
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static void addfield (lua_State *L, luaL_Buffer *b, lua_Integer i) {
   lua_geti(L, 1, i);
   if (!lua_isstring(L, -1))
@@ -173,6 +250,8 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_opt(L, luaL_checkinteger, 4, last);
+  if (lua_concatarray(L, 1, sep, lsep, i, last))
+    return 1;  /* plain array part: result built in a single string */
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
@@ -212,6 +291,8 @@ static int unpack (lua_State *L) {
   n = (lua_Unsigned)e - i;  /* number of elements minus 1 (avoid overflows) */
   if (n >= (unsigned int)INT_MAX  || !lua_checkstack(L, (int)(++n)))
     return luaL_error(L, "too many results to unpack");
+  if (lua_pusharray(L, 1, i, e))
+    return (int)n;  /* pushed all at once */
   for (; i < e; i++) {  /* push arg[i..e - 1] (to avoid overflows) */
     lua_geti(L, 1, i);
   }
@@ -349,46 +430,60 @@ static unsigned int choosePivot (unsigned int lo, unsigned int up,
 }
 
 
+/*
+** Sorts elements 'lo', 'up' and a pivot between them and, if there are
+** more than three elements in [lo,up], partitions the interval around
+** the pivot. Returns the pivot's final index, or 0 if the interval is
+** already sorted.
+*/
+static unsigned int sortpartition (lua_State *L, unsigned int lo,
+                                   unsigned int up, unsigned int rnd) {
+  unsigned int p;  /* Pivot index */
+  /* sort elements 'lo', 'p', and 'up' */
+  lua_geti(L, 1, lo);
+  lua_geti(L, 1, up);
+  if (sort_comp(L, -1, -2))  /* a[up] < a[lo]? */
+    set2(L, lo, up);  /* swap a[lo] - a[up] */
+  else
+    lua_pop(L, 2);  /* remove both values */
+  if (up - lo == 1)  /* only 2 elements? */
+    return 0;  /* already sorted */
+  if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
+    p = (lo + up)/2;  /* middle element is a good pivot */
+  else  /* for larger intervals, it is worth a random pivot */
+    p = choosePivot(lo, up, rnd);
+  lua_geti(L, 1, p);
+  lua_geti(L, 1, lo);
+  if (sort_comp(L, -2, -1))  /* a[p] < a[lo]? */
+    set2(L, p, lo);  /* swap a[p] - a[lo] */
+  else {
+    lua_pop(L, 1);  /* remove a[lo] */
+    lua_geti(L, 1, up);
+    if (sort_comp(L, -1, -2))  /* a[up] < a[p]? */
+      set2(L, p, up);  /* swap a[up] - a[p] */
+    else
+      lua_pop(L, 2);
+  }
+  if (up - lo == 2)  /* only 3 elements? */
+    return 0;  /* already sorted */
+  lua_geti(L, 1, p);  /* get middle element (Pivot) */
+  lua_pushvalue(L, -1);  /* push Pivot */
+  lua_geti(L, 1, up - 1);  /* push a[up - 1] */
+  set2(L, p, up - 1);  /* swap Pivot (a[p]) with a[up - 1] */
+  return partition(L, lo, up);
+}
+
+
 /*
 ** QuickSort algorithm (recursive function)
 */
 static void auxsort (lua_State *L, unsigned int lo, unsigned int up,
                                    unsigned int rnd) {
   while (lo < up) {  /* loop for tail recursion */
-    unsigned int p;  /* Pivot index */
+    unsigned int p = sortpartition(L, lo, up, rnd);  /* Pivot index */
     unsigned int n;  /* to be used later */
-    /* sort elements 'lo', 'p', and 'up' */
-    lua_geti(L, 1, lo);
-    lua_geti(L, 1, up);
-    if (sort_comp(L, -1, -2))  /* a[up] < a[lo]? */
-      set2(L, lo, up);  /* swap a[lo] - a[up] */
-    else
-      lua_pop(L, 2);  /* remove both values */
-    if (up - lo == 1)  /* only 2 elements? */
-      return;  /* already sorted */
-    if (up - lo < RANLIMIT || rnd == 0)  /* small interval or no randomize? */
-      p = (lo + up)/2;  /* middle element is a good pivot */
-    else  /* for larger intervals, it is worth a random pivot */
-      p = choosePivot(lo, up, rnd);
-    lua_geti(L, 1, p);
-    lua_geti(L, 1, lo);
-    if (sort_comp(L, -2, -1))  /* a[p] < a[lo]? */
-      set2(L, p, lo);  /* swap a[p] - a[lo] */
-    else {
-      lua_pop(L, 1);  /* remove a[lo] */
-      lua_geti(L, 1, up);
-      if (sort_comp(L, -1, -2))  /* a[up] < a[p]? */
-        set2(L, p, up);  /* swap a[up] - a[p] */
-      else
-        lua_pop(L, 2);
-    }
-    if (up - lo == 2)  /* only 3 elements? */
+    if (p == 0)  /* at most 3 elements? */
       return;  /* already sorted */
-    lua_geti(L, 1, p);  /* get middle element (Pivot) */
-    lua_pushvalue(L, -1);  /* push Pivot */
-    lua_geti(L, 1, up - 1);  /* push a[up - 1] */
-    set2(L, p, up - 1);  /* swap Pivot (a[p]) with a[up - 1] */
-    p = partition(L, lo, up);
     /* a[lo .. p - 1] <= a[p] == P <= a[p + 1 .. up] */
     if (p - lo < up - p) {  /* lower interval is smaller? */
       auxsort(L, lo, p - 1, rnd);  /* call recursively for lower interval */
@@ -406,24 +501,383 @@ static void auxsort (lua_State *L, unsigned int lo, unsigned int up,
 }
 
 
+/*
+** Order function for the generic sort when the order is descending or
+** given by keys. Upvalue 1 is the table of keys (or nil, when comparing
+** the values themselves), upvalue 2 the user's order function (or nil),
+** and upvalue 3 whether the order is descending.
+*/
+static int sortaux (lua_State *L) {
+  int a = 1, b = 2;
+  if (lua_toboolean(L, lua_upvalueindex(3))) {  /* descending? */
+    a = 2; b = 1;
+  }
+  if (!lua_isnil(L, lua_upvalueindex(1))) {  /* comparing indices? */
+    lua_rawgeti(L, lua_upvalueindex(1), lua_tointeger(L, a));
+    lua_rawgeti(L, lua_upvalueindex(1), lua_tointeger(L, b));
+    a = 3; b = 4;  /* compare their keys */
+  }
+  if (lua_isnil(L, lua_upvalueindex(2)))  /* no function? */
+    lua_pushboolean(L, lua_compare(L, a, b, LUA_OPLT));
+  else {
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_pushvalue(L, a);
+    lua_pushvalue(L, b);
+    lua_call(L, 2, 1);
+  }
+  return 1;
+}
+
+
+/*
+** Sort t[1 .. n] by the keys that function at index 3 gives for its
+** elements, each computed once. When the keys cannot go through the
+** fast path, sorts the indices 1 .. n by their keys and then moves the
+** elements to their new places.
+*/
+static void sortbykey (lua_State *L, lua_Integer n, int how) {
+  lua_Integer i;
+  lua_createtable(L, (int)n, 0);  /* 4: keys */
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, 3);
+    lua_geti(L, 1, i);
+    lua_call(L, 1, 1);
+    lua_rawseti(L, 4, i);
+  }
+  if (lua_isnil(L, 2) && lua_sortarray(L, 1, n, 4, how))
+    return;  /* done */
+  lua_createtable(L, (int)n, 0);  /* 5: indices */
+  for (i = 1; i <= n; i++) {
+    lua_pushinteger(L, i);
+    lua_rawseti(L, 5, i);
+  }
+  lua_pushvalue(L, 4);
+  lua_pushvalue(L, 2);
+  lua_pushboolean(L, how & LUA_SORTDESC);
+  lua_pushcclosure(L, sortaux, 3);  /* 6: order function */
+  lua_createtable(L, (int)n, 0);  /* 7: elements in their new order */
+  lua_pushvalue(L, 1);  /* 8: table being sorted */
+  lua_copy(L, 5, 1);  /* 'auxsort' sorts the indices... */
+  lua_copy(L, 6, 2);  /* ...with the new order function */
+  auxsort(L, 1, (unsigned int)n, 0u);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 5, i);
+    lua_geti(L, 8, lua_tointeger(L, -1));
+    lua_rawseti(L, 7, i);
+    lua_pop(L, 1);
+  }
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 7, i);
+    lua_seti(L, 8, i);
+  }
+}
+
+
+/*
+** Check the order argument at 'arg': an order function or one of the
+** names "asc" and "desc". Leaves at index 2 the order function (or nil)
+** and returns LUA_SORTDESC for a descending order.
+*/
+static int getorder (lua_State *L, int arg) {
+  static const char *const orders[] = {"asc", "desc", NULL};
+  int how = 0;
+  if (lua_type(L, arg) == LUA_TSTRING) {  /* order name? */
+    if (luaL_checkoption(L, arg, NULL, orders) == 1)
+      how = LUA_SORTDESC;
+    lua_pushnil(L);  /* no order function */
+  }
+  else {
+    if (!lua_isnoneornil(L, arg))  /* is there an order argument? */
+      luaL_checktype(L, arg, LUA_TFUNCTION);  /* must be a function */
+    lua_pushvalue(L, arg);
+  }
+  lua_replace(L, 2);
+  return how;
+}
+
+
+/* the generic sorts need an order function for a descending order */
+static void descorder (lua_State *L) {
+  lua_pushnil(L);
+  lua_pushnil(L);
+  lua_pushboolean(L, 1);
+  lua_pushcclosure(L, sortaux, 3);
+  lua_replace(L, 2);
+}
+
+
+/*
+** table.sort(t [, comp [, key]]): 'comp' may be an order function or
+** one of the names "asc" and "desc"; with a 'key' function, elements
+** are ordered by their keys. When no order function is given and the
+** values that define the order are all numbers or all strings in the
+** array part, the core sorts them directly.
+*/
 static int sort (lua_State *L) {
   lua_Integer n = aux_getn(L, 1, TAB_RW);
   if (n > 1) {  /* non-trivial interval? */
+    int how;
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
     luaL_checkstack(L, 40, "");  /* assume array is smaller than 2^40 */
-    if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
-      luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
+    lua_settop(L, 3);
+    how = getorder(L, 2);
+    if (!lua_isnil(L, 3)) {  /* is there a key function? */
+      luaL_checktype(L, 3, LUA_TFUNCTION);
+      sortbykey(L, n, how);
+      return 0;
+    }
     lua_settop(L, 2);  /* make sure there are two arguments */
+    if (lua_isnil(L, 2) && lua_sortarray(L, 1, n, 0, how))
+      return 0;  /* sorted by the core */
+    if (how & LUA_SORTDESC)
+      descorder(L);
     auxsort(L, 1, (unsigned int)n, 0u);
   }
   return 0;
 }
 
+
+/*
+** Generic stable sort of t[1 .. n]: bottom-up merge sort between two
+** scratch tables, comparing with 'sort_comp'.
+*/
+static void auxstablesort (lua_State *L, lua_Integer n) {
+  lua_Integer i, w;
+  int src = 3, dst = 4;
+  lua_createtable(L, (int)n, 0);  /* 3 */
+  lua_createtable(L, (int)n, 0);  /* 4 */
+  for (i = 1; i <= n; i++) {
+    lua_geti(L, 1, i);
+    lua_rawseti(L, src, i);
+  }
+  for (w = 1; w < n; w *= 2) {  /* merge pairs of runs with 'w' elements */
+    lua_Integer lo;
+    for (lo = 1; lo <= n; lo += 2 * w) {
+      lua_Integer mid = (w < n - lo + 1) ? lo + w : n + 1;
+      lua_Integer hi = (2 * w < n - lo + 1) ? lo + 2 * w : n + 1;
+      lua_Integer j = mid, k = lo;
+      i = lo;
+      while (i < mid && j < hi) {
+        lua_rawgeti(L, src, i);
+        lua_rawgeti(L, src, j);
+        if (sort_comp(L, -1, -2)) {  /* right element goes first? */
+          lua_rawseti(L, dst, k++);
+          lua_pop(L, 1);
+          j++;
+        }
+        else {  /* equal elements keep their order */
+          lua_pop(L, 1);
+          lua_rawseti(L, dst, k++);
+          i++;
+        }
+      }
+      for (; i < mid; i++) {
+        lua_rawgeti(L, src, i);
+        lua_rawseti(L, dst, k++);
+      }
+      for (; j < hi; j++) {
+        lua_rawgeti(L, src, j);
+        lua_rawseti(L, dst, k++);
+      }
+    }
+    src = 7 - src; dst = 7 - dst;  /* swap tables */
+  }
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, src, i);
+    lua_seti(L, 1, i);
+  }
+}
+
+
+/*
+** table.stablesort(t [, comp]): like 'table.sort', but elements that
+** are equal keep their relative order. Arrays of numbers or strings are
+** sorted by the core with a natural merge sort.
+*/
+static int stablesort (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  if (n > 1) {  /* non-trivial interval? */
+    int how;
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    lua_settop(L, 2);
+    how = getorder(L, 2) | LUA_SORTSTABLE;
+    if (lua_isnil(L, 2) && lua_sortarray(L, 1, n, 0, how))
+      return 0;  /* sorted by the core */
+    if (how & LUA_SORTDESC)
+      descorder(L);
+    auxstablesort(L, n);
+  }
+  return 0;
+}
+
+
+/* sift down element 'i' of the max-heap with 'n' elements at index 3 */
+static void heapdown (lua_State *L, lua_Integer i, lua_Integer n) {
+  for (;;) {
+    lua_Integer c = 2 * i;  /* first child */
+    if (c > n) break;
+    lua_rawgeti(L, 3, c);
+    if (c < n) {
+      lua_rawgeti(L, 3, c + 1);
+      if (sort_comp(L, -2, -1)) {  /* first child < second child? */
+        lua_remove(L, -2);
+        c++;
+      }
+      else
+        lua_pop(L, 1);
+    }
+    lua_rawgeti(L, 3, i);
+    if (!sort_comp(L, -1, -2)) {  /* not smaller than its greater child? */
+      lua_pop(L, 2);
+      break;
+    }
+    lua_rawseti(L, 3, c);  /* element goes down... */
+    lua_rawseti(L, 3, i);  /* ...and the child goes up */
+    i = c;
+  }
+}
+
+
+/*
+** Generic partial sort of t[1 .. n], in O(n log k): keeps the 'k'
+** smallest elements in a max-heap (at index 3) and the others in a list
+** (at index 4); then t[1 .. k] gets the heap in order, followed by the
+** other elements.
+*/
+static void auxpartialsort (lua_State *L, lua_Integer n, lua_Integer k) {
+  lua_Integer i;
+  lua_Integer nrest = 0;  /* number of elements in the list */
+  lua_createtable(L, (int)k, 0);  /* 3: heap */
+  lua_createtable(L, (int)(n - k), 0);  /* 4: other elements */
+  for (i = 1; i <= k; i++) {
+    lua_geti(L, 1, i);
+    lua_rawseti(L, 3, i);
+  }
+  for (i = k / 2; i >= 1; i--)
+    heapdown(L, i, k);
+  for (i = k + 1; i <= n; i++) {
+    lua_geti(L, 1, i);
+    lua_rawgeti(L, 3, 1);
+    if (sort_comp(L, -2, -1)) {  /* t[i] smaller than the heap's top? */
+      lua_rawseti(L, 4, ++nrest);  /* top leaves the heap... */
+      lua_rawseti(L, 3, 1);  /* ...and t[i] takes its place */
+      heapdown(L, 1, k);
+    }
+    else {
+      lua_pop(L, 1);
+      lua_rawseti(L, 4, ++nrest);
+    }
+  }
+  for (i = k; i >= 1; i--) {  /* take elements from the heap, largest first */
+    lua_rawgeti(L, 3, 1);
+    lua_seti(L, 1, i);
+    lua_rawgeti(L, 3, i);
+    lua_rawseti(L, 3, 1);
+    heapdown(L, 1, i - 1);
+  }
+  for (i = 1; i <= nrest; i++) {
+    lua_rawgeti(L, 4, i);
+    lua_seti(L, 1, k + i);
+  }
+}
+
+
+/*
+** table.partialsort(t, k [, comp]): puts the 'k' smallest elements of
+** 't' (by the order 'comp', as in 'table.sort') in order at t[1 .. k];
+** the others follow in no particular order.
+*/
+static int partialsort (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  lua_Integer k = luaL_checkinteger(L, 2);
+  int how;
+  luaL_argcheck(L, k >= 0, 2, "must be non-negative");
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  if (k > n) k = n;
+  lua_settop(L, 3);
+  how = getorder(L, 3) | LUA_SORTPARTIAL;
+  lua_settop(L, 2);
+  if (k > 0 && n > 1) {  /* non-trivial interval? */
+    if (lua_isnil(L, 2) && lua_selectarray(L, 1, n, k, how))
+      return 0;  /* done by the core */
+    if (how & LUA_SORTDESC)
+      descorder(L);
+    auxpartialsort(L, n, k);
+  }
+  return 0;
+}
+
+
+/*
+** Generic selection (introselect): partitions as 'auxsort' does, but
+** keeps only the interval holding position 'k', so it takes linear time
+** on average. After more than log2(n) imbalanced partitions, it sorts
+** what is left, bounding the worst case to that of 'auxsort'.
+*/
+static void auxselect (lua_State *L, unsigned int lo, unsigned int up,
+                                     unsigned int k) {
+  unsigned int rnd = 0;
+  unsigned int m;
+  int badlimit = 0;
+  for (m = up - lo; m > 0; m >>= 1)
+    badlimit++;
+  while (lo < up) {
+    unsigned int p = sortpartition(L, lo, up, rnd);  /* Pivot index */
+    unsigned int n;  /* size of the discarded interval */
+    if (p == 0 || p == k)  /* sorted or pivot in place? */
+      return;
+    if (k < p) {
+      n = up - p + 1;
+      up = p - 1;
+    }
+    else {
+      n = p - lo + 1;
+      lo = p + 1;
+    }
+    if ((up - lo) / 128u > n) {  /* partition too imbalanced? */
+      rnd = l_randomizePivot();  /* try a new randomization */
+      if (--badlimit < 0) {  /* still going badly? */
+        auxsort(L, lo, up, rnd);
+        return;
+      }
+    }
+  }
+}
+
+
+/*
+** table.select(t, k [, comp]): moves to t[k] the element that would be
+** there if 't' were sorted (by the order 'comp', as in 'table.sort'),
+** with no greater element before it and no smaller one after it, and
+** returns it.
+*/
+static int tselect (lua_State *L) {
+  lua_Integer n = aux_getn(L, 1, TAB_RW);
+  lua_Integer k = luaL_checkinteger(L, 2);
+  int how;
+  luaL_argcheck(L, 1 <= k && k <= n, 2, "position out of bounds");
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  lua_settop(L, 3);
+  how = getorder(L, 3);
+  lua_settop(L, 2);
+  if (!(lua_isnil(L, 2) && lua_selectarray(L, 1, n, k, how))) {
+    if (how & LUA_SORTDESC)
+      descorder(L);
+    luaL_checkstack(L, 40, "");  /* as in 'sort' */
+    auxselect(L, 1, (unsigned int)n, (unsigned int)k);
+  }
+  lua_geti(L, 1, k);
+  return 1;
+}
+
 /* }====================================================== */
 
 
 static const luaL_Reg tab_funcs[] = {
+  {"clear", tclear},
   {"concat", tconcat},
+  {"freeze", tfreeze},
+  {"isfrozen", tisfrozen},
 #if defined(LUA_COMPAT_MAXN)
   {"maxn", maxn},
 #endif
@@ -432,7 +886,10 @@ static const luaL_Reg tab_funcs[] = {
   {"unpack", unpack},
   {"remove", tremove},
   {"move", tmove},
+  {"partialsort", partialsort},
+  {"select", tselect},
   {"sort", sort},
+  {"stablesort", stablesort},
   {NULL, NULL}
 };
 
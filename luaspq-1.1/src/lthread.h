@@ -0,0 +1,112 @@
+/*
+** $Id: lthread.h $
+** System threads used by the garbage collector
+** See Copyright Notice in lua.h
+*/
+
+#ifndef lthread_h
+#define lthread_h
+
+
+#include "llimits.h"
+
+
+#if defined(LUA_USE_GCTHREADS)
+
+/*
+** Atomic accesses to values that other threads may change at the same
+** time. Loads and stores are relaxed: they only avoid torn or
+** reordered-away accesses (plain moves on usual machines).
+*/
+
+#if defined(_MSC_VER)	/* { */
+
+#include <intrin.h>
+
+/* aligned volatile accesses are atomic in MSVC */
+#define l_loadbyte(p)		(*cast(volatile lu_byte *, p))
+#define l_storebyte(p,v)	(*cast(volatile lu_byte *, p) = (v))
+#define l_loadint(p)		(*cast(volatile int *, p))
+#define l_storeint(p,v)		(*cast(volatile int *, p) = (v))
+
+/* atomically replace byte '*p' by 'n' if it is 'o'; true if replaced */
+#define l_casbyte(p,o,n)  \
+	(_InterlockedCompareExchange8(cast(char *, p), cast(char, n), \
+	                              cast(char, o)) == cast(char, o))
+
+#else			/* }{ */
+
+#define l_loadbyte(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define l_storebyte(p,v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define l_loadint(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define l_storeint(p,v)		__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+/* atomically replace byte '*p' by 'n' if it is 'o'; true if replaced */
+#define l_casbyte(p,o,n)	__sync_bool_compare_and_swap(p, o, n)
+
+#endif			/* } */
+
+
+/*
+** Only the collector uses these threads, and never while they could
+** run Lua code: they touch the heap only while the mutator waits for
+** them (or objects already unlinked from every list).
+*/
+
+#if defined(lgc_c)	/* { */
+
+#if defined(_WIN32)	/* { */
+
+#include <windows.h>
+
+typedef HANDLE l_thread;
+typedef CRITICAL_SECTION l_mutex;
+typedef CONDITION_VARIABLE l_cond;
+
+#define l_threadfunc(f,ud)	DWORD WINAPI f (LPVOID ud)
+#define l_threadreturn		return 0
+#define l_threadcreate(t,f,ud)  \
+	((*(t) = CreateThread(NULL, 0, f, (ud), 0, NULL)) != NULL)
+#define l_threadjoin(t)  \
+	(WaitForSingleObject(t, INFINITE), (void)CloseHandle(t))
+
+#define l_mutexinit(m)		InitializeCriticalSection(m)
+#define l_mutexfree(m)		DeleteCriticalSection(m)
+#define l_lock(m)		EnterCriticalSection(m)
+#define l_unlock(m)		LeaveCriticalSection(m)
+
+#define l_condinit(c)		InitializeConditionVariable(c)
+#define l_condfree(c)		((void)(c))
+#define l_condwait(c,m)		SleepConditionVariableCS(c, m, INFINITE)
+#define l_condbroadcast(c)	WakeAllConditionVariable(c)
+
+#else			/* }{ */
+
+#include <pthread.h>
+
+typedef pthread_t l_thread;
+typedef pthread_mutex_t l_mutex;
+typedef pthread_cond_t l_cond;
+
+#define l_threadfunc(f,ud)	void *f (void *ud)
+#define l_threadreturn		return NULL
+#define l_threadcreate(t,f,ud)	(pthread_create(t, NULL, f, (ud)) == 0)
+#define l_threadjoin(t)		((void)pthread_join(t, NULL))
+
+#define l_mutexinit(m)		((void)pthread_mutex_init(m, NULL))
+#define l_mutexfree(m)		((void)pthread_mutex_destroy(m))
+#define l_lock(m)		((void)pthread_mutex_lock(m))
+#define l_unlock(m)		((void)pthread_mutex_unlock(m))
+
+#define l_condinit(c)		((void)pthread_cond_init(c, NULL))
+#define l_condfree(c)		((void)pthread_cond_destroy(c))
+#define l_condwait(c,m)		((void)pthread_cond_wait(c, m))
+#define l_condbroadcast(c)	((void)pthread_cond_broadcast(c))
+
+#endif			/* } */
+
+#endif			/* } */
+
+#endif
+
+#endif
@@ -51,6 +51,44 @@
 /* #undef LUA_32BITS */
 
 
+/*
+@@ LUA_NANBOXING packs each value into a single 8-byte word, keeping
+** non-float values in the payload of NaNs. It needs 'double' floats and
+** pointers that fit in 47 bits (user space on 64-bit Linux), and it
+** implies 32-bit integers. 'lua_newstate' returns NULL where pointers
+** do not fit, and a later block that does not is a memory error.
+*/
+/* #undef LUA_NANBOXING */
+
+
+/*
+@@ LUA_USE_SHAPES lets tables built by record constructors ({x=..., y=...})
+** share an immutable key layout (a "shape") and keep only their values.
+** Such tables switch to a regular hash part when they get a key that does
+** not fit (not a short string, or too many keys).
+*/
+/* #undef LUA_USE_SHAPES */
+
+
+/*
+@@ LUA_USE_FULLHASH makes string hashes cover every byte of a string
+** (8 bytes at a time) instead of sampling at most ~32 bytes. It avoids
+** collisions among long strings that share most of their bytes, at the
+** cost of hashing long strings used as keys in full. It needs 'long long'.
+*/
+/* #undef LUA_USE_FULLHASH */
+
+
+/*
+@@ LUA_USE_GCTHREADS lets the collector use helper system threads to
+** mark large heaps in parallel (see 'collectgarbage("setparallel")')
+** and to give dead blocks back to the allocator (LUA_GCSETBGFREE,
+** which the stand-alone interpreter turns on; a host that forks should
+** leave it off). It needs pthreads on POSIX systems.
+*/
+/* #undef LUA_USE_GCTHREADS */
+
+
 /*
 @@ LUA_USE_C89 controls the use of non-ISO-C89 features.
 ** Define it if you want Lua to avoid the use of a few C99 features
@@ -123,6 +161,13 @@
 #endif
 #define LUA_FLOAT_TYPE	LUA_FLOAT_FLOAT
 
+#elif defined(LUA_NANBOXING)	/* }{ */
+/*
+** 32-bit integers (they must fit in a NaN payload) and 'double'
+*/
+#define LUA_INT_TYPE	LUA_INT_INT
+#define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
+
 #elif defined(LUA_C89_NUMBERS)	/* }{ */
 /*
 ** largest types available for C89 ('long' and 'double')
@@ -802,6 +847,10 @@ typedef struct lua_State lua_State;
 #define LUA_MINSTACK	20
 
 
+/* buffer size needed by 'lua_numbertobuff' */
+#define LUA_NUMBUFFSIZE	50
+
+
 /* predefined values in the registry */
 #define LUA_RIDX_MAINTHREAD	1
 #define LUA_RIDX_GLOBALS	2
@@ -948,6 +997,8 @@ LUA_API void        (lua_pushnil) (lua_State *L);
 LUA_API void        (lua_pushnumber) (lua_State *L, lua_Number n);
 LUA_API void        (lua_pushinteger) (lua_State *L, lua_Integer n);
 LUA_API const char *(lua_pushlstring) (lua_State *L, const char *s, size_t len);
+LUA_API const char *(lua_pushsubstr) (lua_State *L, int idx, size_t off,
+                                                             size_t len);
 LUA_API const char *(lua_pushstring) (lua_State *L, const char *s);
 LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
@@ -964,6 +1015,8 @@ LUA_API int   (lua_pushthread) (lua_State *L);
 LUA_API int (lua_getglobal) (lua_State *L, const char *name);
 LUA_API int (lua_gettable) (lua_State *L, int idx);
 LUA_API int (lua_getfield) (lua_State *L, int idx, const char *k);
+LUA_API int (lua_getlfield) (lua_State *L, int idx, const char *k,
+                                                    size_t len);
 LUA_API int (lua_geti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawget) (lua_State *L, int idx);
 LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
@@ -1031,6 +1084,13 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCGEN		10
+#define LUA_GCINC		11
+#define LUA_GCSETMINORMUL	12
+#define LUA_GCSETMAJORMUL	13
+#define LUA_GCSETPARALLEL	14
+/* needs a thread-safe allocator; a negative 'data' forbids it for good */
+#define LUA_GCSETBGFREE		15
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -1042,11 +1102,31 @@ LUA_API int (lua_gc) (lua_State *L, int what, int data);
 LUA_API int   (lua_error) (lua_State *L);
 
 LUA_API int   (lua_next) (lua_State *L, int idx);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx, int keepcap);
+LUA_API void  (lua_freeze) (lua_State *L, int idx);
+LUA_API int   (lua_isfrozen) (lua_State *L, int idx);
+LUA_API int   (lua_movearray) (lua_State *L, int idx1, lua_Integer f,
+                               lua_Integer e, lua_Integer t, int idx2);
+LUA_API int   (lua_pusharray) (lua_State *L, int idx, lua_Integer i,
+                               lua_Integer j);
+LUA_API int   (lua_concatarray) (lua_State *L, int idx, const char *sep,
+                                 size_t lsep, lua_Integer i, lua_Integer j);
+LUA_API int   (lua_sortarray) (lua_State *L, int idx, lua_Integer n,
+                               int kidx, int how);
+LUA_API int   (lua_selectarray) (lua_State *L, int idx, lua_Integer n,
+                                 lua_Integer k, int how);
+
+/* options for 'lua_sortarray' and 'lua_selectarray' */
+#define LUA_SORTDESC	1	/* descending order */
+#define LUA_SORTSTABLE	2	/* equal elements keep their order */
+#define LUA_SORTPARTIAL	4	/* 'lua_selectarray' also sorts t[1 .. k] */
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
+LUA_API size_t   (lua_numbertobuff) (lua_State *L, int idx, char *buff,
+                                     int prec);
 
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
@@ -18,6 +18,7 @@
 
 #include "lua.h"
 
+#include "lctype.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -35,6 +36,10 @@
 #define MAXTAGLOOP	2000
 
 
+/* maximum length of a numeral inside a slice (see 'l_strton') */
+#define MAXSLICENUM	200
+
+
 
 /*
 ** 'l_intfitsf' checks whether a given integer can be converted to a
@@ -65,6 +70,30 @@
 
 
 
+/*
+** Converts string 'obj' to a number in 'result', returning true on
+** success. 'luaO_str2num' needs a '\0' after the numeral, which a slice
+** may not have; so, such a numeral is first copied to a buffer, without
+** its surrounding spaces. (Numerals longer than MAXSLICENUM are not
+** converted.)
+*/
+static int l_strton (const TValue *obj, TValue *result) {
+  TString *ts = tsvalue(obj);
+  const char *s = getstr(ts);
+  size_t l = tsslen(ts);
+  char buff[MAXSLICENUM + 1];
+  if (isterminated(ts))
+    return (luaO_str2num(s, result) == l + 1);
+  while (l > 0 && lisspace(cast_uchar(*s))) { s++; l--; }
+  while (l > 0 && lisspace(cast_uchar(s[l - 1]))) l--;
+  if (l > MAXSLICENUM)
+    return 0;  /* too long to be a numeral */
+  memcpy(buff, s, l * sizeof(char));
+  buff[l] = '\0';
+  return (luaO_str2num(buff, result) == l + 1);
+}
+
+
 /*
 ** Try to convert a value to a float. The float case is already handled
 ** by the macro 'tonumber'.
@@ -76,7 +105,7 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
     return 1;
   }
   else if (cvt2num(obj) &&  /* string convertible to number? */
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+            l_strton(obj, &v)) {
     *n = nvalue(&v);  /* convert result of 'luaO_str2num' to a float */
     return 1;
   }
@@ -108,8 +137,7 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
     *p = ivalue(obj);
     return 1;
   }
-  else if (cvt2num(obj) &&
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+  else if (cvt2num(obj) && l_strton(obj, &v)) {
     obj = &v;
     goto again;  /* convert result from 'luaO_str2num' to an integer */
   }
@@ -190,14 +218,14 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
     const TValue *tm;
     if (oldval != NULL) {
-      lua_assert(ttistable(t) && ttisnil(oldval));
-      /* must check the metamethod */
-      if ((tm = fasttm(L, hvalue(t)->metatable, TM_NEWINDEX)) == NULL &&
-         /* no metamethod; is there a previous entry in the table? */
-         (oldval != luaO_nilobject ||
-         /* no previous entry; must create one. (The next test is
-            always true; we only need the assignment.) */
-         (oldval = luaH_newkey(L, hvalue(t), key), 1))) {
+      lua_assert(ttistable(t) && (ttisnil(oldval) || isfrozen(hvalue(t))));
+      /* must check the metamethod (only for absent entries) */
+      if (!ttisnil(oldval) ||
+          (tm = fasttm(L, hvalue(t)->metatable, TM_NEWINDEX)) == NULL) {
+        checkwritable(L, hvalue(t));
+        /* no metamethod; is there a previous entry in the table? */
+        if (oldval == luaO_nilobject)  /* no; must create one */
+          oldval = luaH_newkey(L, hvalue(t), key);
         /* no metamethod and (now) there is an entry with given key */
         setobj2t(L, cast(TValue *, oldval), val);
         invalidateTMcache(hvalue(t));
@@ -231,7 +259,7 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 ** and it uses 'strcoll' (to respect locales) for each segments
 ** of the strings.
 */
-static int l_strcmp (const TString *ls, const TString *rs) {
+int luaV_strcmp (const TString *ls, const TString *rs) {
   const char *l = getstr(ls);
   size_t ll = tsslen(ls);
   const char *r = getstr(rs);
@@ -351,8 +379,11 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LTnum(l, r);
-  else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) < 0;
+  else if (ttisstring(l) && ttisstring(r)) {  /* both are strings? */
+    luaS_terminate(L, tsvalue(l));  /* 'luaV_strcmp' needs the '\0's */
+    luaS_terminate(L, tsvalue(r));
+    return luaV_strcmp(tsvalue(l), tsvalue(r)) < 0;
+  }
   else if ((res = luaT_callorderTM(L, l, r, TM_LT)) < 0)  /* no metamethod? */
     luaG_ordererror(L, l, r);  /* error */
   return res;
@@ -371,8 +402,11 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
   if (ttisnumber(l) && ttisnumber(r))  /* both operands are numbers? */
     return LEnum(l, r);
-  else if (ttisstring(l) && ttisstring(r))  /* both are strings? */
-    return l_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+  else if (ttisstring(l) && ttisstring(r)) {  /* both are strings? */
+    luaS_terminate(L, tsvalue(l));  /* 'luaV_strcmp' needs the '\0's */
+    luaS_terminate(L, tsvalue(r));
+    return luaV_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+  }
   else if ((res = luaT_callorderTM(L, l, r, TM_LE)) >= 0)  /* try 'le' */
     return res;
   else {  /* try 'lt': */
@@ -850,6 +884,10 @@ void luaV_execute (lua_State *L) {
         int c = GETARG_C(i);
         Table *t = luaH_new(L);
         sethvalue(L, ra, t);
+#if defined(LUA_USE_SHAPES)
+        if (c != 0)  /* constructor has record fields? */
+          luaH_setshape(L, t);  /* share its keys with similar tables */
+#endif
         if (b != 0 || c != 0)
           luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
         checkGC(L, ra + 1);
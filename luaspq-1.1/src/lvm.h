@@ -74,15 +74,16 @@
 ** Fast track for set table. If 't' is a table and 't[k]' is not nil,
 ** call GC barrier, do a raw 't[k]=v', and return true; otherwise,
 ** return false with 'slot' equal to NULL (if 't' is not a table) or
-** 'nil'. (This is needed by 'luaV_finishget'.) Note that, if the macro
-** returns true, there is no need to 'invalidateTMcache', because the
-** call is not creating a new entry.
+** 'nil' (or anything, if 't' is frozen). (This is needed by
+** 'luaV_finishget'.) Note that, if the macro returns true, there is no
+** need to 'invalidateTMcache', because the call is not creating a new
+** entry.
 */
 #define luaV_fastset(L,t,k,slot,f,v) \
   (!ttistable(t) \
    ? (slot = NULL, 0) \
    : (slot = f(hvalue(t), k), \
-     ttisnil(slot) ? 0 \
+     (ttisnil(slot) || isfrozen(hvalue(t))) ? 0 \
      : (luaC_barrierback(L, hvalue(t), v), \
         setobj2t(L, cast(TValue *,slot), v), \
         1)))
@@ -95,6 +96,7 @@
 
 
 LUAI_FUNC int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2);
+LUAI_FUNC int luaV_strcmp (const TString *ls, const TString *rs);
 LUAI_FUNC int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r);
 LUAI_FUNC int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r);
 LUAI_FUNC int luaV_tonumber_ (const TValue *obj, lua_Number *n);